@@ -3,6 +3,7 @@
 
 #include <conio.h>
 #include <stdio.h>
+#include <float.h>
 
 #include "src/common.h"
 #include "src/time.h"
@@ -11,12 +12,23 @@
 #include "src/thread.h"
 #include "src/signal.h"
 #include "src/blockallocator.h"
+#include "src/sizeclassallocator.h"
+#include "src/linearallocator.h"
 #include "src/ts_queue.h"
+#include "src/mpmc_queue.h"
 #include "src/vec3.h"
 #include "src/random.h"
 
 #include "src/profile.h"
 #include "src/job.h"
+#include "src/job_parallel.h"
+#include "src/job_coroutine.h"
+#include "src/job_graph.h"
+#include "src/job_trace.h"
+#include "src/job_arena.h"
+#include "src/job_io.h"
+#include "src/job_metrics.h"
+#include "src/cpu_topology.h"
 
 
 
@@ -63,6 +75,13 @@ struct particle_t
       }
 };
 
+//--------------------------------------------------------------------
+struct particle_bounds_t
+{
+   vec3 mins;
+   vec3 maxs;
+};
+
 //--------------------------------------------------------------------
 static void UpdateParticles( particle_t *particles, uint const count, float const dt ) 
 {
@@ -72,22 +91,34 @@ static void UpdateParticles( particle_t *particles, uint const count, float cons
 }
 
 //--------------------------------------------------------------------
-// So this one works differently - instead of us giving the thread a 
-// chunk of work to do, this will pull chunks of work itself until it detects no 
-// work is left.
-static void UpdateParticlesInChunks( particle_t *particles, uint *idx_ptr, float dt, uint total ) 
+// summed in double - 10 million floats added up in a float loses most of them
+static double GetKineticEnergy( particle_t const *particles, uint const count )
 {
-   uint const STEP_SIZE = 4096;
-   
-   uint idx = AtomicAdd( idx_ptr, STEP_SIZE ) - STEP_SIZE; 
-   while (idx < total) {
-      uint stop = min( total, idx + STEP_SIZE );
-      for (uint i = idx; i < stop; ++i) {
-         particles[idx].update(dt);
-      }
+   double energy = 0.0;
+   for (uint i = 0; i < count; ++i) {
+      energy += 0.5 * (double)particles[i].vel.magnitude2();
+   }
+   return energy;
+}
 
-      idx = AtomicAdd( idx_ptr, STEP_SIZE ) - STEP_SIZE; 
+//--------------------------------------------------------------------
+static particle_bounds_t CombineBounds( particle_bounds_t const &a, particle_bounds_t const &b )
+{
+   particle_bounds_t r;
+   r.mins = vec3( (a.mins.x < b.mins.x) ? a.mins.x : b.mins.x, (a.mins.y < b.mins.y) ? a.mins.y : b.mins.y, (a.mins.z < b.mins.z) ? a.mins.z : b.mins.z );
+   r.maxs = vec3( (a.maxs.x > b.maxs.x) ? a.maxs.x : b.maxs.x, (a.maxs.y > b.maxs.y) ? a.maxs.y : b.maxs.y, (a.maxs.z > b.maxs.z) ? a.maxs.z : b.maxs.z );
+   return r;
+}
+
+//--------------------------------------------------------------------
+static particle_bounds_t GetBounds( particle_t const *particles, uint const count )
+{
+   particle_bounds_t bounds = { vec3( FLT_MAX ), vec3( -FLT_MAX ) };
+   for (uint i = 0; i < count; ++i) {
+      particle_bounds_t point = { particles[i].pos, particles[i].pos };
+      bounds = CombineBounds( bounds, point );
    }
+   return bounds;
 }
 
 //--------------------------------------------------------------------
@@ -139,7 +170,29 @@ int main( int argc, char const *argv[] )
    EventTest();
    pause();
 
+   SignalPingPongTest();
+   MPMCQueueTest();
+   SizeClassAllocatorTest();
+   LinearAllocatorTest();
+   MemoryTrackingTest();
    JobSystemTest();
+   JobDispatchBatchTest();
+   JobHandleTest();
+   JobLambdaTest();
+   JobCancelTest();
+   JobArenaTest();
+   JobIOTest();
+   JobMetricsTest();
+   JobSystemScalingTest();
+   JobParallelForTest();
+   JobParallelReduceTest();
+   JobWaitTest();
+   JobPriorityTest();
+   JobCoroutineTest();
+   JobGraphTest();
+   JobSystemRestartTest();
+   JobTraceTest();
+   pause();
 
 
 
@@ -148,7 +201,6 @@ int main( int argc, char const *argv[] )
 
 
    uint const NUM_TESTS = 10;
-   uint const NUM_THREADS = 8;
 
    uint const CONTENDING_THREADS = 0;
    uint const MAX_PRIMES = 100000; // in release, calculating 100000 primes took 18 seconds
@@ -210,83 +262,79 @@ int main( int argc, char const *argv[] )
    printf( "\n" );
 
 
-   float dt = 0.0f;
-   for (uint testi = 0; testi < NUM_TESTS; ++testi) {
-      // Okay, so going for 60 frames per second.
-      // add some noise to it to prevent compiler from optimizing for a constnat;
-      dt = (1.0f / 60.0f) + RandomFl( -0.001f, 0.001f );
+   CpuTopologyPrint();
 
-      // sample 0 - main thread test
-      {
-         PROFILE_LOG_SCOPE("Particles Update :: Main Thread");
-         UpdateParticles( particles, NUM_PARTICLES, dt );
-      }
-
-      // sample 1 : single thread test - benchmark - how much does just spinning up a thread add?
-      // and splitting the load.
-      {
-         PROFILE_LOG_SCOPE("Particle Update :: One Thread");
-         // Okay, let's try something else;
-         // sample 1 - single thread
-         uint thread_part_count = NUM_PARTICLES / 2;
-         thread_handle_t th = ThreadCreate( UpdateParticles, particles, thread_part_count, dt );
+   // once with the workers left to the OS, once pinned one per core
+   for (uint pinned = 0; pinned < 2; ++pinned) {
+      printf( "== workers %s ==\n", pinned ? "pinned" : "unpinned" );
+      JobSystemStartup( JOB_TYPE_COUNT, -1, pinned ? JOB_SYSTEM_DEFAULT_FLAGS : JOB_SYSTEM_FLAG_WORK_STEALING );
 
-         // while they're doing work - we should do work too! 
-         UpdateParticles( particles + thread_part_count, NUM_PARTICLES - thread_part_count, dt );
+      float dt = 0.0f;
+      for (uint testi = 0; testi < NUM_TESTS; ++testi) {
+         // Okay, so going for 60 frames per second.
+         // add some noise to it to prevent compiler from optimizing for a constnat;
+         dt = (1.0f / 60.0f) + RandomFl( -0.001f, 0.001f );
 
-         ThreadJoin(th);
-      }
-
-      // sample 2 : multi thread test - benchmark - how much does just spinning up a thread add?
-      // Okay, this is worse - but as our "update" function gets more complicated, this starts getting better
-      // meaning memory contention is likely our issue;
-      {
-         PROFILE_LOG_SCOPE("Particle Update :: MultiThread");
-         thread_handle_t threads[NUM_THREADS];
-         uint thread_part_count = NUM_PARTICLES / (NUM_THREADS + 1); // +1 because the main thread is going to do some work too.
-         uint start_idx = 0;
-
-         for (uint i = 0; i < NUM_THREADS; ++i) {
-            threads[i] = ThreadCreate( UpdateParticles, particles + start_idx, thread_part_count, dt );
-            start_idx += thread_part_count;
+         // sample 0 - main thread test
+         {
+            PROFILE_LOG_SCOPE("Particles Update :: Main Thread");
+            UpdateParticles( particles, NUM_PARTICLES, dt );
          }
 
-         // while they're doing work - we should do work too! So do the remaining.
-         UpdateParticles( particles + start_idx, NUM_PARTICLES - start_idx, dt );
-
-         // wait for everyone to finish
-         ThreadJoin( threads, NUM_THREADS );
-      }
-
-      // sample 3 : multi thread test - benchmark - how much does just spinning up a thread add?
-      // Okay, this is worse - but as our "update" function gets more complicated, this starts getting better
-      // meaning memory contention is likely our issue;
-      {
-         PROFILE_LOG_SCOPE("Particle Update :: Chunked");
-
-         // Okay, let's try something else;
-         thread_handle_t threads[NUM_THREADS];
-         uint idx = 0;
+         // sample 1 : job system - the range is split up recursively with the grain picked 
+         // from how long a single update takes, and this thread helps out until it's done.
+         {
+            PROFILE_LOG_SCOPE("Particle Update :: JobParallelFor");
+            JobParallelForRange( 0, NUM_PARTICLES, [=]( uint begin, uint end ) {
+               UpdateParticles( particles + begin, end - begin, dt );
+            });
+         }
 
-         for (uint i = 0; i < NUM_THREADS; ++i) {
-            threads[i] = ThreadCreate( UpdateParticlesInChunks, particles, &idx, dt, NUM_PARTICLES );
+         // sample 2 : total energy and bounds of the set - serial, then per block and combined.
+         double serial_energy;
+         {
+            PROFILE_LOG_SCOPE("Particle Energy :: Main Thread");
+            serial_energy = GetKineticEnergy( particles, NUM_PARTICLES );
          }
 
-         // while they're doing work - we should do work too! So do the remaining.
-         UpdateParticlesInChunks( particles, &idx, dt, NUM_PARTICLES );
+         double energy;
+         {
+            PROFILE_LOG_SCOPE("Particle Energy :: JobParallelReduce");
+            energy = JobParallelReduce( 0, NUM_PARTICLES, 0.0, 
+               [=]( uint begin, uint end ) { return GetKineticEnergy( particles + begin, end - begin ); },
+               []( double a, double b ) { return a + b; } );
+         }
 
-         // wait for everyone to finish - just because I ran out of work doesn't mean they're down with their acquired chunks
-         ThreadJoin( threads, NUM_THREADS );
+         particle_bounds_t bounds;
+         {
+            PROFILE_LOG_SCOPE("Particle Bounds :: JobParallelReduce");
+            particle_bounds_t const empty = { vec3( FLT_MAX ), vec3( -FLT_MAX ) };
+            bounds = JobParallelReduce( 0, NUM_PARTICLES, empty, 
+               [=]( uint begin, uint end ) { return GetBounds( particles + begin, end - begin ); },
+               CombineBounds );
+         }
+         printf( "energy %.1f [serial %.1f], bounds (%.1f, %.1f, %.1f) to (%.1f, %.1f, %.1f)\n", 
+            energy, serial_energy, 
+            bounds.mins.x, bounds.mins.y, bounds.mins.z, 
+            bounds.maxs.x, bounds.maxs.y, bounds.maxs.z );
+
+         // new line - space out each test.
+         printf("\n");
+         ProfileMemoryFrameTick();
       }
 
-      // new line - space out each test.
-      printf("\n");
+      printf( "JobParallelFor grain: %u particles\n", JobParallelForGetLastGrain() );
+      JobSystemShutdown();
    }
 
 
    // a single update is about 4ms on my machine;
    pause();
 
+#if MEMORY_TRACKING
+   PrintLiveAllocations();
+#endif
+
    delete[] particles;
    return 0;
 }
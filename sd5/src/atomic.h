@@ -59,6 +59,20 @@ uint CompareAndSet( uint volatile *ptr, uint const comparand, uint const value )
    return ::InterlockedCompareExchange( ptr, value, comparand );
 }
 
+//--------------------------------------------------------------------
+__forceinline 
+uint64_t AtomicAdd64( uint64_t volatile *ptr, uint64_t const value ) 
+{
+   return (uint64_t) ::InterlockedAdd64( (LONGLONG volatile*)ptr, (LONGLONG)value );
+}
+
+//--------------------------------------------------------------------
+__forceinline 
+uint64_t CompareAndSet64( uint64_t volatile *ptr, uint64_t const comparand, uint64_t const value )
+{
+   return (uint64_t) ::InterlockedCompareExchange64( (LONGLONG volatile*)ptr, (LONGLONG)value, (LONGLONG)comparand );
+}
+
 //--------------------------------------------------------------------
 __forceinline 
 bool CompareAndSet128( uint64_t volatile data[2], uint64_t comparand[2], uint64_t value[2] )
@@ -4,10 +4,14 @@
 /*                                                                      */
 /************************************************************************/
 #include "blockallocator.h"
+#include "sizeclassallocator.h"
+
+#include <Windows.h>
 
 #include "profile.h"
+#include "time.h"
 #include "thread.h"
-#include "ts_queue.h"
+#include "mpmc_queue.h"
 
 /************************************************************************/
 /*                                                                      */
@@ -32,18 +36,117 @@
 /* STRUCTS                                                              */
 /*                                                                      */
 /************************************************************************/
+// A thread's pair of magazines for one MagazineBlockAllocator
+struct block_magazine_cache_t
+{
+   uint generation;              // of the allocator these came from - 0 if none
+   block_magazine_t *loaded;
+   block_magazine_t *previous;
+};
+
+//--------------------------------------------------------------------
+struct block_magazine_thread_t
+{
+   block_magazine_cache_t caches[BLOCK_MAGAZINE_MAX_ALLOCATORS];
+   bool exited;                  // anything after this goes straight to the depot
+
+   // thread is going away - give everything back
+   ~block_magazine_thread_t();
+};
 
 /************************************************************************/
 /*                                                                      */
 /* CLASSES                                                              */
 /*                                                                      */
 /************************************************************************/
-class SystemAllocator : public IAllocator 
+//--------------------------------------------------------------------
+BlockSlabList::BlockSlabList( size_t block_size, eBlockGrowth g )
 {
-   public:
-      void* alloc( size_t size ) { return ::malloc(size); }
-      void free( void *ptr ) { return ::free(ptr); }
-};
+   stride = (block_size + BLOCK_ALIGNMENT - 1) & ~((size_t)BLOCK_ALIGNMENT - 1);
+   growth = g;
+   next_size = BLOCK_SLAB_GRANULARITY;
+   alignment = 0;
+   tag = 0;
+   slabs = nullptr;
+
+   slab_count = 0;
+   block_count = 0;
+   total_bytes = 0;
+}
+
+//--------------------------------------------------------------------
+BlockSlabList::~BlockSlabList()
+{
+   block_slab_header_t *slab = slabs;
+   while (nullptr != slab) {
+      block_slab_header_t *next = slab->next;
+      BlockSlabRelease( slab->base );
+      slab = next;
+   }
+   slabs = nullptr;
+}
+
+//--------------------------------------------------------------------
+void BlockSlabList::align_slabs( size_t a, uint t )
+{
+   alignment = a;
+   tag = t;
+   next_size = a;
+}
+
+//--------------------------------------------------------------------
+void* BlockSlabList::grow( uint min_count, void **out_last )
+{
+   if ((BLOCK_GROWTH_NONE == growth) && (nullptr != slabs)) {
+      return nullptr;
+   }
+
+   size_t size = next_size;
+   size_t const needed = BLOCK_SLAB_HEADER_SIZE + (stride * min_count);
+   if (needed > size) {
+      if (0 != alignment) {
+         // aligned slabs can't be any bigger - that many blocks need more of them
+         if ((BLOCK_SLAB_HEADER_SIZE + stride) > alignment) {
+            return nullptr;
+         }
+      } else {
+         size = (needed + BLOCK_SLAB_GRANULARITY - 1) & ~((size_t)BLOCK_SLAB_GRANULARITY - 1);
+      }
+   }
+
+   void *base;
+   byte_t *mem = (byte_t*) BlockSlabReserve( size, alignment, &base );
+   if (nullptr == mem) {
+      return nullptr;
+   }
+
+   block_slab_header_t *slab = (block_slab_header_t*)mem;
+   slab->base = base;
+   slab->size = size;
+   slab->tag = tag;
+   slab->next = slabs;
+   slabs = slab;
+
+   uint const count = (uint)((size - BLOCK_SLAB_HEADER_SIZE) / stride);
+   byte_t *first = mem + BLOCK_SLAB_HEADER_SIZE;
+   for (uint i = 0; i < count - 1; ++i) {
+      *(void**)(first + (i * stride)) = first + ((i + 1) * stride);
+   }
+
+   byte_t *last = first + ((count - 1) * stride);
+   *(void**)last = nullptr;
+   *out_last = last;
+
+   ++slab_count;
+   block_count += count;
+   total_bytes += size;
+
+   if ((BLOCK_GROWTH_DOUBLE == growth) && (0 == alignment)) {
+      next_size = (next_size * 2 < BLOCK_SLAB_MAX_SIZE) ? (next_size * 2) : BLOCK_SLAB_MAX_SIZE;
+   }
+
+   return first;
+}
 
 /************************************************************************/
 /*                                                                      */
@@ -58,7 +161,15 @@ static BlockAllocator gBlockAllocator(BLOCK_SIZE);
 static ThreadSafeBlockAllocator gTSBlockAllocator(BLOCK_SIZE);
 static LocklessBlockAllocator gLFBlockAllocator(BLOCK_SIZE);
 
-static ThreadSafeQueue<void*> gQueues[NUM_QUEUES];
+static MPMCQueue<void*> gQueues[NUM_QUEUES];
+
+// every live MagazineBlockAllocator, by slot [the lock is made on first use - these
+// can be made from operator new before this file's statics are]
+static MagazineBlockAllocator *gMagazineAllocators[BLOCK_MAGAZINE_MAX_ALLOCATORS];
+static uint gMagazineGeneration = 0;
+
+static thread_local block_magazine_thread_t tMagazines;
+static MagazineBlockAllocator gMagBlockAllocator(BLOCK_SIZE);
 
 /************************************************************************/
 /*                                                                      */
@@ -71,6 +182,13 @@ static ThreadSafeQueue<void*> gQueues[NUM_QUEUES];
 /* LOCAL FUNCTIONS                                                      */
 /*                                                                      */
 /************************************************************************/
+//--------------------------------------------------------------------
+static CriticalSection* GetMagazineLock()
+{
+   static CriticalSection lock;
+   return &lock;
+}
+
 //--------------------------------------------------------------------
 static uint AddBytes( void *ptr )
 {
@@ -100,7 +218,7 @@ static void AllocatorTest( IAllocator *allocator, uint count )
    for (uint i = 0; i < count; ++i) {
 
       int queue_idx = rand() % NUM_QUEUES;
-      ThreadSafeQueue<void*> *q = gQueues + queue_idx;
+      MPMCQueue<void*> *q = gQueues + queue_idx;
 
       if (q->dequeue(&ptr)) {
          value += AddBytes(ptr);
@@ -113,7 +231,7 @@ static void AllocatorTest( IAllocator *allocator, uint count )
 
    // once we're done, make sure all the queues are empty
    for (uint i = 0; i < NUM_QUEUES; ++i) {
-      ThreadSafeQueue<void*> *q = gQueues + i;
+      MPMCQueue<void*> *q = gQueues + i;
       while (q->dequeue(&ptr)) {
          value += AddBytes(ptr);
          allocator->free(ptr); 
@@ -124,13 +242,395 @@ static void AllocatorTest( IAllocator *allocator, uint count )
 }
 #pragma optimize( "", on )  
 
+//--------------------------------------------------------------------
+// Holds more than a magazine's worth at a time, so the magazine allocator
+// has to visit the depot too
+#pragma optimize( "", off )  
+static void BatchTest( IAllocator *allocator, uint count ) 
+{
+   uint const BATCH_SIZE = 48;
+   void *ptrs[BATCH_SIZE];
+
+   for (uint i = 0; i < count; i += BATCH_SIZE) {
+      for (uint j = 0; j < BATCH_SIZE; ++j) {
+         ptrs[j] = allocator->alloc(BLOCK_SIZE);
+         *(uint*)ptrs[j] = j;
+      }
+
+      for (uint j = 0; j < BATCH_SIZE; ++j) {
+         allocator->free( ptrs[j] );
+      }
+   }
+}
+#pragma optimize( "", on )  
+
+//--------------------------------------------------------------------
+// allocs + frees a second, in millions
+static double TimeBatchTest( IAllocator *allocator, uint thread_count, uint count )
+{
+   thread_handle_t threads[64];
+
+   uint64_t const start_op = TimeGetOpCount();
+   for (uint i = 0; i < thread_count; ++i) {
+      threads[i] = ThreadCreate( BatchTest, allocator, count );
+   }
+
+   for (uint i = 0; i < thread_count; ++i) {
+      ThreadJoin( threads[i] );
+   }
+   double const ms = TimeOpCountTo_ms( TimeGetOpCount() - start_op );
+
+   double const ops = 2.0 * (double)count * (double)thread_count;
+   return (ms > 0.0) ? (ops / (ms * 1000.0)) : 0.0;
+}
+
+//--------------------------------------------------------------------
+// count allocations from an empty allocator [cold], then free them all and
+// allocate them again [steady state - everything comes off the free list]
+static void ColdStartTest( char const *name, IAllocator *allocator, uint count )
+{
+   void **ptrs = (void**) ::malloc( sizeof(void*) * count );
+
+   uint64_t start_op = TimeGetOpCount();
+   for (uint i = 0; i < count; ++i) {
+      ptrs[i] = allocator->alloc(BLOCK_SIZE);
+   }
+   uint64_t const cold_op = TimeGetOpCount() - start_op;
+
+   for (uint i = 0; i < count; ++i) {
+      allocator->free( ptrs[i] );
+   }
+
+   start_op = TimeGetOpCount();
+   for (uint i = 0; i < count; ++i) {
+      ptrs[i] = allocator->alloc(BLOCK_SIZE);
+   }
+   uint64_t const steady_op = TimeGetOpCount() - start_op;
+
+   for (uint i = 0; i < count; ++i) {
+      allocator->free( ptrs[i] );
+   }
+   ::free( ptrs );
+
+   printf( "  %-24s cold: %8.3f ms   steady: %8.3f ms\n", name, 
+      TimeOpCountTo_ms(cold_op), 
+      TimeOpCountTo_ms(steady_op) );
+}
+
 /************************************************************************/
 /*                                                                      */
 /* EXTERNAL FUNCTIONS                                                   */
 /*                                                                      */
 /************************************************************************/
+//--------------------------------------------------------------------
+void* BlockSlabReserve( size_t size, size_t alignment, void **out_base )
+{
+   if (alignment <= BLOCK_SLAB_GRANULARITY) {
+      void *mem = ::VirtualAlloc( nullptr, size, MEM_RESERVE | MEM_COMMIT, PAGE_READWRITE );
+      *out_base = mem;
+      return mem;
+   }
+
+   // reserve enough to find an aligned run in, and only commit that
+   byte_t *base = (byte_t*) ::VirtualAlloc( nullptr, size + alignment, MEM_RESERVE, PAGE_NOACCESS );
+   if (nullptr == base) {
+      return nullptr;
+   }
+
+   byte_t *aligned = (byte_t*)(((uintptr_t)base + alignment - 1) & ~((uintptr_t)alignment - 1));
+   if (nullptr == ::VirtualAlloc( aligned, size, MEM_COMMIT, PAGE_READWRITE )) {
+      ::VirtualFree( base, 0, MEM_RELEASE );
+      return nullptr;
+   }
+
+   *out_base = base;
+   return aligned;
+}
+
+//--------------------------------------------------------------------
+void BlockSlabRelease( void *base )
+{
+   ::VirtualFree( base, 0, MEM_RELEASE );
+}
+
+//--------------------------------------------------------------------
+block_magazine_thread_t::~block_magazine_thread_t()
+{
+   ScopedLock<CriticalSection> magazine_lock( GetMagazineLock() );
+   for (uint i = 0; i < BLOCK_MAGAZINE_MAX_ALLOCATORS; ++i) {
+      MagazineBlockAllocator *allocator = gMagazineAllocators[i];
+      if ((nullptr != allocator) && (allocator->generation == caches[i].generation)) {
+         allocator->flush_cache( caches + i );
+      }
+
+      // never matches, so get_cache always takes its slow path from here on
+      caches[i].generation = 0;
+   }
+
+   // other thread_local destructors can still free [or alloc]
+   exited = true;
+}
+
+//--------------------------------------------------------------------
+MagazineBlockAllocator::MagazineBlockAllocator( size_t bs, uint prealloc_count, eBlockGrowth growth )
+   : block_size( (bs > sizeof(void*)) ? bs : sizeof(void*) )
+   , slabs( block_size, growth )
+{
+   full_magazines = nullptr;
+   empty_magazines = nullptr;
+   all_magazines = nullptr;
+   loose = nullptr;
+   depot_trips = 0;
+
+   if (prealloc_count > 0) {
+      void *last;
+      loose = slabs.grow( prealloc_count, &last );
+   }
+
+   ScopedLock<CriticalSection> magazine_lock( GetMagazineLock() );
+   slot = BLOCK_MAGAZINE_MAX_ALLOCATORS;
+   for (uint i = 0; i < BLOCK_MAGAZINE_MAX_ALLOCATORS; ++i) {
+      if (nullptr == gMagazineAllocators[i]) {
+         slot = i;
+         break;
+      }
+   }
+
+   if (slot == BLOCK_MAGAZINE_MAX_ALLOCATORS) {
+      // out of slots - raise BLOCK_MAGAZINE_MAX_ALLOCATORS
+      __debugbreak();
+   }
+
+   gMagazineAllocators[slot] = this;
+   generation = ++gMagazineGeneration;
+}
+
+//--------------------------------------------------------------------
+// Threads still holding magazines from us find out by the generation, and drop them
+MagazineBlockAllocator::~MagazineBlockAllocator()
+{
+   {
+      ScopedLock<CriticalSection> magazine_lock( GetMagazineLock() );
+      gMagazineAllocators[slot] = nullptr;
+   }
+
+   block_magazine_t *mag = all_magazines;
+   while (nullptr != mag) {
+      block_magazine_t *next = mag->all_next;
+      ::free( mag );
+      mag = next;
+   }
+   all_magazines = nullptr;
+}
+
+//--------------------------------------------------------------------
+// nullptr once the thread's caches are gone
+block_magazine_cache_t* MagazineBlockAllocator::get_cache()
+{
+   block_magazine_cache_t *cache = tMagazines.caches + slot;
+   if (cache->generation != generation) {
+      if (tMagazines.exited) {
+         return nullptr;
+      }
+
+      // left over from whoever had the slot before us - its magazines went with it
+      cache->generation = generation;
+      cache->loaded = nullptr;
+      cache->previous = nullptr;
+   }
+
+   return cache;
+}
+
+//--------------------------------------------------------------------
+void* MagazineBlockAllocator::alloc( size_t size )
+{
+   if (size > block_size) {
+      return nullptr; 
+   }
+
+   block_magazine_cache_t *cache = get_cache();
+   if (nullptr == cache) {
+      // thread is on its way out - borrow a magazine just long enough
+      block_magazine_cache_t temp = { generation, nullptr, nullptr };
+      void *ptr = alloc_slow( &temp );
+      flush_cache( &temp );
+      return ptr;
+   }
+
+   block_magazine_t *mag = cache->loaded;
+   if ((nullptr != mag) && (mag->count > 0)) {
+      return mag->rounds[--mag->count];
+   }
+
+   return alloc_slow( cache );
+}
+
+//--------------------------------------------------------------------
+void MagazineBlockAllocator::free( void *ptr )
+{
+   if (nullptr == ptr) {
+      return;
+   }
+
+   block_magazine_cache_t *cache = get_cache();
+   if (nullptr == cache) {
+      block_magazine_cache_t temp = { generation, nullptr, nullptr };
+      free_slow( &temp, ptr );
+      flush_cache( &temp );
+      return;
+   }
+
+   block_magazine_t *mag = cache->loaded;
+   if ((nullptr != mag) && (mag->count < BLOCK_MAGAZINE_SIZE)) {
+      mag->rounds[mag->count++] = ptr;
+      return;
+   }
+
+   free_slow( cache, ptr );
+}
+
+//--------------------------------------------------------------------
+// Loaded is empty
+void* MagazineBlockAllocator::alloc_slow( block_magazine_cache_t *cache )
+{
+   block_magazine_t *prev = cache->previous;
+   if ((nullptr != prev) && (prev->count > 0)) {
+      cache->previous = cache->loaded;
+      cache->loaded = prev;
+      return prev->rounds[--prev->count];
+   }
+
+   // both empty - trade one in for a full one
+   SCOPE_LOCK(depot_lock);
+   ++depot_trips;
+
+   block_magazine_t *full = full_magazines;
+   if (nullptr != full) {
+      full_magazines = full->next;
+   } else {
+      full = fill_magazine();
+      if (nullptr == full) {
+         // growth policy says no
+         return nullptr;
+      }
+   }
+
+   if (nullptr != prev) {
+      prev->next = empty_magazines;
+      empty_magazines = prev;
+   }
+
+   cache->previous = cache->loaded;
+   cache->loaded = full;
+   return full->rounds[--full->count];
+}
+
+//--------------------------------------------------------------------
+// Loaded is full
+void MagazineBlockAllocator::free_slow( block_magazine_cache_t *cache, void *ptr )
+{
+   block_magazine_t *prev = cache->previous;
+   if ((nullptr != prev) && (prev->count < BLOCK_MAGAZINE_SIZE)) {
+      cache->previous = cache->loaded;
+      cache->loaded = prev;
+      prev->rounds[prev->count++] = ptr;
+      return;
+   }
+
+   // both full - trade one in for an empty one
+   SCOPE_LOCK(depot_lock);
+   ++depot_trips;
+
+   if (nullptr != prev) {
+      prev->next = full_magazines;
+      full_magazines = prev;
+   }
+
+   block_magazine_t *empty = get_empty_magazine();
+   cache->previous = cache->loaded;
+   cache->loaded = empty;
+   empty->rounds[empty->count++] = ptr;
+}
+
+//--------------------------------------------------------------------
+block_magazine_t* MagazineBlockAllocator::get_empty_magazine()
+{
+   block_magazine_t *mag = empty_magazines;
+   if (nullptr != mag) {
+      empty_magazines = mag->next;
+      return mag;
+   }
+
+   mag = (block_magazine_t*) ::malloc( sizeof(block_magazine_t) );
+   mag->next = nullptr;
+   mag->count = 0;
+   mag->all_next = all_magazines;
+   all_magazines = mag;
+   return mag;
+}
 
+//--------------------------------------------------------------------
+// No full ones in the depot - load one with blocks that have never been handed out
+block_magazine_t* MagazineBlockAllocator::fill_magazine()
+{
+   block_magazine_t *mag = get_empty_magazine();
+   while (mag->count < BLOCK_MAGAZINE_SIZE) {
+      if (nullptr == loose) {
+         void *last;
+         loose = slabs.grow( 1, &last );
+         if (nullptr == loose) {
+            break;
+         }
+      }
 
+      void *block = loose;
+      loose = *(void**)block;
+      mag->rounds[mag->count++] = block;
+   }
+
+   if (0 == mag->count) {
+      mag->next = empty_magazines;
+      empty_magazines = mag;
+      return nullptr;
+   }
+
+   return mag;
+}
+
+//--------------------------------------------------------------------
+void MagazineBlockAllocator::flush_cache( block_magazine_cache_t *cache )
+{
+   SCOPE_LOCK(depot_lock);
+
+   block_magazine_t *mags[2] = { cache->loaded, cache->previous };
+   for (uint i = 0; i < 2; ++i) {
+      block_magazine_t *mag = mags[i];
+      if (nullptr == mag) {
+         continue;
+      }
+
+      if (mag->count > 0) {
+         mag->next = full_magazines;
+         full_magazines = mag;
+      } else {
+         mag->next = empty_magazines;
+         empty_magazines = mag;
+      }
+   }
+
+   cache->loaded = nullptr;
+   cache->previous = nullptr;
+}
+
+//--------------------------------------------------------------------
+void MagazineBlockAllocator::flush_thread()
+{
+   block_magazine_cache_t *cache = get_cache();
+   if (nullptr != cache) {
+      flush_cache( cache );
+   }
+}
 
 //--------------------------------------------------------------------
 void RunAllocatorSpeedTest()
@@ -146,6 +646,31 @@ void RunAllocatorSpeedTest()
    printf( "Enter Count: " );
    scanf_s( "%i", &count );
 
+   // Fresh allocators each time, so the cold numbers include growing
+   printf( "Cold Start vs Steady State...\n" );
+   for (uint i = 0; i < NUM_TESTS; ++i) {
+      BlockAllocator doubling( BLOCK_SIZE );
+      BlockAllocator fixed( BLOCK_SIZE, 0, BLOCK_GROWTH_FIXED );
+      BlockAllocator prealloc( BLOCK_SIZE, count, BLOCK_GROWTH_NONE );
+      ThreadSafeBlockAllocator locked( BLOCK_SIZE );
+      LocklessBlockAllocator lockfree( BLOCK_SIZE );
+      MagazineBlockAllocator magazine( BLOCK_SIZE );
+
+      ColdStartTest( "Malloc", &gSystemAllocator, count );
+      ColdStartTest( "Block - Doubling", &doubling, count );
+      ColdStartTest( "Block - Fixed", &fixed, count );
+      ColdStartTest( "Block - Preallocated", &prealloc, count );
+      ColdStartTest( "Locked - Doubling", &locked, count );
+      ColdStartTest( "LockFree - Doubling", &lockfree, count );
+      ColdStartTest( "Magazine - Doubling", &magazine, count );
+
+      printf( "  slabs: doubling %u, fixed %u, preallocated %u\n\n", 
+         doubling.slabs.slab_count, 
+         fixed.slabs.slab_count, 
+         prealloc.slabs.slab_count );
+   }
+   pause();
+
    // Single threaded test.
    printf( "Single Threaded Test...\n" );
    for (uint i = 0; i < NUM_TESTS; ++i) {
@@ -158,6 +683,11 @@ void RunAllocatorSpeedTest()
          PROFILE_LOG_SCOPE("Block - Single");
          AllocatorTest( &gBlockAllocator, count );
       }
+
+      {
+         PROFILE_LOG_SCOPE("SizeClass - Single");
+         AllocatorTest( SizeClassGetGlobal(), count );
+      }
    }
    pause();
 
@@ -196,11 +726,55 @@ void RunAllocatorSpeedTest()
             ThreadJoin( threads[i] );
          }
       }
+
+      {
+         PROFILE_LOG_SCOPE("MagazineAllocator");
+         for (uint i = 0; i < NUM_THREADS; ++i) {
+            threads[i] = ThreadCreate( AllocatorTest, &gMagBlockAllocator, count );
+         }
+
+         for (uint i = 0; i < NUM_THREADS; ++i) {
+            ThreadJoin( threads[i] );
+         }
+      }
+
+      {
+         PROFILE_LOG_SCOPE("SizeClassAllocator");
+         for (uint i = 0; i < NUM_THREADS; ++i) {
+            threads[i] = ThreadCreate( AllocatorTest, SizeClassGetGlobal(), count );
+         }
+
+         for (uint i = 0; i < NUM_THREADS; ++i) {
+            ThreadJoin( threads[i] );
+         }
+      }
    }
-   printf( "Max Allocations: %u\n", gTSBlockAllocator.alloc_count );
+   printf( "Slabs: %u [%u blocks, %u KB]\n", 
+      gTSBlockAllocator.slabs.slab_count, 
+      gTSBlockAllocator.slabs.block_count, 
+      (uint)(gTSBlockAllocator.slabs.total_bytes / 1024) );
+   printf( "Magazine depot trips: %u\n", gMagBlockAllocator.depot_trips );
+   pause();
+
+   RunAllocatorScalingTest( count );
    pause();
 }
 
+//--------------------------------------------------------------------
+void RunAllocatorScalingTest( uint count )
+{
+   printf( "Scaling [M allocs+frees a second, %u each per thread]...\n", count );
+   printf( "  %8s %10s %10s %10s\n", "threads", "locked", "lockfree", "magazine" );
+
+   for (uint thread_count = 1; thread_count <= 64; thread_count *= 2) {
+      double const locked = TimeBatchTest( &gTSBlockAllocator, thread_count, count );
+      double const lockfree = TimeBatchTest( &gLFBlockAllocator, thread_count, count );
+      double const magazine = TimeBatchTest( &gMagBlockAllocator, thread_count, count );
+
+      printf( "  %8u %10.2f %10.2f %10.2f\n", thread_count, locked, lockfree, magazine );
+   }
+}
+
 /************************************************************************/
 /*                                                                      */
 /* COMMANDS                                                             */
@@ -15,6 +15,20 @@
 /* DEFINES AND CONSTANTS                                                */
 /*                                                                      */
 /************************************************************************/
+// Pools grow a slab at a time straight from the OS, so slabs are page aligned
+// and come in multiples of the allocation granularity
+#define BLOCK_SLAB_GRANULARITY   (64 * 1024)
+#define BLOCK_SLAB_MAX_SIZE      (4 * 1024 * 1024)
+
+// blocks in a slab are at least this aligned [same as malloc gives]
+#define BLOCK_ALIGNMENT          (16)
+
+// blocks a magazine holds - a thread goes to the depot at most once this many allocs [or frees]
+#define BLOCK_MAGAZINE_SIZE            (32)
+
+// MagazineBlockAllocators alive at once - every thread has room for a pair of magazines 
+// from each [a SizeClassAllocator is SIZE_CLASS_COUNT of them]
+#define BLOCK_MAGAZINE_MAX_ALLOCATORS  (128)
 
 /************************************************************************/
 /*                                                                      */
@@ -27,12 +41,41 @@
 /* TYPES                                                                */
 /*                                                                      */
 /************************************************************************/
+// How big the next slab is once the free list runs dry
+enum eBlockGrowth : uint
+{
+   BLOCK_GROWTH_DOUBLE,    // twice the last one, up to BLOCK_SLAB_MAX_SIZE
+   BLOCK_GROWTH_FIXED,     // always BLOCK_SLAB_GRANULARITY
+   BLOCK_GROWTH_NONE,      // just the one slab - alloc returns nullptr once it's used up
+};
 
 /************************************************************************/
 /*                                                                      */
 /* STRUCTS                                                              */
 /*                                                                      */
 /************************************************************************/
+// Start of every slab [blocks start BLOCK_SLAB_HEADER_SIZE in]
+struct block_slab_header_t
+{
+   block_slab_header_t *next;
+   void *base;          // what the OS gave us [before aligning]
+   size_t size;
+   uint tag;            // whatever the owner wants to find from a block
+};
+
+#define BLOCK_SLAB_HEADER_SIZE (64)
+
+//--------------------------------------------------------------------
+// A small stack of free blocks a thread owns outright
+struct block_magazine_t
+{
+   block_magazine_t *next;       // while it sits in the depot
+   block_magazine_t *all_next;   // every magazine the allocator has made
+   uint count;
+   void *rounds[BLOCK_MAGAZINE_SIZE];
+};
+
+struct block_magazine_cache_t;
 
 /************************************************************************/
 /*                                                                      */
@@ -65,6 +108,54 @@ class IAllocator
       }
 };
 
+//--------------------------------------------------------------------
+//------------------------------------------------------------------------
+class SystemAllocator : public IAllocator 
+{
+   public:
+      void* alloc( size_t size ) { return ::malloc(size); }
+      void free( void *ptr ) { return ::free(ptr); }
+};
+
+//--------------------------------------------------------------------
+//------------------------------------------------------------------------
+// The slabs behind a block allocator.  Not thread safe - the allocators 
+// only grow one thread at a time.  Everything is returned when it's destroyed,
+// so no block can outlive its allocator.
+class BlockSlabList
+{
+   public:
+      BlockSlabList( size_t block_size, eBlockGrowth growth );
+      ~BlockSlabList();
+
+      // Every slab from here on is exactly alignment bytes and aligned to it, so 
+      // GetHeader can find the slab [and its tag] from any block.  Call before
+      // anything is carved.
+      void align_slabs( size_t alignment, uint tag );
+
+      // Carves a new slab [of at least min_count blocks] into blocks linked through
+      // their first pointer.  Returns the first one and sets out_last to the last,
+      // or nullptr if the growth policy or the OS won't give us more.
+      void* grow( uint min_count, void **out_last );
+
+      static block_slab_header_t* GetHeader( void const *block, size_t alignment )
+      {
+         return (block_slab_header_t*)((uintptr_t)block & ~((uintptr_t)alignment - 1));
+      }
+
+   public:
+      size_t stride;          // block size rounded up to BLOCK_ALIGNMENT
+      eBlockGrowth growth;
+      size_t next_size;
+      size_t alignment;       // 0 unless align_slabs was called
+      uint tag;
+      block_slab_header_t *slabs;
+
+      uint slab_count;
+      uint block_count;       // carved so far, in use or not
+      size_t total_bytes;
+};
+
 //--------------------------------------------------------------------
 //------------------------------------------------------------------------
 class BlockAllocator : public IAllocator
@@ -75,15 +166,17 @@ class BlockAllocator : public IAllocator
    };
 
    public:
-      BlockAllocator( size_t bs )
+      // prealloc_count blocks are carved up front, so the first that many allocs never
+      // go to the OS
+      BlockAllocator( size_t bs, uint prealloc_count = 0, eBlockGrowth growth = BLOCK_GROWTH_DOUBLE )
          : free_list(nullptr)
+         , block_size( (bs > sizeof(block_t)) ? bs : sizeof(block_t) )  // must be at least the block pointer size
+         , slabs( block_size, growth )
       {
-         // must be at least the block pointer size
-         block_size = Max( bs, sizeof(block_t) );
-      }
-
-      ~BlockAllocator()
-      {
+         if (prealloc_count > 0) {
+            block_t *last;
+            free_list = (block_t*) slabs.grow( prealloc_count, (void**)&last );
+         }
       }
 
       void* alloc( size_t size )
@@ -92,14 +185,16 @@ class BlockAllocator : public IAllocator
             return nullptr; 
          }
 
-         void *ptr = free_list;
-         if (nullptr == ptr) {
-            ptr = ::malloc(block_size);
-            ++alloc_count;
-         } else {
-            free_list = free_list->next; 
+         if (nullptr == free_list) {
+            block_t *last;
+            free_list = (block_t*) slabs.grow( 1, (void**)&last );
+            if (nullptr == free_list) {
+               return nullptr;
+            }
          }
 
+         void *ptr = free_list;
+         free_list = free_list->next; 
          return ptr;
       }
 
@@ -116,9 +211,9 @@ class BlockAllocator : public IAllocator
 
 
    public:
-      size_t block_size;
       block_t *free_list;
-      uint alloc_count;
+      size_t block_size;
+      BlockSlabList slabs;
 };
 
 
@@ -132,14 +227,15 @@ class ThreadSafeBlockAllocator : public IAllocator
    };
 
    public:
-      ThreadSafeBlockAllocator( size_t bs )
+      ThreadSafeBlockAllocator( size_t bs, uint prealloc_count = 0, eBlockGrowth growth = BLOCK_GROWTH_DOUBLE )
          : free_list(nullptr)
+         , block_size( (bs > sizeof(block_t)) ? bs : sizeof(block_t) )
+         , slabs( block_size, growth )
       {
-         block_size = Max( bs, sizeof(block_t) );
-      }
-
-      ~ThreadSafeBlockAllocator()
-      {
+         if (prealloc_count > 0) {
+            block_t *last;
+            free_list = (block_t*) slabs.grow( prealloc_count, (void**)&last );
+         }
       }
 
       void* alloc( size_t size )
@@ -148,19 +244,18 @@ class ThreadSafeBlockAllocator : public IAllocator
             return nullptr; 
          }
 
-         void *ptr = nullptr;
-
-         {
-            SCOPE_LOCK(lock);
-            if (free_list == nullptr) {
-               ++alloc_count;
-               return ::malloc(block_size);
-            } else {
-               ptr = free_list;
-               free_list = free_list->next;
-               return ptr;
+         SCOPE_LOCK(lock);
+         if (free_list == nullptr) {
+            block_t *last;
+            free_list = (block_t*) slabs.grow( 1, (void**)&last );
+            if (nullptr == free_list) {
+               return nullptr;
             }
          }
+
+         void *ptr = free_list;
+         free_list = free_list->next;
+         return ptr;
       }
 
       void free( void *ptr )
@@ -175,9 +270,9 @@ class ThreadSafeBlockAllocator : public IAllocator
 
 
    public:
-      size_t block_size;
       block_t *free_list;
-      uint alloc_count;
+      size_t block_size;
+      BlockSlabList slabs;
 
       CriticalSection lock;
 };
@@ -209,20 +304,17 @@ class LocklessBlockAllocator : public IAllocator
 
 
    public:
-      LocklessBlockAllocator( size_t bs )
+      LocklessBlockAllocator( size_t bs, uint prealloc_count = 0, eBlockGrowth growth = BLOCK_GROWTH_DOUBLE )
+         : block_size( (bs > sizeof(block_t)) ? bs : sizeof(block_t) )
+         , slabs( block_size, growth )
       {
          head.next = nullptr;
          head.aba = 0;
-         
-         // first difference is that we add
-         // our block size to the requested block size, as
-         // we are no longer allowed to "reuse" the memory
-         block_size = Max( bs, sizeof(block_t) );
-         alloc_count = 0;
-      }
 
-      ~LocklessBlockAllocator()
-      {
+         if (prealloc_count > 0) {
+            block_t *last;
+            head.next = (block_t*) slabs.grow( prealloc_count, (void**)&last );
+         }
       }
 
       void* alloc( size_t size )
@@ -231,18 +323,44 @@ class LocklessBlockAllocator : public IAllocator
             return nullptr; 
          }
 
+         void *ptr = try_alloc();
+         if (nullptr == ptr) {
+            // list was empty when we checked - only one thread grows at a time, 
+            // and whoever was ahead of us may have already refilled it
+            SCOPE_LOCK(grow_lock);
+            ptr = try_alloc();
+            if (nullptr == ptr) {
+               block_t *last;
+               block_t *first = (block_t*) slabs.grow( 1, (void**)&last );
+               if (nullptr == first) {
+                  return nullptr;
+               }
+
+               // keep the first, the rest go on the list in one go
+               if (first != last) {
+                  push_chain( first->next, last );
+               }
+               ptr = first;
+            }
+         }
+
+         return ptr;
+      }
+
+      // Only returns previously freed blocks - nullptr if the free list is empty
+      // (lets a caller decide how it wants to grow instead of falling back to malloc)
+      void* try_alloc()
+      {
          void *ptr = nullptr;
 
          /** lockfree free **/
          while (true) {
-            node_t cur_head = head;
+            node_t cur_head = read_head();
             block_t *top = cur_head.next;
 
             // list was empty when we checked
             if (nullptr == top) {
-               InterlockedIncrement( (LONG*)&alloc_count );
-               ptr = ::malloc(block_size);
-               return ptr;
+               return nullptr;
             }
 
             ptr = top;
@@ -267,14 +385,32 @@ class LocklessBlockAllocator : public IAllocator
          }
 
          block_t *node = (block_t*)ptr;
-        
+         push_chain( node, node );
+      }
+
+      // One copy of the head that everything in the loop works from - a plain copy lets the
+      // compiler load next again on its own, and then top isn't what we compare against.
+      // aba first, so if next changes after it the compare fails.
+      node_t read_head() const
+      {
+         uint64_t volatile const *data = head.data;
+
+         node_t cur;
+         cur.data[1] = data[1];
+         cur.data[0] = data[0];
+         return cur;
+      }
+
+      // pushes an already linked run of blocks [first through last]
+      void push_chain( block_t *first, block_t *last )
+      {
          while (true) {
-            node_t cur_head = head;
+            node_t cur_head = read_head();
 
-            node->next = cur_head.next;
+            last->next = cur_head.next;
             node_t new_head; 
             new_head.aba = cur_head.aba + 1;
-            new_head.next = node;
+            new_head.next = first;
 
             if (CompareAndSet128( head.data, cur_head.data, new_head.data )) {
                break;
@@ -282,15 +418,59 @@ class LocklessBlockAllocator : public IAllocator
          }
       }
 
-   
-
-
    public:
       // head MUST be 128 byte aligned;
       node_t head;           // now a full node - we'll be replacing BOTH piece at once
       size_t block_size;      // List of free blocks;
 
-      uint alloc_count;
+      BlockSlabList slabs;
+      CriticalSection grow_lock;
+};
+
+//--------------------------------------------------------------------
+//--------------------------------------------------------------------
+// Lockless allocator's head is one cache line every thread fights over.  This one
+// gives each thread two magazines [loaded and previous] so most allocs and frees 
+// are a push or pop on memory only that thread touches.  Only when both are empty
+// [or both full] does it go to the depot, trading a whole magazine at a time.
+//
+// Blocks can be freed from any thread - they just end up in that thread's magazine.
+// Threads give their magazines back when they exit.
+class MagazineBlockAllocator : public IAllocator
+{
+   public:
+      MagazineBlockAllocator( size_t bs, uint prealloc_count = 0, eBlockGrowth growth = BLOCK_GROWTH_DOUBLE );
+      ~MagazineBlockAllocator();
+
+      void* alloc( size_t size );
+      void free( void *ptr );
+
+      // Hands the calling thread's magazines back to the depot
+      void flush_thread();
+      void flush_cache( block_magazine_cache_t *cache );
+
+   private:
+      block_magazine_cache_t* get_cache();
+      void* alloc_slow( block_magazine_cache_t *cache );
+      void free_slow( block_magazine_cache_t *cache, void *ptr );
+
+      // depot_lock held
+      block_magazine_t* get_empty_magazine();
+      block_magazine_t* fill_magazine();
+
+   public:
+      size_t block_size;
+      uint slot;              // into every thread's caches
+      uint generation;        // tells this allocator apart from an old one that had the slot
+
+      CriticalSection depot_lock;
+      block_magazine_t *full_magazines;      // [can be partly full, from threads that left]
+      block_magazine_t *empty_magazines;
+      block_magazine_t *all_magazines;
+      void *loose;                           // carved from a slab, never been in a magazine
+      BlockSlabList slabs;
+
+      uint depot_trips;
 };
 
 /************************************************************************/
@@ -304,3 +484,15 @@ class LocklessBlockAllocator : public IAllocator
 /* FUNCTION PROTOTYPES                                                  */
 /*                                                                      */
 /************************************************************************/
+// Committed memory straight from the OS, aligned to alignment [0 for the allocation
+// granularity].  out_base is what to hand BlockSlabRelease when it's done with.
+void* BlockSlabReserve( size_t size, size_t alignment, void **out_base );
+void BlockSlabRelease( void *base );
+
+// Asks for a count, then times malloc against the block allocators - cold,
+// steady state, and with 8 threads fighting over them
+void RunAllocatorSpeedTest();
+
+// Allocs and frees a second for the locked, lockless and magazine allocators,
+// from 1 to 64 threads
+void RunAllocatorScalingTest( uint count );
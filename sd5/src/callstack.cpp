@@ -171,6 +171,19 @@ Callstack* CreateCallstack( uint skip_frames )
    return cs;
 }
 
+//------------------------------------------------------------------------
+// noinline so skip_frames means the same thing everywhere
+__declspec(noinline) uint CallstackCapture( void **frames, uint const max_frames, uint skip_frames, uint32_t *out_hash )
+{
+   DWORD hash;
+   uint const count = CaptureStackBackTrace( 1 + skip_frames, max_frames, frames, &hash );
+   if (nullptr != out_hash) {
+      *out_hash = hash;
+   }
+
+   return count;
+}
+
 //------------------------------------------------------------------------
 // Fills lines with human readable data for the given callstack
 // Fills from top to bottom (top being most recently called, with each next one being the calling function of the previous)
@@ -179,18 +192,24 @@ Callstack* CreateCallstack( uint skip_frames )
 // [ ] If a file exists in yoru src directory, clip the filename
 // [ ] Be able to specify a list of function names which will cause this trace to stop.
 uint CallstackGetLines( callstack_line_t *line_buffer, uint const max_lines, Callstack *cs )
+{
+   return CallstackGetLines( line_buffer, max_lines, cs->frames, cs->frame_count );
+}
+
+//------------------------------------------------------------------------
+uint CallstackGetLines( callstack_line_t *line_buffer, uint const max_lines, void* const *frames, uint const frame_count )
 {
    IMAGEHLP_LINE64 line_info; 
    DWORD line_offset = 0; // Displacement from the beginning of the line 
    line_info.SizeOfStruct = sizeof(IMAGEHLP_LINE64);
 
    
-   uint count = min( max_lines, cs->frame_count );
+   uint count = min( max_lines, frame_count );
    uint idx = 0;
 
    for (uint i = 0; i < count; ++i) {
       callstack_line_t *line = &(line_buffer[idx]);
-      DWORD64 ptr = (DWORD64)(cs->frames[i]);
+      DWORD64 ptr = (DWORD64)(frames[i]);
       if (FALSE == LSymFromAddr( gProcess, ptr, 0, gSymbol )) {
          continue;
       }
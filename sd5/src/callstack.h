@@ -81,5 +81,11 @@ void DestroyCallstack( Callstack *c );
 
 uint CallstackGetLines( callstack_line_t *line_buffer, uint const max_lines, Callstack *cs );
 
+// Same as above without a Callstack object - CallstackCapture fills frames you own and never
+// allocates, so it's safe to call from inside operator new.  Returns how many frames were
+// captured, and their hash through out_hash if it isn't nullptr.
+uint CallstackCapture( void **frames, uint const max_frames, uint skip_frames, uint32_t *out_hash );
+uint CallstackGetLines( callstack_line_t *line_buffer, uint const max_lines, void* const *frames, uint const frame_count );
+
 void CallstackDemo();
 
@@ -13,6 +13,9 @@
 typedef unsigned int uint;
 typedef unsigned __int8 byte_t;
 
+// what to pad things out to so threads writing them don't share a line
+#define CACHE_LINE_SIZE (64)
+
 // used in a sample
 extern std::atomic<int> gA;
 extern int gB;
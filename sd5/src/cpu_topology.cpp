@@ -0,0 +1,230 @@
+/************************************************************************/
+/*                                                                      */
+/* INCLUDE                                                              */
+/*                                                                      */
+/************************************************************************/
+#include "cpu_topology.h"
+
+#define WIN32_LEAN_AND_MEAN
+#include <Windows.h>
+
+#include <algorithm>
+#include <thread>
+
+/************************************************************************/
+/*                                                                      */
+/* LOCAL VARIABLES                                                      */
+/*                                                                      */
+/************************************************************************/
+static cpu_topology_t *gTopology = nullptr;
+
+/************************************************************************/
+/*                                                                      */
+/* LOCAL FUNCTIONS                                                      */
+/*                                                                      */
+/************************************************************************/
+
+//------------------------------------------------------------------------
+static inline bool MaskHas( GROUP_AFFINITY const &mask, cpu_logical_t const &cpu )
+{
+   return (mask.Group == cpu.group) && ((mask.Mask & ((KAFFINITY)1 << cpu.number)) != 0);
+}
+
+//------------------------------------------------------------------------
+static bool CompareLogical( cpu_logical_t const &a, cpu_logical_t const &b )
+{
+   if (a.node != b.node)         return a.node < b.node;
+   if (a.cache != b.cache)       return a.cache < b.cache;
+   if (a.core != b.core)         return a.core < b.core;
+   if (a.group != b.group)       return a.group < b.group;
+   return a.number < b.number;
+}
+
+//------------------------------------------------------------------------
+static void QueryFallback( cpu_topology_t *topo )
+{
+   uint count = (uint)std::thread::hardware_concurrency();
+   count = (count > 0) ? count : 1;
+
+   for (uint i = 0; i < count; ++i) {
+      cpu_logical_t cpu;
+      cpu.group = (uint16_t)(i / (sizeof(KAFFINITY) * 8));
+      cpu.number = (uint16_t)(i % (sizeof(KAFFINITY) * 8));
+      cpu.core = i;
+      cpu.cache = 0;
+      cpu.node = 0;
+      topo->cpus.push_back( cpu );
+   }
+
+   topo->core_count = count;
+   topo->cache_count = 1;
+   topo->node_count = 1;
+}
+
+//------------------------------------------------------------------------
+static bool QueryTopology( cpu_topology_t *topo )
+{
+   DWORD size = 0;
+   ::GetLogicalProcessorInformationEx( RelationAll, nullptr, &size );
+   if (0 == size) {
+      return false;
+   }
+
+   byte_t *buffer = (byte_t*) malloc( size );
+   if (!::GetLogicalProcessorInformationEx( RelationAll, (PSYSTEM_LOGICAL_PROCESSOR_INFORMATION_EX)buffer, &size )) {
+      free( buffer );
+      return false;
+   }
+
+   // Records can come in any order - cores first so there is something to
+   // attach caches and nodes to.  Only the last level cache matters.
+   uint last_cache_level = 0;
+   for (DWORD offset = 0; offset < size; ) {
+      SYSTEM_LOGICAL_PROCESSOR_INFORMATION_EX *info = (SYSTEM_LOGICAL_PROCESSOR_INFORMATION_EX*)(buffer + offset);
+      offset += info->Size;
+
+      if (RelationCache == info->Relationship) {
+         last_cache_level = (info->Cache.Level > last_cache_level) ? info->Cache.Level : last_cache_level;
+         continue;
+      }
+
+      if (RelationProcessorCore != info->Relationship) {
+         continue;
+      }
+
+      for (WORD g = 0; g < info->Processor.GroupCount; ++g) {
+         GROUP_AFFINITY const &mask = info->Processor.GroupMask[g];
+         for (uint bit = 0; bit < sizeof(KAFFINITY) * 8; ++bit) {
+            if (mask.Mask & ((KAFFINITY)1 << bit)) {
+               cpu_logical_t cpu;
+               cpu.group = mask.Group;
+               cpu.number = (uint16_t)bit;
+               cpu.core = topo->core_count;
+               cpu.cache = 0;
+               cpu.node = 0;
+               topo->cpus.push_back( cpu );
+            }
+         }
+      }
+      ++topo->core_count;
+   }
+
+   topo->cache_count = 0;
+   topo->node_count = 0;
+   for (DWORD offset = 0; offset < size; ) {
+      SYSTEM_LOGICAL_PROCESSOR_INFORMATION_EX *info = (SYSTEM_LOGICAL_PROCESSOR_INFORMATION_EX*)(buffer + offset);
+      offset += info->Size;
+
+      if ((RelationCache == info->Relationship) && (info->Cache.Level == last_cache_level) && (CacheInstruction != info->Cache.Type)) {
+         for (uint i = 0; i < topo->cpus.size(); ++i) {
+            if (MaskHas( info->Cache.GroupMask, topo->cpus[i] )) {
+               topo->cpus[i].cache = topo->cache_count;
+            }
+         }
+         ++topo->cache_count;
+      } else if (RelationNumaNode == info->Relationship) {
+         for (uint i = 0; i < topo->cpus.size(); ++i) {
+            if (MaskHas( info->NumaNode.GroupMask, topo->cpus[i] )) {
+               topo->cpus[i].node = info->NumaNode.NodeNumber;
+            }
+         }
+         topo->node_count = ((info->NumaNode.NodeNumber + 1) > topo->node_count) ? (info->NumaNode.NodeNumber + 1) : topo->node_count;
+      }
+   }
+
+   free( buffer );
+
+   topo->cache_count = (topo->cache_count > 0) ? topo->cache_count : 1;
+   topo->node_count = (topo->node_count > 0) ? topo->node_count : 1;
+   return !topo->cpus.empty();
+}
+
+/************************************************************************/
+/*                                                                      */
+/* GLOBAL FUNCTIONS                                                     */
+/*                                                                      */
+/************************************************************************/
+
+//------------------------------------------------------------------------
+cpu_topology_t const* CpuTopologyGet()
+{
+   if (nullptr != gTopology) {
+      return gTopology;
+   }
+
+   // racing here just leaks one - it comes out the same either way
+   cpu_topology_t *topo = new cpu_topology_t();
+   topo->core_count = 0;
+   if (!QueryTopology( topo )) {
+      topo->cpus.clear();
+      QueryFallback( topo );
+   }
+
+   std::sort( topo->cpus.begin(), topo->cpus.end(), CompareLogical );
+
+   gTopology = topo;
+   return topo;
+}
+
+//------------------------------------------------------------------------
+uint CpuTopologyGetDistance( uint a, uint b )
+{
+   cpu_topology_t const *topo = CpuTopologyGet();
+   cpu_logical_t const &ca = topo->cpus[a];
+   cpu_logical_t const &cb = topo->cpus[b];
+
+   if (ca.core == cb.core) {
+      return CPU_DISTANCE_SAME_CORE;
+   } else if (ca.cache == cb.cache) {
+      return CPU_DISTANCE_SAME_CACHE;
+   } else if (ca.node == cb.node) {
+      return CPU_DISTANCE_SAME_NODE;
+   } else {
+      return CPU_DISTANCE_FAR;
+   }
+}
+
+//------------------------------------------------------------------------
+bool CpuTopologyPinCurrentThread( uint const *cpus, uint count )
+{
+   if (0 == count) {
+      return false;
+   }
+
+   cpu_topology_t const *topo = CpuTopologyGet();
+
+   GROUP_AFFINITY affinity = {};
+   affinity.Group = topo->cpus[cpus[0]].group;
+   for (uint i = 0; i < count; ++i) {
+      cpu_logical_t const &cpu = topo->cpus[cpus[i]];
+      if (cpu.group == affinity.Group) {
+         affinity.Mask |= (KAFFINITY)1 << cpu.number;
+      }
+   }
+
+   return ::SetThreadGroupAffinity( ::GetCurrentThread(), &affinity, nullptr ) != FALSE;
+}
+
+//------------------------------------------------------------------------
+void CpuTopologyUnpinCurrentThread()
+{
+   DWORD_PTR process_mask;
+   DWORD_PTR system_mask;
+   if (::GetProcessAffinityMask( ::GetCurrentProcess(), &process_mask, &system_mask )) {
+      ::SetThreadAffinityMask( ::GetCurrentThread(), process_mask );
+   }
+}
+
+//------------------------------------------------------------------------
+void CpuTopologyPrint()
+{
+   cpu_topology_t const *topo = CpuTopologyGet();
+   printf( "CPU topology: %u logical, %u cores, %u last level caches, %u nodes\n",
+      (uint)topo->cpus.size(), topo->core_count, topo->cache_count, topo->node_count );
+
+   for (uint i = 0; i < topo->cpus.size(); ++i) {
+      cpu_logical_t const &cpu = topo->cpus[i];
+      printf( "  cpu %2u: group %u #%2u, core %2u, cache %u, node %u\n",
+         i, cpu.group, cpu.number, cpu.core, cpu.cache, cpu.node );
+   }
+}
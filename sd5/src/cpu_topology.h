@@ -0,0 +1,78 @@
+#pragma once
+#if !defined( __CPU_TOPOLOGY__ )
+#define __CPU_TOPOLOGY__
+
+// What the machine looks like - which logical processors are hyperthreads of
+// the same core, which cores share a last level cache, and which NUMA node they
+// sit on.  Queried once from GetLogicalProcessorInformationEx.
+//
+// Distances between two logical processors:
+//    0 - same physical core [SMT siblings, share L1/L2]
+//    1 - same L3
+//    2 - same NUMA node
+//    3 - anything else
+
+/************************************************************************/
+/*                                                                      */
+/* INCLUDE                                                              */
+/*                                                                      */
+/************************************************************************/
+#include "common.h"
+
+#include <vector>
+
+/************************************************************************/
+/*                                                                      */
+/* DEFINES AND CONSTANTS                                                */
+/*                                                                      */
+/************************************************************************/
+#define CPU_DISTANCE_SAME_CORE   (0)
+#define CPU_DISTANCE_SAME_CACHE  (1)
+#define CPU_DISTANCE_SAME_NODE   (2)
+#define CPU_DISTANCE_FAR         (3)
+
+/************************************************************************/
+/*                                                                      */
+/* STRUCTS                                                              */
+/*                                                                      */
+/************************************************************************/
+struct cpu_logical_t
+{
+   uint16_t group;   // processor group, and number within it - what affinity calls want
+   uint16_t number;
+
+   uint core;        // index of the physical core
+   uint cache;       // index of the last level cache it shares
+   uint node;        // NUMA node
+};
+
+//------------------------------------------------------------------------
+struct cpu_topology_t
+{
+   // ordered by node, then cache, then core - so neighbours in the list are neighbours on the chip
+   std::vector<cpu_logical_t> cpus;
+
+   uint core_count;
+   uint cache_count;
+   uint node_count;
+};
+
+/************************************************************************/
+/*                                                                      */
+/* FUNCTION PROTOTYPES                                                  */
+/*                                                                      */
+/************************************************************************/
+// Queried on first use.  If the OS won't tell us, every logical processor is its own core.
+cpu_topology_t const* CpuTopologyGet();
+
+// indices into CpuTopologyGet()->cpus
+uint CpuTopologyGetDistance( uint a, uint b );
+
+// Restricts the calling thread to the given processors [only those in the same
+// processor group as the first one].  Unpin gives it back the whole process mask.
+bool CpuTopologyPinCurrentThread( uint const *cpus, uint count );
+void CpuTopologyUnpinCurrentThread();
+
+void CpuTopologyPrint();
+
+#endif
@@ -5,17 +5,50 @@
 /************************************************************************/
 #include "job.h"
 
-#include "ts_queue.h"
 #include "signal.h"
 #include "atomic.h"
 #include "thread.h"
+#include "time.h"
 #include "profile.h"
+#include "ws_deque.h"
+#include "blockallocator.h"
+#include "cpu_topology.h"
+#include "job_arena.h"
+#include "job_metrics.h"
+#include "job_coroutine.h"
+
+#include <algorithm>
+
+// WaitOnAddress/WakeByAddressAll
+#pragma comment(lib, "Synchronization.lib")
 
 /************************************************************************/
 /*                                                                      */
 /* DEFINES AND CONSTANTS                                                */
 /*                                                                      */
 /************************************************************************/
+// jobs each thread keeps on hand before touching the shared pool
+#define JOB_CACHE_SIZE (64)
+
+// how many times JobWait spins with nothing to help with before going to sleep
+#define JOB_WAIT_SPIN_COUNT (2000)
+
+// How long a job can be queued before it is as urgent as a fresh critical job - this
+// is the aging policy.  Jobs sort by enqueue time + this, so a long waiting low 
+// priority job eventually goes ahead of newer, higher priority ones.
+static double const JOB_PRIORITY_AGE_MS[JOB_PRIORITY_COUNT] = {
+   0.0,     // JOB_PRIORITY_CRITICAL
+   2.0,     // JOB_PRIORITY_HIGH
+   16.0,    // JOB_PRIORITY_NORMAL
+   100.0,   // JOB_PRIORITY_LOW
+};
+
+// A waiter whose consumer has queues no worker services can't sleep forever - 
+// something may show up in them that only it can run.  So it wakes this often to check.
+#define JOB_WAIT_PARK_MS (1)
+
+// worker isn't pinned to anything
+#define JOB_CPU_NONE (0xffffffff)
 
 /************************************************************************/
 /*                                                                      */
@@ -34,12 +67,67 @@
 /* STRUCTS                                                              */
 /*                                                                      */
 /************************************************************************/
+void JobPoolFlush( void **items, uint count );
+
+//------------------------------------------------------------------------
+// Per-thread stack of free jobs.  Create/release on the same thread never
+// touch an atomic - the shared pool is only hit in batches of half a cache.
+struct job_cache_t
+{
+   void *items[JOB_CACHE_SIZE];
+   uint count;
+
+   ~job_cache_t()
+   {
+      // thread is going away - give everything back.
+      JobPoolFlush( items, count );
+      count = 0;
+   }
+};
+
+enum eJobThreadCommand : uint
+{
+   JOB_THREAD_PARK,  // no job system - sleep until told otherwise
+   JOB_THREAD_RUN,   // run as the worker we were given
+   JOB_THREAD_EXIT,
+};
+
+//------------------------------------------------------------------------
+// OS thread behind a worker.  Outlives the job system if shutdown is asked to
+// keep threads - it parks, and the next startup hands it a new worker.
+struct job_thread_t
+{
+   thread_handle_t handle;
+   class JobWorker *worker;
+   eJobThreadCommand volatile command;  // threads wait on this changing
+};
 
 /************************************************************************/
 /*                                                                      */
 /* CLASSES                                                              */
 /*                                                                      */
 /************************************************************************/
+typedef WorkStealingDeque<Job*> JobDeque;
+
+//------------------------------------------------------------------------
+// One per generic thread.  Only the owning thread pushes and pops from
+// its deque - everyone else can only steal.
+class JobWorker
+{
+   public:
+      JobDeque deque;
+
+      uint index;
+      job_thread_t *thread;
+
+      uint cpu;            // index into CpuTopologyGet()->cpus, or JOB_CPU_NONE if it isn't pinned
+      uint *steal_order;   // every other worker, nearest first [nullptr to just go round]
+
+      // 1 while parked waiting for work - whoever sets it back to 0 owes it a wake up
+      uint volatile is_sleeping;
+};
+
+//------------------------------------------------------------------------
 class JobSystem
 {
    public:
@@ -47,7 +135,20 @@ class JobSystem
       Signal **signals;
       uint queue_count;
 
+      JobWorker *workers;
+      uint worker_count;
+      uint exited_count;
+      uint *steal_orders;
+
+      // workers parked with nothing to do - lets a busy system skip looking for someone to wake
+      uint volatile idle_count;
+
+      // per category - cores kept away from the workers [JobSystemReserveCores]
+      std::vector<uint> *reserved_cpus;
+
+      uint flags;
       bool is_running;
+      bool is_cancelling;  // shutting down with JOB_SHUTDOWN_CANCEL - jobs finish without running
 };
 
 /************************************************************************/
@@ -57,6 +158,38 @@ class JobSystem
 /************************************************************************/
 static JobSystem *gJobSystem = nullptr;
 
+// worker the current thread is running as (nullptr for the main thread or any 
+// thread not created by the job system)
+static thread_local JobWorker *tWorker = nullptr;
+
+// job whose work the current thread is in the middle of [nullptr if none]
+static thread_local Job *tCurrentJob = nullptr;
+
+// Jobs are never returned to the OS - slabs go into the shared lockless pool
+// and threads cache from that.
+static LocklessBlockAllocator gJobPool( sizeof(Job) );
+
+// lambda captures that don't fit in the job
+static LocklessBlockAllocator gJobPayloadPool( JOB_PAYLOAD_POOL_SIZE );
+static thread_local job_cache_t tJobCache;
+
+// every malloc the job system makes on behalf of a job [slabs and dependent spills]
+static uint gJobHeapAllocCount = 0;
+
+// Every slab ever carved, so a handle's slot can find its job.  Slabs are never
+// freed, so a stale handle always points at a real job [just not its job].
+static Job *gJobSlabs[JOB_MAX_SLABS];
+static uint gJobSlabCount = 0;
+
+// JOB_PRIORITY_AGE_MS in op counts
+static uint64_t gPriorityAgeOps[JOB_PRIORITY_COUNT];
+
+// threads left running by JobSystemShutdown( ..., true ) - only touched by startup/shutdown
+static std::vector<job_thread_t*> gParkedThreads;
+
+// cores each category asked for - outlives the system, applied at startup
+static std::vector<uint> gReservedCoreCounts;
+
 /************************************************************************/
 /*                                                                      */
 /* GLOBAL VARIABLES                                                     */
@@ -69,354 +202,2354 @@ static JobSystem *gJobSystem = nullptr;
 /*                                                                      */
 /************************************************************************/
 
+static void DispatchJobs( Job **jobs, uint count, bool pass_reference );
+
 //------------------------------------------------------------------------
-static void GenericJobThread( Signal *signal ) 
+void JobPoolFlush( void **items, uint count )
 {
-   JobConsumer consumer;
-   consumer.add_category( JOB_GENERIC );
-
-   while (gJobSystem->is_running) {
-      signal->wait();
-      consumer.consume_all_jobs();
+   for (uint i = 0; i < count; ++i) {
+      gJobPool.free( items[i] );
    }
-
-   consumer.consume_all_jobs();
 }
 
-/************************************************************************/
-/*                                                                      */
-/* GLOBAL FUNCTIONS                                                     */
-/*                                                                      */
-/************************************************************************/
-
 //------------------------------------------------------------------------
-void Job::on_finish()
+// Grab half a cache worth from the shared pool, and if that is empty,
+// carve a new slab - keeping part of it and handing the rest to the pool.
+static void JobPoolRefill( job_cache_t *cache )
 {
-   // we're done - do this first - as anyone waiting 
-   // doesn't care about my dependendants, so we'll let them know as soon as possible.
-   set_state( JOB_STATE_FINISHED );
+   uint const want = JOB_CACHE_SIZE / 2;
+   while (cache->count < want) {
+      void *ptr = gJobPool.try_alloc();
+      if (nullptr == ptr) {
+         break;
+      }
+      cache->items[cache->count++] = ptr;
+   }
 
-   // inform our dependants that we are done.
-   for (uint i = 0; i < dependents.size(); ++i) {
-      dependents[i]->on_dependancy_finished();
+   if (cache->count > 0) {
+      return;
+   }
+
+   uint slab_idx = AtomicIncrement( &gJobSlabCount ) - 1;
+   if (slab_idx >= JOB_MAX_SLABS) {
+      // out of slots for handles - raise JOB_MAX_SLABS.  Give ours back and leave
+      // the cache empty so JobCreate fails.
+      AtomicDecrement( &gJobSlabCount );
+      return;
+   }
+
+   // Jobs are constructed once here, and just reset by JobCreate each time they're used
+   AtomicIncrement( &gJobHeapAllocCount );
+   Job *slab = (Job*) ::malloc( sizeof(Job) * JOB_SLAB_COUNT );
+   if (nullptr == slab) {
+      // the slot stays empty - someone may already have the one after it, so it can't be given back
+      return;
+   }
+
+   for (uint i = 0; i < JOB_SLAB_COUNT; ++i) {
+      Job *job = new (slab + i) Job();
+      job->slot = (slab_idx * JOB_SLAB_COUNT) + i;
+      job->generation = 1;
+      job->state = JOB_STATE_FINISHED;
+      job->waiter_count = 0;
+   }
+   gJobSlabs[slab_idx] = slab;
+
+   for (uint i = 0; i < JOB_SLAB_COUNT; ++i) {
+      void *ptr = slab + i;
+      if (i < want) {
+         cache->items[cache->count++] = ptr;
+      } else {
+         gJobPool.free( ptr );
+      }
    }
-   
-   // in the case I recycle these - want to make sure this starts cleared.
-   dependents.clear();
 }
 
 //------------------------------------------------------------------------
-void Job::on_dependancy_finished() 
+static Job* JobPoolAlloc()
 {
-   // we both dispatch and release [the dependancy's hold on me]
-   // You'll notice ref_count should almost be >= than dependancy_count due to this;
-   JobDispatchAndRelease( this );
+   job_cache_t *cache = &tJobCache;
+   if (0 == cache->count) {
+      JobPoolRefill( cache );
+      if (0 == cache->count) {
+         return nullptr;
+      }
+   }
+
+   return (Job*) cache->items[--cache->count];
 }
 
 //------------------------------------------------------------------------
-void Job::dependent_on( Job *parent ) 
+static void JobPoolFree( Job *job )
 {
-   // TODO:  Only allow this if the parent has not yet been dispatched once
-   // [and warning/assert if not].  May require an additional state.
+   if (nullptr != job->cancel_token) {
+      JobCancelTokenRelease( job->cancel_token );
+      job->cancel_token = nullptr;
+   }
 
-   // I have a no dependancy, increment the count
-   AtomicIncrement( &dependancy_count );
+   if (nullptr != job->payload_vtable) {
+      job->payload_vtable->destroy( job->user_data );
+      if ((0 != job->payload_vtable->size) && (job->user_data != job->payload)) {
+         JobPayloadFree( job->user_data, job->payload_vtable->size );
+      }
+      job->payload_vtable = nullptr;
+   }
 
-   // Increment my reference count, as this parent is now holding on to me as well.
-   JobAcquire( this );
+   // anyone still holding a handle to this use of it now sees it as finished
+   uint generation = job->generation + 1;
+   job->generation = (0 != generation) ? generation : 1;
+
+   job_cache_t *cache = &tJobCache;
+   if (JOB_CACHE_SIZE == cache->count) {
+      // full - return the older half to the shared pool
+      uint const half = JOB_CACHE_SIZE / 2;
+      JobPoolFlush( cache->items, half );
+      memmove( cache->items, cache->items + half, sizeof(void*) * (JOB_CACHE_SIZE - half) );
+      cache->count -= half;
+   }
 
-   // Push it back
-   parent->dependents.push_back( this );
+   cache->items[cache->count++] = job;
 }
 
 //------------------------------------------------------------------------
-void Job::set_state( eJobState new_state ) 
+// Only ever held for a couple of instructions, so just spin.
+static void LockDependents( Job *job )
 {
-   state = new_state;
+   while (0 != CompareAndSet( &job->dependents_lock, 0, 1 )) {
+      YieldProcessor();
+   }
 }
 
 //------------------------------------------------------------------------
-// JobConsumer
+static void UnlockDependents( Job *job )
+{
+   CompareAndSet( &job->dependents_lock, 1, 0 );
+}
+
 //------------------------------------------------------------------------
+static inline bool IsUrgent( Job *job )
+{
+   return (job->priority < JOB_PRIORITY_NORMAL) || (0 != job->deadline_op);
+}
 
 //------------------------------------------------------------------------
-void JobConsumer::add_category( uint category )
+// Earliest a job should run - smaller is more urgent.
+static inline uint64_t GetSortKey( Job *job )
 {
-   JobQueue *queue = JobSystemGetQueue( category );
-   if (nullptr == queue) {
-      // error/warning -> category didn't exist
-      return; 
-   }
+   return (0 != job->deadline_op) ? job->deadline_op : (job->enqueue_op + gPriorityAgeOps[job->priority]);
+}
 
-   // Add uniquely!  Takes no time to search it, and consumers
-   // should be setup at init time, so the cost doesn't matter.
-   if (std::find( queues.begin(), queues.end(), queue ) == queues.end()) {
-      queues.push_back( queue );
-   }
+//------------------------------------------------------------------------
+static bool CompareDeadlines( Job *a, Job *b )
+{
+   // std heaps are max heaps - flip it so the earliest deadline is on top
+   return a->deadline_op > b->deadline_op;
 }
 
 //------------------------------------------------------------------------
-bool JobConsumer::consume_job()
+static inline bool IsStealingEnabled()
+{
+   return (gJobSystem->flags & JOB_SYSTEM_FLAG_WORK_STEALING) != 0;
+}
+
+//------------------------------------------------------------------------
+// Try every other worker once, starting after ourselves so thieves
+// spread out instead of all hitting worker 0.
+static Job* StealJob()
 {
+   uint const count = gJobSystem->worker_count;
+
+   // pinned workers go by distance - whoever shares our cache has the data we'd want
+   if ((nullptr != tWorker) && (nullptr != tWorker->steal_order)) {
+      Job *job = nullptr;
+      for (uint i = 0; i < count - 1; ++i) {
+         if (gJobSystem->workers[tWorker->steal_order[i]].deque.steal( &job )) {
+            return job;
+         }
+      }
+      return nullptr;
+   }
+
+   uint start = (nullptr != tWorker) ? (tWorker->index + 1) : 0;
+
    Job *job = nullptr;
-   for (uint i = 0; i < queues.size(); ++i) {
-      JobQueue *queue = queues[i];
-      if (queue->dequeue( &job )) {
-
-         // queue no longer holds it, and now the consumer does
-         // so instead of acquiring and releasing, I just do nothing
-         // as the reference silently passes between the two states.
-         job->set_state( JOB_STATE_RUNNING );
-
-         // Do the work
-         job->work_cb( job->user_data );
-
-         // And we're done.
-         job->on_finish();
-         job->dependents.clear();
-         
-         // release my hold on this job.
-         JobRelease(job);
-         return true;
+   for (uint i = 0; i < count; ++i) {
+      JobWorker *victim = &gJobSystem->workers[(start + i) % count];
+      if (victim == tWorker) {
+         continue;
+      }
+
+      if (victim->deque.steal( &job )) {
+         return job;
       }
    }
 
-   // no queues had work for me - then this failed
-   return false;
+   return nullptr;
 }
 
 //------------------------------------------------------------------------
-uint JobConsumer::consume_all_jobs()
+static void RunJob( Job *job )
 {
-   // all work is in consume job - so.. just do that while it succeeds.
-   uint count = 0;
-   while (consume_job()) {
-      ++count;
+   // queue no longer holds it, and now the consumer does
+   // so instead of acquiring and releasing, I just do nothing
+   // as the reference silently passes between the two states.
+   job->set_state( JOB_STATE_RUNNING );
+   JOB_TRACE_RUN_BEGIN();
+   JOB_METRICS_RUN_BEGIN();
+
+   // Do the work [unless it was cancelled, or we're throwing it away on shutdown - we 
+   // still finish it so that anything waiting or depending on it isn't stuck forever]
+   if (!gJobSystem->is_cancelling && !job->is_cancelled()) {
+      // waiters can run jobs from inside a job, so put back whoever was here
+      Job *outer_job = tCurrentJob;
+      tCurrentJob = job;
+
+      // whatever it took from scratch goes back as soon as it's done
+      size_t scratch_mark = JobScratchGetMark();
+      job->work_cb( job->user_data );
+      JobScratchRewind( scratch_mark );
+
+      tCurrentJob = outer_job;
    }
 
-   return count;
-}
+   // before finishing - anyone waiting on it sees it counted
+   JOB_METRICS_RUN_END();
+
+   if (job->is_suspended) {
+      // Not done - it's waiting on something.  Drop the hold JobSuspendOn took, which
+      // dispatches it again right away if what it's waiting on has already finished.
+      job->is_suspended = false;
+      JobDispatch( job );
+   } else {
+      // And we're done.
+      job->on_finish();
+   }
 
-//------------------------------------------------------------------------
-uint JobConsumer::consume_for_ms( uint ms )
-{
-   uint count = 0;
-   uint start = TimeGet_ms();
-   do {
-      // consume a job - if we fail - just return, no reason to busy loop.
-      if (!consume_job()) {
-         return count; 
-      }
-      // otherwise (we consumed a job), increment the count and see if we've elapsed time.
-      ++count;
-   } while ((TimeGet_ms() - start) < ms);
+   JOB_TRACE_RUN_END( job );
 
-   return count;
+   // release my hold on this job.
+   JobRelease(job);
 }
 
 //------------------------------------------------------------------------
-void JobSystemStartup( uint job_category_count, int generic_thread_count /*= -1*/ )
+// Any generic work - our own deque, the shared queue, then anyone else's deque.
+// Used by waiters to help out regardless of what consumer they were given.
+static bool RunGenericJob()
 {
-   int core_count = (int)std::thread::hardware_concurrency();
-   if (generic_thread_count <= 0) {
-      core_count += generic_thread_count; 
+   Job *job = nullptr;
+   JobQueue *queue = &gJobSystem->queues[JOB_GENERIC];
+   if (queue->has_urgent() && queue->dequeue( &job )) {
+      RunJob( job );
+      return true;
    }
-   core_count--; // one is always being created - so subtract from total wanted;
-
-   // We need queues! 
-   gJobSystem = new JobSystem();
-   gJobSystem->queues = new ThreadSafeQueue<Job*>[job_category_count];
-   gJobSystem->signals = new Signal*[job_category_count];
-   gJobSystem->queue_count = job_category_count;
-   gJobSystem->is_running = true;
 
-   for (uint i = 0; i < job_category_count; ++i) {
-      gJobSystem->signals[i] = nullptr;
+   if ((nullptr != tWorker) && tWorker->deque.pop( &job )) {
+      RunJob( job );
+      return true;
    }
 
-   // create the signal
-   gJobSystem->signals[JOB_GENERIC] = new Signal();
+   if (!queue->empty() && queue->dequeue( &job )) {
+      RunJob( job );
+      return true;
+   }
 
-   ThreadCreate( GenericJobThread, gJobSystem->signals[JOB_GENERIC] );
-   for (int i = 0; i < core_count; ++i) {
-      ThreadCreate( GenericJobThread, gJobSystem->signals[JOB_GENERIC] );
+   if (IsStealingEnabled()) {
+      job = StealJob();
+      JOB_METRICS_STEAL( nullptr != job );
+      if (nullptr != job) {
+         RunJob( job );
+         return true;
+      }
    }
+
+   return false;
 }
 
 //------------------------------------------------------------------------
-void JobSystemShutdown()
+static inline Job* GetJobInSlot( uint slot )
 {
-   // dont' forget to clean up.
-   // TODO!
-
-   // You should stop the system
-   // and ensure all enqueued jobs have finished.
+   return gJobSlabs[slot / JOB_SLAB_COUNT] + (slot % JOB_SLAB_COUNT);
 }
 
 //------------------------------------------------------------------------
-void JobSystemSetSignal( uint category, Signal *signal )
+// Sleep until the job's state or generation changes [or ms pass].  Finishing is 
+// the only change that wakes us, but a change before we got to sleep [including 
+// the job being recycled] just returns right away.
+static void ParkOnJob( Job *job, uint generation, DWORD ms )
 {
-   // not a proper category?  Return
-   if (category >= gJobSystem->queue_count) {
-      return; 
+   AtomicIncrement( &job->waiter_count );
+
+   uint64_t observed = job->state_and_generation;
+   if (((uint)(observed >> 32) == generation) && (JOB_STATE_FINISHED != (eJobState)(uint)observed)) {
+      ::WaitOnAddress( &job->state_and_generation, &observed, sizeof(observed), ms );
    }
 
-   gJobSystem->signals[category] = signal;
+   AtomicDecrement( &job->waiter_count );
 }
 
 //------------------------------------------------------------------------
-JobQueue* JobSystemGetQueue(uint category)
+// hint only
+static bool HasGenericWork()
 {
-   // not a proper category?  Return
-   if (category >= gJobSystem->queue_count) {
-      return nullptr;
+   if (!gJobSystem->queues[JOB_GENERIC].empty()) {
+      return true;
    }
 
-   // notice I return a POINTER to the queue
-   // there is only ever one unique queue, and the consumers just reference it.
-   return &(gJobSystem->queues[category]);
+   for (uint i = 0; i < gJobSystem->worker_count; ++i) {
+      if (!gJobSystem->workers[i].deque.empty()) {
+         return true;
+      }
+   }
+   return false;
 }
 
-
 //------------------------------------------------------------------------
-Job* JobCreate( eJobType type, job_work_cb work_cb, void *user_data )
+// Park until WakeWorkers picks us.  We say we're asleep BEFORE taking a last look 
+// for work - so a dispatch either sees us in the idle count, or we see its job.
+static void SleepWorker( JobWorker *worker )
 {
-   Job *job = new Job();
-   job->type = type;
-   job->state = JOB_STATE_WAITING;
-   job->work_cb = work_cb;
-   job->user_data = user_data;
-   job->dependancy_count = 1;
-   job->ref_count = 1;
+   worker->is_sleeping = 1;
+   AtomicIncrement( &gJobSystem->idle_count );
+   MemoryBarrier();
+
+   if (HasGenericWork() || !gJobSystem->is_running) {
+      // take it back - unless somebody already woke us, in which case they did the count
+      if (1 == CompareAndSet( &worker->is_sleeping, 1, 0 )) {
+         AtomicDecrement( (uint*)&gJobSystem->idle_count );
+      }
+      return;
+   }
 
-   return job;
+   JOB_METRICS_IDLE_BEGIN();
+   uint sleeping = 1;
+   while (1 == worker->is_sleeping) {
+      ::WaitOnAddress( &worker->is_sleeping, &sleeping, sizeof(sleeping), INFINITE );
+   }
+   JOB_METRICS_IDLE_END();
 }
 
 //------------------------------------------------------------------------
-void JobAcquire( Job *job )
+// Wake up to count parked workers - starting after ourselves so the same ones aren't always picked.
+static void WakeWorkers( uint count )
 {
-   AtomicIncrement( &job->ref_count );
+   // the new jobs have to be visible before we look at who's asleep
+   MemoryBarrier();
+   if (0 == gJobSystem->idle_count) {
+      return;
+   }
+
+   uint const worker_count = gJobSystem->worker_count;
+   uint start = (nullptr != tWorker) ? (tWorker->index + 1) : 0;
+   for (uint i = 0; (i < worker_count) && (count > 0); ++i) {
+      JobWorker *worker = &gJobSystem->workers[(start + i) % worker_count];
+      if ((1 == worker->is_sleeping) && (1 == CompareAndSet( &worker->is_sleeping, 1, 0 ))) {
+         AtomicDecrement( (uint*)&gJobSystem->idle_count );
+         ::WakeByAddressSingle( (PVOID)&worker->is_sleeping );
+         --count;
+      }
+   }
 }
 
 //------------------------------------------------------------------------
-void JobRelease( Job *job )
+// Returns once the job system stops running.
+static void RunWorker( JobWorker *worker ) 
 {
-   // remove a reference - if we're the last one, delete me!
-   uint ref_count = AtomicDecrement( &job->ref_count );
-   if (0 == ref_count) {
-      delete job;
+   tWorker = worker;
+
+   // threads are reused between startups, so always set it one way or the other
+   if (JOB_CPU_NONE != worker->cpu) {
+      CpuTopologyPinCurrentThread( &worker->cpu, 1 );
+   } else {
+      CpuTopologyUnpinCurrentThread();
+   }
+
+   JobConsumer consumer;
+   consumer.add_category( JOB_GENERIC );
+
+   while (gJobSystem->is_running) {
+      if (0 == consumer.consume_all_jobs()) {
+         SleepWorker( worker );
+      }
    }
+
+   consumer.consume_all_jobs();
+
+   tWorker = nullptr;
 }
 
 //------------------------------------------------------------------------
-void JobDispatch( Job *job )
+static void GenericJobThread( job_thread_t *thread ) 
 {
-   // if I'm not ready to run, don't. 
-   uint dcount = AtomicDecrement( &job->dependancy_count );
-   if (dcount != 0) {
-      return; 
-   }
+   while (true) {
+      eJobThreadCommand command = thread->command;
+      if (JOB_THREAD_EXIT == command) {
+         break;
+      }
 
-   // update my state
-   job->state = JOB_STATE_ENQUEUED; 
+      if (JOB_THREAD_PARK == command) {
+         ::WaitOnAddress( &thread->command, &command, sizeof(command), INFINITE );
+         continue;
+      }
 
-   // I'm being qneueued - so the queue now holds a reference to me
-   // do this BEFORE qneueing to prevent the job system
-   // from potentially releasing before I have a chance to acquire.
-   JobAcquire( job );
-   gJobSystem->queues[job->type].enqueue( job );
+      JobSystem *system = gJobSystem;
+      RunWorker( thread->worker );
 
-   // IF a signal is associated with this job type, signal it.
-   Signal *signal = gJobSystem->signals[job->type];
-   if (nullptr != signal) {
-      signal->signal_all();
+      // park BEFORE saying we're out - as soon as we do, shutdown can return
+      // and a restart can hand us a new worker.
+      thread->worker = nullptr;
+      thread->command = JOB_THREAD_PARK;
+      AtomicIncrement( &system->exited_count );
    }
 }
 
 //------------------------------------------------------------------------
-void JobDispatchAndRelease( Job *job )
+static void SetThreadCommand( job_thread_t *thread, eJobThreadCommand command )
 {
-   // exactly as the name says.
-   JobDispatch( job );
-   JobRelease( job );
+   thread->command = command;
+   ::WakeByAddressSingle( (PVOID)&thread->command );
 }
 
-
 //------------------------------------------------------------------------
-void JobWait( Job *job, JobConsumer *consumer )
+static void DestroyJobThread( job_thread_t *thread )
 {
-   while (!job->is_finished()) {
-      if (consumer != nullptr) {
-         consumer->consume_job(); 
-      } 
-   }
+   SetThreadCommand( thread, JOB_THREAD_EXIT );
+   ThreadJoin( thread->handle );
+   delete thread;
 }
 
 //------------------------------------------------------------------------
-void JobWaitAndRelease( Job *job, JobConsumer *consumer )
+// Reserved cores come off the end of the topology a whole core at a time, but 
+// the first core is always left for the workers.  Returns which cpus were taken.
+static std::vector<bool> ReserveCpus()
 {
-   JobWait( job, consumer );
-   JobRelease( job );
+   cpu_topology_t const *topo = CpuTopologyGet();
+   std::vector<bool> taken( topo->cpus.size(), false );
+
+   int next = (int)topo->cpus.size() - 1;
+   uint category_count = (gJobSystem->queue_count < gReservedCoreCounts.size()) ? gJobSystem->queue_count : (uint)gReservedCoreCounts.size();
+   for (uint category = 0; category < category_count; ++category) {
+      for (uint i = 0; i < gReservedCoreCounts[category]; ++i) {
+         if ((next < 0) || (topo->cpus[next].core == topo->cpus[0].core)) {
+            break;
+         }
+
+         uint core = topo->cpus[next].core;
+         while ((next >= 0) && (topo->cpus[next].core == core)) {
+            gJobSystem->reserved_cpus[category].push_back( (uint)next );
+            taken[next] = true;
+            --next;
+         }
+      }
+   }
+
+   return taken;
 }
 
+//------------------------------------------------------------------------
+// One worker per physical core first, and only then onto their SMT siblings.  
+// Cpus are ordered so that neighbouring workers share a cache.
+static void PlaceWorkers( std::vector<bool> taken )
+{
+   cpu_topology_t const *topo = CpuTopologyGet();
+   uint const count = gJobSystem->worker_count;
+
+   // siblings are next to each other in the list - take the first free one of each core per pass
+   std::vector<uint> order;
+   bool added = true;
+   while (added) {
+      added = false;
+      uint last_core = JOB_CPU_NONE;
+      for (uint i = 0; i < topo->cpus.size(); ++i) {
+         if (!taken[i] && (topo->cpus[i].core != last_core)) {
+            order.push_back( i );
+            taken[i] = true;
+            last_core = topo->cpus[i].core;
+            added = true;
+         }
+      }
+   }
 
-//--------------------------------------------------------------------
-// Some test code - make sure I did the thing right! 
-//--------------------------------------------------------------------
+   // more workers than cpus just wraps around
+   for (uint i = 0; i < count; ++i) {
+      gJobSystem->workers[i].cpu = order[i % order.size()];
+   }
 
+   // everyone else, nearest first - ties go round from ourselves so thieves still spread out
+   gJobSystem->steal_orders = new uint[count * count];
+   for (uint i = 0; i < count; ++i) {
+      JobWorker *worker = &gJobSystem->workers[i];
+      worker->steal_order = gJobSystem->steal_orders + (i * count);
+      for (uint j = 1; j < count; ++j) {
+         worker->steal_order[j - 1] = (i + j) % count;
+      }
 
-//--------------------------------------------------------------------
-static void EmptyJob( void *ptr )
-{
-   uint *count_ptr = (uint*)ptr;
-   AtomicIncrement( count_ptr );
+      std::stable_sort( worker->steal_order, worker->steal_order + (count - 1), [=]( uint a, uint b ) {
+         JobWorker const *workers = gJobSystem->workers;
+         return CpuTopologyGetDistance( worker->cpu, workers[a].cpu ) < CpuTopologyGetDistance( worker->cpu, workers[b].cpu );
+      });
+   }
 }
 
-//--------------------------------------------------------------------
-static bool gDone = false;
-static void OnEverythingDone( void *ptr )
+//------------------------------------------------------------------------
+// No workers are left - anything still queued [or that becomes ready while we
+// do this] is run [or cancelled] right here.
+static void FinishRemainingJobs()
 {
-   uint *count_ptr = (uint*)ptr;
+   Job *job = nullptr;
+   bool found = true;
+   while (found) {
+      found = false;
+      for (uint i = 0; i < gJobSystem->queue_count; ++i) {
+         while (gJobSystem->queues[i].dequeue( &job )) {
+            RunJob( job );
+            found = true;
+         }
+      }
 
-   // assert count_ptr is 1000 [make sure all other jobs got to run first!]
-   uint count = *count_ptr; 
-   if (count != 1000) {
-      __debugbreak();
+      for (uint i = 0; i < gJobSystem->worker_count; ++i) {
+         while (gJobSystem->workers[i].deque.steal( &job )) {
+            RunJob( job );
+            found = true;
+         }
+      }
    }
-
-   gDone = true;
+}
+
+/************************************************************************/
+/*                                                                      */
+/* GLOBAL FUNCTIONS                                                     */
+/*                                                                      */
+/************************************************************************/
+
+//------------------------------------------------------------------------
+void JobDependentList::push_back( Job *job )
+{
+   if (count == capacity) {
+      // out of room - double it.
+      uint new_capacity = capacity * 2;
+      Job **new_items = (Job**) ::malloc( sizeof(Job*) * new_capacity );
+      AtomicIncrement( &gJobHeapAllocCount );
+
+      for (uint i = 0; i < count; ++i) {
+         new_items[i] = (*this)[i];
+      }
+
+      ::free( heap );
+      heap = new_items;
+      capacity = new_capacity;
+   }
+
+   if (nullptr == heap) {
+      inline_items[count] = job;
+   } else {
+      heap[count] = job;
+   }
+   ++count;
+}
+
+//------------------------------------------------------------------------
+void Job::on_finish()
+{
+   // we're done - do this first - as anyone waiting 
+   // doesn't care about my dependendants, so we'll let them know as soon as possible.
+   // Done under the lock so nobody adds themselves to the list after this; 
+   // which means the list is ours to walk without it.
+   LockDependents( this );
+   set_state( JOB_STATE_FINISHED );
+   UnlockDependents( this );
+
+   // Wake anyone parked on me.  The barrier keeps the read of the count from moving above
+   // the state change - a waiter increments the count before it checks the state, so one
+   // of us always sees the other.
+   MemoryBarrier();
+   if (waiter_count > 0) {
+      ::WakeByAddressAll( (PVOID)&state_and_generation );
+   }
+
+   if (nullptr != finish_cb) {
+      finish_cb( user_data );
+   }
+
+   // inform our dependants that we are done - all of them in one go.  Our hold on 
+   // each goes to the queue if it's ready, and is released if it isn't.
+   uint count = dependents.size();
+   if (count > 0) {
+      DispatchJobs( dependents.data(), count, true );
+   }
+   
+   // in the case I recycle these - want to make sure this starts cleared.
+   dependents.clear();
+}
+
+//------------------------------------------------------------------------
+bool Job::dependent_on( Job *parent ) 
+{
+   LockDependents( parent );
+
+   // too late - it is never going to tell us it finished.
+   if (parent->is_finished()) {
+      UnlockDependents( parent );
+      return false;
+   }
+
+   // I have a no dependancy, increment the count
+   AtomicIncrement( &dependancy_count );
+
+   // Increment my reference count, as this parent is now holding on to me as well.
+   JobAcquire( this );
+
+   // Push it back
+   parent->dependents.push_back( this );
+   JOB_TRACE_EDGE( parent, this );
+
+   UnlockDependents( parent );
+   return true;
+}
+
+//------------------------------------------------------------------------
+void Job::set_state( eJobState new_state ) 
+{
+   state = new_state;
+}
+
+//------------------------------------------------------------------------
+void Job::set_deadline_ms( double ms )
+{
+   deadline_op = TimeGetOpCount() + TimeOpCountFrom_ms( ms );
+}
+
+//------------------------------------------------------------------------
+// JobQueue
+//------------------------------------------------------------------------
+
+//------------------------------------------------------------------------
+JobQueue::JobQueue()
+   : normal(JOB_QUEUE_LOCKLESS_CAPACITY)
+   , locked_count(0)
+   , urgent_count(0)
+   , next_due_op(UINT64_MAX)
+{
+   memset( stats, 0, sizeof(stats) );
+}
+
+//------------------------------------------------------------------------
+void JobQueue::enqueue( Job *job )
+{
+   job->enqueue_op = TimeGetOpCount();
+
+   if (!IsUrgent(job) && (JOB_PRIORITY_NORMAL == job->priority) && normal.try_enqueue( job )) {
+      return;
+   }
+
+   SCOPE_LOCK(lock);
+   if (0 != job->deadline_op) {
+      deadlines.push_back( job );
+      std::push_heap( deadlines.begin(), deadlines.end(), CompareDeadlines );
+   } else {
+      fifos[job->priority].push( job );
+   }
+
+   ++locked_count;
+   if (IsUrgent(job)) {
+      ++urgent_count;
+   }
+   update_next_due();
+}
+
+//------------------------------------------------------------------------
+void JobQueue::enqueue_batch( Job **jobs, uint count )
+{
+   // plain normal work to the front - it goes in with a single claim on the lockless queue
+   uint normal_count = 0;
+   for (uint i = 0; i < count; ++i) {
+      Job *job = jobs[i];
+      if (!IsUrgent(job) && (JOB_PRIORITY_NORMAL == job->priority)) {
+         std::swap( jobs[normal_count], jobs[i] );
+         ++normal_count;
+      }
+   }
+
+   uint64_t now = TimeGetOpCount();
+   for (uint i = 0; i < count; ++i) {
+      jobs[i]->enqueue_op = now;
+   }
+
+   uint first = 0;
+   if ((normal_count > 0) && normal.try_enqueue_batch( jobs, normal_count )) {
+      first = normal_count;
+   } else {
+      // no room for all of them - as many as will fit, the rest spill
+      while ((first < normal_count) && normal.try_enqueue( jobs[first] )) {
+         ++first;
+      }
+   }
+
+   if (first == count) {
+      return;
+   }
+
+   SCOPE_LOCK(lock);
+   for (uint i = first; i < count; ++i) {
+      Job *job = jobs[i];
+      if (0 != job->deadline_op) {
+         deadlines.push_back( job );
+         std::push_heap( deadlines.begin(), deadlines.end(), CompareDeadlines );
+      } else {
+         fifos[job->priority].push( job );
+      }
+
+      ++locked_count;
+      if (IsUrgent(job)) {
+         ++urgent_count;
+      }
+   }
+   update_next_due();
+}
+
+//------------------------------------------------------------------------
+bool JobQueue::dequeue( Job **out )
+{
+   Job *job = nullptr;
+   bool found = false;
+
+   // Locked work goes first only if it sorts ahead of the oldest normal job - so a steady
+   // stream of high priority [or deadline] work can hold normal work back by no more than 
+   // the difference in their allowances.
+   if (0 != locked_count) {
+      uint64_t const normal_key = get_normal_front_key();
+      if (next_due_op < normal_key) {
+         found = dequeue_locked( &job, normal_key );
+      }
+   }
+
+   if (!found) {
+      found = normal.dequeue( &job );
+   }
+
+   // only low priority [or spilled] work left
+   if (!found && (0 != locked_count)) {
+      found = dequeue_locked( &job, UINT64_MAX );
+   }
+
+   if (!found) {
+      return false;
+   }
+
+   record_wait( job );
+   *out = job;
+   return true;
+}
+
+//------------------------------------------------------------------------
+// Sort key of the oldest job in the lockless queue - UINT64_MAX if it's empty, or if
+// it was taken while we looked [normal work is moving, so nothing's starving]
+uint64_t JobQueue::get_normal_front_key() const
+{
+   Job *job;
+   uint pos;
+   if (!normal.peek( &job, &pos )) {
+      return UINT64_MAX;
+   }
+
+   // the job can't have been recycled if it's still at the front after reading it [volatile
+   // so the read stays ahead of the check]
+   uint64_t const enqueue_op = *(uint64_t volatile*)&job->enqueue_op;
+   if (!normal.is_front( pos )) {
+      return UINT64_MAX;
+   }
+
+   return enqueue_op + gPriorityAgeOps[JOB_PRIORITY_NORMAL];
+}
+
+//------------------------------------------------------------------------
+// Takes the locked job with the smallest sort key, if it's smaller than before_key
+bool JobQueue::dequeue_locked( Job **out, uint64_t before_key )
+{
+   SCOPE_LOCK(lock);
+   if (0 == locked_count) {
+      return false;
+   }
+
+   // Each FIFO is in enqueue order and shares an allowance, so its front has 
+   // its smallest key.  Ties go to the higher priority.
+   uint best_fifo = JOB_PRIORITY_COUNT;
+   uint64_t best_key = UINT64_MAX;
+   for (uint i = 0; i < JOB_PRIORITY_COUNT; ++i) {
+      if (!fifos[i].empty()) {
+         uint64_t key = GetSortKey( fifos[i].front() );
+         if (key < best_key) {
+            best_key = key;
+            best_fifo = i;
+         }
+      }
+   }
+
+   bool use_deadline = !deadlines.empty() && (deadlines.front()->deadline_op < best_key);
+   Job *job = use_deadline ? deadlines.front() : fifos[best_fifo].front();
+   if (GetSortKey(job) >= before_key) {
+      return false;
+   }
+
+   if (use_deadline) {
+      std::pop_heap( deadlines.begin(), deadlines.end(), CompareDeadlines );
+      deadlines.pop_back();
+   } else {
+      fifos[best_fifo].pop();
+   }
+
+   --locked_count;
+   if (IsUrgent(job)) {
+      --urgent_count;
+   }
+   update_next_due();
+
+   *out = job;
+   return true;
+}
+
+//------------------------------------------------------------------------
+// Called with the lock held
+void JobQueue::update_next_due()
+{
+   uint64_t due = deadlines.empty() ? UINT64_MAX : deadlines.front()->deadline_op;
+   for (uint i = 0; i < JOB_PRIORITY_COUNT; ++i) {
+      if (!fifos[i].empty()) {
+         uint64_t key = GetSortKey( fifos[i].front() );
+         due = (key < due) ? key : due;
+      }
+   }
+   next_due_op = due;
+}
+
+//------------------------------------------------------------------------
+// how long did it sit here?  Normal work doesn't hold the lock, so these are all atomic.
+void JobQueue::record_wait( Job *job )
+{
+   uint64_t now = TimeGetOpCount();
+   uint64_t wait = now - job->enqueue_op;
+
+   job_wait_stats_t *stat = &stats[job->priority];
+   AtomicIncrement( &stat->count );
+   AtomicAdd64( &stat->total_wait_op, wait );
+
+   uint64_t max_wait = stat->max_wait_op;
+   while (wait > max_wait) {
+      uint64_t prev = CompareAndSet64( &stat->max_wait_op, max_wait, wait );
+      if (prev == max_wait) {
+         break;
+      }
+      max_wait = prev;
+   }
+
+   if ((0 != job->deadline_op) && (now > job->deadline_op)) {
+      AtomicIncrement( &stat->deadline_misses );
+   }
+
+   JOB_METRICS_QUEUE_WAIT( wait );
+}
+
+//------------------------------------------------------------------------
+void JobQueue::get_stats( job_wait_stats_t out[JOB_PRIORITY_COUNT] )
+{
+   memcpy( out, stats, sizeof(stats) );
+}
+
+//------------------------------------------------------------------------
+void JobQueue::reset_stats()
+{
+   memset( stats, 0, sizeof(stats) );
+}
+
+//------------------------------------------------------------------------
+// JobConsumer
+//------------------------------------------------------------------------
+
+//------------------------------------------------------------------------
+void JobConsumer::add_category( uint category )
+{
+   JobQueue *queue = JobSystemGetQueue( category );
+   if (nullptr == queue) {
+      // error/warning -> category didn't exist
+      return; 
+   }
+
+   // Add uniquely!  Takes no time to search it, and consumers
+   // should be setup at init time, so the cost doesn't matter.
+   if (std::find( queues.begin(), queues.end(), queue ) == queues.end()) {
+      queues.push_back( queue );
+   }
+
+   if (JOB_GENERIC == category) {
+      can_steal = IsStealingEnabled();
+   }
+}
+
+//------------------------------------------------------------------------
+bool JobConsumer::consume_job()
+{
+   Job *job = nullptr;
+
+   // Urgent work first.  It never goes in the deques, so only the queues need checking.
+   for (uint i = 0; i < queues.size(); ++i) {
+      JobQueue *queue = queues[i];
+      if (queue->has_urgent() && queue->dequeue( &job )) {
+         RunJob( job );
+         return true;
+      }
+   }
+
+   // my own work next - it was most recently touched, so is likely still in cache.
+   if ((nullptr != tWorker) && tWorker->deque.pop( &job )) {
+      RunJob( job );
+      return true;
+   }
+
+   // then anything injected from outside the workers
+   for (uint i = 0; i < queues.size(); ++i) {
+      JobQueue *queue = queues[i];
+      if (!queue->empty() && queue->dequeue( &job )) {
+         RunJob( job );
+         return true;
+      }
+   }
+
+   // finally, see if anyone else has more than they can handle.
+   if (can_steal) {
+      job = StealJob();
+      JOB_METRICS_STEAL( nullptr != job );
+      if (nullptr != job) {
+         RunJob( job );
+         return true;
+      }
+   }
+
+   // no queues had work for me - then this failed
+   return false;
+}
+
+//------------------------------------------------------------------------
+uint JobConsumer::consume_all_jobs()
+{
+   // all work is in consume job - so.. just do that while it succeeds.
+   uint count = 0;
+   while (consume_job()) {
+      ++count;
+   }
+
+   return count;
+}
+
+//------------------------------------------------------------------------
+uint JobConsumer::consume_for_ms( uint ms )
+{
+   uint count = 0;
+   uint start = TimeGet_ms();
+   do {
+      // consume a job - if we fail - just return, no reason to busy loop.
+      if (!consume_job()) {
+         return count; 
+      }
+      // otherwise (we consumed a job), increment the count and see if we've elapsed time.
+      ++count;
+   } while ((TimeGet_ms() - start) < ms);
+
+   return count;
+}
+
+//------------------------------------------------------------------------
+void JobSystemStartup( uint job_category_count, int generic_thread_count /*= -1*/, uint flags /*= JOB_SYSTEM_DEFAULT_FLAGS*/ )
+{
+   // We need queues! 
+   gJobSystem = new JobSystem();
+   gJobSystem->queues = new JobQueue[job_category_count];
+   gJobSystem->signals = new Signal*[job_category_count];
+   gJobSystem->reserved_cpus = new std::vector<uint>[job_category_count];
+   gJobSystem->steal_orders = nullptr;
+   gJobSystem->queue_count = job_category_count;
+   gJobSystem->flags = flags;
+   gJobSystem->is_running = true;
+   gJobSystem->is_cancelling = false;
+
+   // relative thread counts are relative to what isn't reserved
+   std::vector<bool> taken = ReserveCpus();
+   int available = (int)std::thread::hardware_concurrency();
+   for (uint i = 0; i < job_category_count; ++i) {
+      available -= (int)gJobSystem->reserved_cpus[i].size();
+   }
+
+   int thread_count = generic_thread_count;
+   if (thread_count <= 0) {
+      thread_count += available;
+   }
+   thread_count = (thread_count > 0) ? thread_count : 1; // always want at least one;
+
+   for (uint i = 0; i < job_category_count; ++i) {
+      gJobSystem->signals[i] = nullptr;
+   }
+
+   for (uint i = 0; i < JOB_PRIORITY_COUNT; ++i) {
+      gPriorityAgeOps[i] = TimeOpCountFrom_ms( JOB_PRIORITY_AGE_MS[i] );
+   }
+
+   // workers must all exist before any thread starts - they steal from each other.
+   gJobSystem->worker_count = (uint)thread_count;
+   gJobSystem->exited_count = 0;
+   gJobSystem->idle_count = 0;
+   gJobSystem->workers = new JobWorker[thread_count];
+   for (uint i = 0; i < gJobSystem->worker_count; ++i) {
+      gJobSystem->workers[i].index = i;
+      gJobSystem->workers[i].cpu = JOB_CPU_NONE;
+      gJobSystem->workers[i].steal_order = nullptr;
+      gJobSystem->workers[i].is_sleeping = 0;
+   }
+
+   if (flags & JOB_SYSTEM_FLAG_PIN_WORKERS) {
+      PlaceWorkers( taken );
+   }
+
+   // reuse any threads a previous shutdown kept around before making new ones
+   for (uint i = 0; i < gJobSystem->worker_count; ++i) {
+      JobWorker *worker = &gJobSystem->workers[i];
+
+      job_thread_t *thread;
+      if (!gParkedThreads.empty()) {
+         thread = gParkedThreads.back();
+         gParkedThreads.pop_back();
+      } else {
+         thread = new job_thread_t();
+         thread->command = JOB_THREAD_PARK;
+         thread->handle = ThreadCreate( GenericJobThread, thread );
+      }
+
+      worker->thread = thread;
+      thread->worker = worker;
+      SetThreadCommand( thread, JOB_THREAD_RUN );
+   }
+}
+
+//------------------------------------------------------------------------
+void JobSystemShutdown( eJobShutdownPolicy policy /*= JOB_SHUTDOWN_DRAIN*/, bool keep_threads /*= false*/ )
+{
+   if (nullptr == gJobSystem) {
+      // nothing running - but still let go of anything kept from last time.
+      if (!keep_threads) {
+         for (uint i = 0; i < gParkedThreads.size(); ++i) {
+            DestroyJobThread( gParkedThreads[i] );
+         }
+         gParkedThreads.clear();
+      }
+      return;
+   }
+
+   // Stop the workers - they finish [or cancel] whatever is left in the generic queues on the way out.
+   gJobSystem->is_cancelling = (JOB_SHUTDOWN_CANCEL == policy);
+   gJobSystem->is_running = false;
+
+   // a worker that was just about to park could miss a single wake up, so 
+   // keep poking until every one of them has made it out.
+   while (gJobSystem->exited_count < gJobSystem->worker_count) {
+      WakeWorkers( gJobSystem->worker_count );
+      ThreadYield();
+   }
+
+   // the other categories [and anything the last few jobs made ready]
+   FinishRemainingJobs();
+
+   for (uint i = 0; i < gJobSystem->worker_count; ++i) {
+      gParkedThreads.push_back( gJobSystem->workers[i].thread );
+   }
+
+   if (!keep_threads) {
+      for (uint i = 0; i < gParkedThreads.size(); ++i) {
+         DestroyJobThread( gParkedThreads[i] );
+      }
+      gParkedThreads.clear();
+   }
+
+   delete[] gJobSystem->workers;
+   delete[] gJobSystem->steal_orders;
+   delete[] gJobSystem->reserved_cpus;
+   delete[] gJobSystem->signals;
+   delete[] gJobSystem->queues;
+   delete gJobSystem;
+   gJobSystem = nullptr;
+}
+
+//------------------------------------------------------------------------
+void JobSystemSetSignal( uint category, Signal *signal )
+{
+   // not a proper category?  Return
+   if (category >= gJobSystem->queue_count) {
+      return; 
+   }
+
+   gJobSystem->signals[category] = signal;
+}
+
+//------------------------------------------------------------------------
+JobQueue* JobSystemGetQueue(uint category)
+{
+   // not a proper category?  Return
+   if (category >= gJobSystem->queue_count) {
+      return nullptr;
+   }
+
+   // notice I return a POINTER to the queue
+   // there is only ever one unique queue, and the consumers just reference it.
+   return &(gJobSystem->queues[category]);
+}
+
+//------------------------------------------------------------------------
+uint JobSystemGetWorkerCount()
+{
+   return (nullptr != gJobSystem) ? gJobSystem->worker_count : 0;
+}
+
+//------------------------------------------------------------------------
+int JobSystemGetCurrentWorkerIndex()
+{
+   return (nullptr != tWorker) ? (int)tWorker->index : -1;
+}
+
+//------------------------------------------------------------------------
+void JobSystemGetQueueDepths( std::vector<uint> *queues, std::vector<uint> *deques )
+{
+   queues->clear();
+   deques->clear();
+   if (nullptr == gJobSystem) {
+      return;
+   }
+
+   for (uint i = 0; i < gJobSystem->queue_count; ++i) {
+      queues->push_back( gJobSystem->queues[i].size_approx() );
+   }
+   for (uint i = 0; i < gJobSystem->worker_count; ++i) {
+      deques->push_back( gJobSystem->workers[i].deque.size_approx() );
+   }
+}
+
+//------------------------------------------------------------------------
+void JobSystemReserveCores( uint category, uint core_count )
+{
+   if (category >= gReservedCoreCounts.size()) {
+      gReservedCoreCounts.resize( category + 1, 0 );
+   }
+   gReservedCoreCounts[category] = core_count;
+}
+
+//------------------------------------------------------------------------
+bool JobSystemPinCurrentThread( uint category )
+{
+   if ((nullptr == gJobSystem) || (category >= gJobSystem->queue_count)) {
+      return false;
+   }
+
+   std::vector<uint> const &cpus = gJobSystem->reserved_cpus[category];
+   return !cpus.empty() && CpuTopologyPinCurrentThread( cpus.data(), (uint)cpus.size() );
+}
+
+//------------------------------------------------------------------------
+void JobSystemGetWaitStats( uint category, job_wait_stats_t out[JOB_PRIORITY_COUNT] )
+{
+   JobQueue *queue = JobSystemGetQueue( category );
+   if (nullptr == queue) {
+      memset( out, 0, sizeof(job_wait_stats_t) * JOB_PRIORITY_COUNT );
+      return;
+   }
+
+   queue->get_stats( out );
+}
+
+//------------------------------------------------------------------------
+void JobSystemResetWaitStats()
+{
+   for (uint i = 0; i < gJobSystem->queue_count; ++i) {
+      gJobSystem->queues[i].reset_stats();
+   }
+}
+
+//------------------------------------------------------------------------
+void JobSystemPrintWaitStats()
+{
+   static char const *PRIORITY_NAMES[JOB_PRIORITY_COUNT] = { "critical", "high", "normal", "low" };
+
+   for (uint cat = 0; cat < gJobSystem->queue_count; ++cat) {
+      job_wait_stats_t stats[JOB_PRIORITY_COUNT];
+      JobSystemGetWaitStats( cat, stats );
+
+      for (uint pri = 0; pri < JOB_PRIORITY_COUNT; ++pri) {
+         job_wait_stats_t const &stat = stats[pri];
+         if (0 == stat.count) {
+            continue;
+         }
+
+         printf( "  queue %u [%-8s] %6u jobs, wait avg %8.3f ms, max %8.3f ms, %u deadlines missed\n",
+            cat, PRIORITY_NAMES[pri], stat.count,
+            TimeOpCountTo_ms( stat.total_wait_op ) / (double)stat.count,
+            TimeOpCountTo_ms( stat.max_wait_op ),
+            stat.deadline_misses );
+      }
+   }
+}
+
+//------------------------------------------------------------------------
+Job* JobCreate( eJobType type, job_work_cb work_cb, void *user_data )
+{
+   Job *job = JobPoolAlloc();
+   if (nullptr == job) {
+      return nullptr;
+   }
+
+   job->type = type;
+   job->state = JOB_STATE_WAITING;
+   job->work_cb = work_cb;
+   job->user_data = user_data;
+   job->dependancy_count = 1;
+   job->ref_count = 1;
+   job->priority = JOB_PRIORITY_NORMAL;
+   job->deadline_op = 0;
+   job->enqueue_op = 0;
+   job->dependents_lock = 0;
+   job->is_suspended = false;
+   job->finish_cb = nullptr;
+   job->dependents.clear();
+   job->payload_vtable = nullptr;
+   job->cancel_token = nullptr;
+   JOB_TRACE_ASSIGN_ID( job );
+
+   return job;
+}
+
+//------------------------------------------------------------------------
+void* JobPayloadAlloc( size_t size )
+{
+   if (size > JOB_PAYLOAD_POOL_SIZE) {
+      AtomicIncrement( &gJobHeapAllocCount );
+      return ::malloc( size );
+   }
+
+   void *ptr = gJobPayloadPool.try_alloc();
+   if (nullptr == ptr) {
+      AtomicIncrement( &gJobHeapAllocCount );
+      ptr = ::malloc( JOB_PAYLOAD_POOL_SIZE );
+   }
+   return ptr;
+}
+
+//------------------------------------------------------------------------
+void JobPayloadFree( void *ptr, size_t size )
+{
+   if (size > JOB_PAYLOAD_POOL_SIZE) {
+      ::free( ptr );
+   } else {
+      gJobPayloadPool.free( ptr );
+   }
+}
+
+//------------------------------------------------------------------------
+void JobAcquire( Job *job )
+{
+   AtomicIncrement( &job->ref_count );
+}
+
+//------------------------------------------------------------------------
+void JobRelease( Job *job )
+{
+   // remove a reference - if we're the last one, delete me!
+   uint ref_count = AtomicDecrement( &job->ref_count );
+   if (0 == ref_count) {
+      JobPoolFree( job );
+   }
+}
+
+//------------------------------------------------------------------------
+// Generic work that becomes ready on a worker stays with that worker - 
+// others will steal it if they run dry.  Only normal priority work though, 
+// everything else goes through the queue so it is run in order of urgency.
+static inline bool CanKeepOnWorker( Job *job )
+{
+   return (JOB_GENERIC == job->type) && (JOB_PRIORITY_NORMAL == job->priority) && (0 == job->deadline_op);
+}
+
+//------------------------------------------------------------------------
+// Jobs that just became ready [already acquired for the queue].  One push for 
+// what we keep, one per category for the rest, and a wake up per new job.
+static void EnqueueReadyJobs( Job **ready, uint count )
+{
+   uint generic_count = 0;
+
+   uint first = 0;
+   if ((nullptr != tWorker) && IsStealingEnabled()) {
+      for (uint i = 0; i < count; ++i) {
+         if (CanKeepOnWorker( ready[i] )) {
+            JOB_TRACE_ENQUEUE( ready[i] );
+            std::swap( ready[first], ready[i] );
+            ++first;
+         }
+      }
+
+      if (first > 0) {
+         tWorker->deque.push_batch( ready, first );
+         generic_count += first;
+      }
+   }
+
+   // whatever is left, a category at a time [almost always just the one]
+   while (first < count) {
+      uint type = ready[first]->type;
+      uint end = first;
+      for (uint i = first; i < count; ++i) {
+         if (ready[i]->type == type) {
+            std::swap( ready[end], ready[i] );
+            ++end;
+         }
+      }
+
+      gJobSystem->queues[type].enqueue_batch( ready + first, end - first );
+      if (JOB_GENERIC == type) {
+         generic_count += end - first;
+      }
+
+      // IF a signal is associated with this job type, signal it - once per new job, so
+      // no more consumers get up than there is work for.
+      Signal *signal = gJobSystem->signals[type];
+      if (nullptr != signal) {
+         signal->signal_n( end - first );
+      }
+
+      first = end;
+   }
+
+   if (generic_count > 0) {
+      WakeWorkers( generic_count );
+   }
+}
+
+//------------------------------------------------------------------------
+// pass_reference - the caller's reference on each job goes to the queue if it is 
+// ready, or is released if it isn't.  Saves an acquire and a release per job.
+static void DispatchJobs( Job **jobs, uint count, bool pass_reference )
+{
+   Job *ready[JOB_DISPATCH_CHUNK_SIZE];
+
+   uint i = 0;
+   while (i < count) {
+      uint ready_count = 0;
+      for (; (i < count) && (ready_count < JOB_DISPATCH_CHUNK_SIZE); ++i) {
+         Job *job = jobs[i];
+
+         // if I'm not ready to run, don't. 
+         uint dcount = AtomicDecrement( &job->dependancy_count );
+         if (dcount != 0) {
+            if (pass_reference) {
+               JobRelease( job );
+            }
+            continue; 
+         }
+
+         // update my state
+         job->state = JOB_STATE_ENQUEUED; 
+
+         // I'm being qneueued - so the queue now holds a reference to me
+         // do this BEFORE qneueing to prevent the job system
+         // from potentially releasing before I have a chance to acquire.
+         if (!pass_reference) {
+            JobAcquire( job );
+         }
+         ready[ready_count] = job;
+         ++ready_count;
+      }
+
+      if (ready_count > 0) {
+         EnqueueReadyJobs( ready, ready_count );
+      }
+   }
+}
+
+//------------------------------------------------------------------------
+void JobDispatch( Job *job )
+{
+   DispatchJobs( &job, 1, false );
+}
+
+//------------------------------------------------------------------------
+void JobDispatchBatch( Job **jobs, uint count )
+{
+   DispatchJobs( jobs, count, false );
+}
+
+//------------------------------------------------------------------------
+JobHandle JobDispatchAndRelease( Job *job )
+{
+   // grab it first - once dispatched the job can finish and be recycled at any time
+   JobHandle handle = JobGetHandle( job );
+   DispatchJobs( &job, 1, true );
+   return handle;
+}
+
+//------------------------------------------------------------------------
+JobHandle JobGetHandle( Job *job )
+{
+   JobHandle handle;
+   handle.slot = job->slot;
+   handle.generation = job->generation;
+   return handle;
+}
+
+//------------------------------------------------------------------------
+bool JobIsFinished( JobHandle handle )
+{
+   if (!handle.is_valid()) {
+      return true;
+   }
+
+   // State first - if the generation still matches after, the state was this job's.
+   // Any other generation means ours finished and the slot moved on.
+   Job *job = GetJobInSlot( handle.slot );
+   eJobState state = job->state;
+   return (JOB_STATE_FINISHED == state) || (job->generation != handle.generation);
+}
+
+//------------------------------------------------------------------------
+bool JobHandle::is_finished() const
+{
+   return JobIsFinished( *this );
+}
+
+
+//------------------------------------------------------------------------
+void JobWait( Job *job, JobConsumer *consumer )
+{
+   JobWait( JobGetHandle( job ), consumer );
+}
+
+//------------------------------------------------------------------------
+void JobWait( JobHandle handle, JobConsumer *consumer )
+{
+   if (!handle.is_valid()) {
+      return;
+   }
+
+   Job *job = GetJobInSlot( handle.slot );
+
+   // only need to wake up on our own if we're the one that has to run what's in the consumer
+   DWORD park_ms = INFINITE;
+   if (nullptr != consumer) {
+      JobQueue *generic_queue = JobSystemGetQueue( JOB_GENERIC );
+      for (uint i = 0; i < consumer->queues.size(); ++i) {
+         if (consumer->queues[i] != generic_queue) {
+            park_ms = JOB_WAIT_PARK_MS;
+         }
+      }
+   }
+
+   uint spins = 0;
+   while (!JobIsFinished( handle )) {
+      // help out if there is anything to do
+      if (((nullptr != consumer) && consumer->consume_job()) || RunGenericJob()) {
+         spins = 0;
+         continue;
+      }
+
+      // nothing - the job is likely running somewhere and may be close to done.
+      if (spins < JOB_WAIT_SPIN_COUNT) {
+         ++spins;
+         YieldProcessor();
+         continue;
+      }
+
+      // and give up the core till it finishes.
+      ParkOnJob( job, handle.generation, park_ms );
+      spins = 0;
+   }
+}
+
+//------------------------------------------------------------------------
+JobCancelToken* JobCancelTokenCreate()
+{
+   JobCancelToken *token = new JobCancelToken();
+   token->cancelled = 0;
+   token->ref_count = 1;
+   return token;
+}
+
+//------------------------------------------------------------------------
+void JobCancelTokenAcquire( JobCancelToken *token )
+{
+   AtomicIncrement( &token->ref_count );
+}
+
+//------------------------------------------------------------------------
+void JobCancelTokenRelease( JobCancelToken *token )
+{
+   if (0 == AtomicDecrement( &token->ref_count )) {
+      delete token;
+   }
+}
+
+//------------------------------------------------------------------------
+void JobCancel( JobCancelToken *token )
+{
+   token->cancelled = 1;
+}
+
+//------------------------------------------------------------------------
+// Only the first token sticks - the job owns a reference to it once it does.
+static void AttachCancelToken( Job *job, JobCancelToken *token )
+{
+   if (nullptr == CompareAndSetPointer( &job->cancel_token, (JobCancelToken*)nullptr, token )) {
+      JobCancelTokenAcquire( token );
+   }
+}
+
+//------------------------------------------------------------------------
+// Parents hold a reference to each dependent until they finish, and can't finish
+// while we hold their lock - so everything we walk stays alive.
+static void AttachCancelTokenToDependents( Job *job, JobCancelToken *token )
+{
+   LockDependents( job );
+   if (!job->is_finished()) {
+      for (uint i = 0; i < job->dependents.size(); ++i) {
+         Job *dependent = job->dependents[i];
+         AttachCancelToken( dependent, token );
+         AttachCancelTokenToDependents( dependent, token );
+      }
+   }
+   UnlockDependents( job );
+}
+
+//------------------------------------------------------------------------
+void JobSetCancelToken( Job *job, JobCancelToken *token, bool include_dependents /*= false*/ )
+{
+   AttachCancelToken( job, token );
+   if (include_dependents) {
+      AttachCancelTokenToDependents( job, token );
+   }
+}
+
+//------------------------------------------------------------------------
+bool JobIsCurrentCancelled()
+{
+   return (nullptr != tCurrentJob) && tCurrentJob->is_cancelled();
+}
+
+//------------------------------------------------------------------------
+bool JobSuspendOn( Job *job, Job *awaited )
+{
+   // Hold on to ourselves so we can't be dispatched again before the
+   // thread running us is done with us [RunJob releases this]
+   AtomicIncrement( &job->dependancy_count );
+
+   if (!job->dependent_on( awaited )) {
+      AtomicDecrement( &job->dependancy_count );
+      return false;
+   }
+
+   job->set_state( JOB_STATE_WAITING );
+   job->is_suspended = true;
+   return true;
+}
+
+//------------------------------------------------------------------------
+void JobWaitAndRelease( Job *job, JobConsumer *consumer )
+{
+   JobWait( job, consumer );
+   JobRelease( job );
+}
+
+
+//--------------------------------------------------------------------
+// Some test code - make sure I did the thing right! 
+//--------------------------------------------------------------------
+
+
+//--------------------------------------------------------------------
+static void EmptyJob( void *ptr )
+{
+   uint *count_ptr = (uint*)ptr;
+   AtomicIncrement( count_ptr );
+}
+
+//--------------------------------------------------------------------
+static bool gDone = false;
+static void OnEverythingDone( void *ptr )
+{
+   uint *count_ptr = (uint*)ptr;
+
+   // assert count_ptr is 1000 [make sure all other jobs got to run first!]
+   uint count = *count_ptr; 
+   if (count != 1000) {
+      __debugbreak();
+   }
+
+   gDone = true;
+}
+
+//--------------------------------------------------------------------
+void JobSystemTest()
+{
+   JobSystemStartup( JOB_TYPE_COUNT );
+
+
+   // Make sure creating and releasing work [does not dispatch - job does not run!]
+   Job *job = JobCreate( JOB_GENERIC, EmptyJob, nullptr );
+   JobRelease( job );
+
+   // Next, lets kick off jobs, and make sure they're freeing up.
+   {
+      PROFILE_LOG_SCOPE("JobDispatchAndReleaseTime");
+      uint count = 0;
+      Job *final_job = JobCreate( JOB_GENERIC, OnEverythingDone, &count );
+
+      for (uint i = 0; i < 1000; ++i) {
+         job = JobCreate( JOB_GENERIC, EmptyJob, &count );
+         final_job->dependent_on( job );
+         JobDispatchAndRelease( job );
+      }
+
+      // now I can dispatch myself [if I do it first, it has no dependancies and will immediately run]
+      JobDispatch( final_job );
+
+      // wait for it to finish
+      JobWaitAndRelease( final_job );
+
+      // And after this is done, I should KNOW the count is 1000 [1001 jobs ran]
+      if (count != 1000) {
+         __debugbreak();
+      }
+   }
+
+   JobSystemShutdown();
+}
+
+//--------------------------------------------------------------------
+void JobAllocationTest()
+{
+   uint const ITERATIONS = 1000;
+   uint const JOBS_PER_ITERATION = 1001; // 1000 children + the final job
+
+   JobSystemStartup( JOB_TYPE_COUNT );
+
+   // first pass warms the pool - the second is the steady state we care about.
+   for (uint pass = 0; pass < 2; ++pass) {
+      uint start_allocs = gJobHeapAllocCount;
+      uint64_t start_op = TimeGetOpCount();
+
+      for (uint iter = 0; iter < ITERATIONS; ++iter) {
+         uint count = 0;
+         Job *final_job = JobCreate( JOB_GENERIC, EmptyJob, &count );
+         for (uint i = 0; i < 1000; ++i) {
+            Job *job = JobCreate( JOB_GENERIC, EmptyJob, &count );
+            final_job->dependent_on( job );
+            JobDispatchAndRelease( job );
+         }
+
+         JobDispatch( final_job );
+         JobWaitAndRelease( final_job );
+      }
+
+      uint64_t elapsed = TimeGetOpCount() - start_op;
+      uint allocs = gJobHeapAllocCount - start_allocs;
+      double job_count = (double)(ITERATIONS * JOBS_PER_ITERATION);
+
+      printf( "JobAllocationTest [%s]: %.4f allocs/job, %.1f ns/job\n", 
+         (pass == 0) ? "cold" : "warm",
+         (double)allocs / job_count, 
+         TimeOpCountTo_ms(elapsed) * 1000000.0 / job_count );
+   }
+
+   JobSystemShutdown();
+}
+
+//--------------------------------------------------------------------
+struct wait_test_t
+{
+   uint64_t finish_op;  // when the job ran [the waiter compares against this]
+};
+
+//--------------------------------------------------------------------
+static void RecordFinishJob( void *ptr )
+{
+   wait_test_t *test = (wait_test_t*)ptr;
+   test->finish_op = TimeGetOpCount();
+}
+
+//--------------------------------------------------------------------
+// plays the part of whatever the job is waiting on [IO, another system, etc]
+static void KickJobThread( Job *job, uint delay_ms )
+{
+   if (delay_ms > 0) {
+      ThreadSleep( delay_ms );
+   }
+   JobDispatch( job );
+}
+
+//--------------------------------------------------------------------
+static uint64_t GetThreadCPUTime_us()
+{
+   FILETIME creation, exit, kernel, user;
+   ::GetThreadTimes( ::GetCurrentThread(), &creation, &exit, &kernel, &user );
+
+   uint64_t kernel_time = ((uint64_t)kernel.dwHighDateTime << 32) | kernel.dwLowDateTime;
+   uint64_t user_time = ((uint64_t)user.dwHighDateTime << 32) | user.dwLowDateTime;
+   return (kernel_time + user_time) / 10; // 100ns units
+}
+
+//--------------------------------------------------------------------
+static void RunWaitTest( char const *name, uint iterations, uint delay_ms, bool spin )
+{
+   uint64_t total_latency = 0;
+   uint64_t start_cpu = GetThreadCPUTime_us();
+   uint64_t start_op = TimeGetOpCount();
+
+   for (uint i = 0; i < iterations; ++i) {
+      wait_test_t test;
+      Job *job = JobCreate( JOB_GENERIC, RecordFinishJob, &test );
+      thread_handle_t kicker = ThreadCreate( KickJobThread, job, delay_ms );
+
+      if (spin) {
+         // what JobWait used to do without a consumer
+         while (!job->is_finished());
+      } else {
+         JobWait( job );
+      }
+
+      total_latency += TimeGetOpCount() - test.finish_op;
+      ThreadJoin( kicker );
+      JobRelease( job );
+   }
+
+   uint64_t wall_us = TimeOpCountTo_us( TimeGetOpCount() - start_op );
+   uint64_t cpu_us = GetThreadCPUTime_us() - start_cpu;
+
+   printf( "JobWaitTest [%s, %s]: %.1f us avg wake latency, %.0f%% of a core while waiting\n",
+      name, 
+      spin ? "spin" : "JobWait",
+      TimeOpCountTo_ms(total_latency) * 1000.0 / (double)iterations,
+      (wall_us > 0) ? (100.0 * (double)cpu_us / (double)wall_us) : 0.0 );
 }
 
 //--------------------------------------------------------------------
-void JobSystemTest()
+void JobWaitTest()
 {
    JobSystemStartup( JOB_TYPE_COUNT );
 
+   for (uint spin = 0; spin < 2; ++spin) {
+      RunWaitTest( "short", 1000, 0, spin != 0 );
+      RunWaitTest( "long 5ms", 100, 5, spin != 0 );
+   }
 
-   // Make sure creating and releasing work [does not dispatch - job does not run!]
-   Job *job = JobCreate( JOB_GENERIC, EmptyJob, nullptr );
-   JobRelease( job );
+   JobSystemShutdown();
+}
 
-   // Next, lets kick off jobs, and make sure they're freeing up.
+//--------------------------------------------------------------------
+static void BackgroundJob( void *ptr )
+{
+   // ~20us of "work"
+   uint64_t end_op = TimeGetOpCount() + TimeOpCountFrom_ms( 0.02 );
+   while (TimeGetOpCount() < end_op);
+
+   AtomicIncrement( (uint*)ptr );
+}
+
+//--------------------------------------------------------------------
+struct high_stream_t
+{
+   uint volatile running;
+   uint sent;
+   uint done;
+};
+
+static void HighStreamJob( void *ptr );
+
+//--------------------------------------------------------------------
+static void DispatchHighStreamJob( high_stream_t *stream )
+{
+   AtomicIncrement( &stream->sent );
+   Job *job = JobCreate( JOB_GENERIC, HighStreamJob, stream );
+   job->set_priority( JOB_PRIORITY_HIGH );
+   JobDispatchAndRelease( job );
+}
+
+//--------------------------------------------------------------------
+static void HighStreamJob( void *ptr )
+{
+   high_stream_t *stream = (high_stream_t*)ptr;
+   if (stream->running) {
+      DispatchHighStreamJob( stream );
+   }
+
+   uint64_t end_op = TimeGetOpCount() + TimeOpCountFrom_ms( 0.02 );
+   while (TimeGetOpCount() < end_op);
+
+   AtomicIncrement( &stream->done );
+}
+
+//--------------------------------------------------------------------
+void JobPriorityTest()
+{
+   uint const BACKGROUND_JOBS = 5000;
+
+   JobSystemStartup( JOB_TYPE_COUNT );
+
+   for (uint use_priority = 0; use_priority < 2; ++use_priority) {
+      JobSystemResetWaitStats();
+
+      // a pile of background work...
+      uint count = 0;
+      for (uint i = 0; i < BACKGROUND_JOBS; ++i) {
+         Job *job = JobCreate( JOB_GENERIC, BackgroundJob, &count );
+         if (use_priority) {
+            job->set_priority( JOB_PRIORITY_LOW );
+         }
+         JobDispatchAndRelease( job );
+      }
+
+      // ...and then something the frame needs right now, plus something it needs soon.
+      uint deadline_count = 0;
+      Job *deadline_job = JobCreate( JOB_GENERIC, EmptyJob, &deadline_count );
+      if (use_priority) {
+         deadline_job->set_deadline_ms( 1.0 );
+      }
+      JobDispatchAndRelease( deadline_job );
+
+      wait_test_t test;
+      Job *critical = JobCreate( JOB_GENERIC, RecordFinishJob, &test );
+      if (use_priority) {
+         critical->set_priority( JOB_PRIORITY_CRITICAL );
+      }
+
+      uint64_t start_op = TimeGetOpCount();
+      JobDispatch( critical );
+      JobWaitAndRelease( critical );
+
+      uint background_done = count;
+
+      // background work still all gets done
+      while ((count < BACKGROUND_JOBS) || (0 == deadline_count)) {
+         ThreadYield();
+      }
+
+      printf( "JobPriorityTest [%s]: critical job done %.3f ms after dispatch, %u of %u background jobs were done first\n", 
+         use_priority ? "priorities" : "all normal",
+         TimeOpCountTo_ms( test.finish_op - start_op ),
+         background_done, BACKGROUND_JOBS );
+      JobSystemPrintWaitStats();
+   }
+
+   // Normal work still gets through a steady stream of high priority work - it only
+   // waits out the difference in their allowances
    {
-      PROFILE_LOG_SCOPE("JobDispatchAndReleaseTime");
+      uint const NORMAL_JOBS = 8;
+      uint normal_done = 0;
+      for (uint i = 0; i < NORMAL_JOBS; ++i) {
+         JobDispatchAndRelease( JobCreate( JOB_GENERIC, BackgroundJob, &normal_done ) );
+      }
+
+      // every high priority job queues its own replacement, so the backlog never runs dry
+      high_stream_t stream;
+      stream.running = 1;
+      stream.sent = 0;
+      stream.done = 0;
+      for (uint i = 0; i < 64; ++i) {
+         DispatchHighStreamJob( &stream );
+      }
+
+      uint64_t const start_op = TimeGetOpCount();
+      uint64_t const give_up_op = start_op + TimeOpCountFrom_ms( 1000.0 );
+      while ((normal_done < NORMAL_JOBS) && (TimeGetOpCount() < give_up_op)) {
+         ThreadYield();
+      }
+      uint64_t const normal_op = TimeGetOpCount() - start_op;
+      uint const normal_done_in_time = normal_done;
+
+      stream.running = 0;
+      while (stream.done < stream.sent) {
+         ThreadYield();
+      }
+
+      // starved - it only got to run once the stream stopped
+      if (normal_done_in_time < NORMAL_JOBS) {
+         __debugbreak();
+      }
+
+      printf( "JobPriorityTest [high stream]: %u normal jobs done %.3f ms in, %u high priority jobs ran before the stream stopped\n", 
+         NORMAL_JOBS, TimeOpCountTo_ms( normal_op ), stream.done );
+   }
+
+   JobSystemShutdown();
+}
+
+//--------------------------------------------------------------------
+void JobSystemRestartTest()
+{
+   uint const CYCLES = 64;
+
+   for (uint keep_threads = 0; keep_threads < 2; ++keep_threads) {
+      uint64_t startup_op = 0;
+      uint64_t shutdown_op = 0;
       uint count = 0;
-      Job *final_job = JobCreate( JOB_GENERIC, OnEverythingDone, &count );
 
-      for (uint i = 0; i < 1000; ++i) {
-         job = JobCreate( JOB_GENERIC, EmptyJob, &count );
+      for (uint i = 0; i < CYCLES; ++i) {
+         uint64_t start_op = TimeGetOpCount();
+         JobSystemStartup( JOB_TYPE_COUNT );
+         startup_op += TimeGetOpCount() - start_op;
+
+         // a little work each time - half of it drained on shutdown, the other half cancelled
+         for (uint j = 0; j < 100; ++j) {
+            JobDispatchAndRelease( JobCreate( JOB_GENERIC, EmptyJob, &count ) );
+         }
+
+         start_op = TimeGetOpCount();
+         JobSystemShutdown( (i & 1) ? JOB_SHUTDOWN_CANCEL : JOB_SHUTDOWN_DRAIN, keep_threads != 0 );
+         shutdown_op += TimeGetOpCount() - start_op;
+      }
+
+      // let go of whatever was kept
+      JobSystemShutdown();
+
+      // every drained cycle must have run all of its jobs
+      if (count < (CYCLES / 2) * 100) {
+         __debugbreak();
+      }
+
+      printf( "JobSystemRestartTest [%s]: %u cycles, startup %.1f us, shutdown %.1f us\n", 
+         keep_threads ? "keep threads" : "new threads",
+         CYCLES,
+         TimeOpCountTo_ms( startup_op ) * 1000.0 / (double)CYCLES,
+         TimeOpCountTo_ms( shutdown_op ) * 1000.0 / (double)CYCLES );
+   }
+}
+
+//--------------------------------------------------------------------
+// Each node spawns two children from whatever worker it ran on - this is
+// the case that hammers the shared queue, and what the deques are for.
+static uint gSpawnCount = 0;
+static void SpawnTreeJob( void *ptr )
+{
+   uint depth = (uint)(uintptr_t)ptr;
+   AtomicIncrement( &gSpawnCount );
+
+   if (depth > 0) {
+      for (uint i = 0; i < 2; ++i) {
+         Job *child = JobCreate( JOB_GENERIC, SpawnTreeJob, (void*)(uintptr_t)(depth - 1) );
+         JobDispatchAndRelease( child );
+      }
+   }
+}
+
+//--------------------------------------------------------------------
+static void RunScalingTest( uint thread_count, uint flags )
+{
+   uint const FAN_IN_ITERATIONS = 100;
+   uint const FAN_IN_JOBS = 1000;
+   uint const TREE_DEPTH = 15; 
+   uint const TREE_JOBS = (2U << TREE_DEPTH) - 1;
+
+   char const *mode = (flags & JOB_SYSTEM_FLAG_WORK_STEALING) ? "stealing" : "single queue";
+   char name[128];
+
+   JobSystemStartup( JOB_TYPE_COUNT, (int)thread_count, flags );
+
+   // Fan-in - same shape as JobSystemTest, everything injected from the main thread.
+   {
+      sprintf_s( name, 128, "[%2u threads, %s] fan-in %u x %u", thread_count, mode, FAN_IN_ITERATIONS, FAN_IN_JOBS );
+      PROFILE_LOG_SCOPE(name);
+
+      for (uint iter = 0; iter < FAN_IN_ITERATIONS; ++iter) {
+         uint count = 0;
+         Job *final_job = JobCreate( JOB_GENERIC, EmptyJob, &count );
+         for (uint i = 0; i < FAN_IN_JOBS; ++i) {
+            Job *job = JobCreate( JOB_GENERIC, EmptyJob, &count );
+            final_job->dependent_on( job );
+            JobDispatchAndRelease( job );
+         }
+
+         JobDispatch( final_job );
+         JobWaitAndRelease( final_job );
+      }
+   }
+
+   // Recursive spawn - work created on the workers themselves.
+   {
+      sprintf_s( name, 128, "[%2u threads, %s] spawn tree %u", thread_count, mode, TREE_JOBS );
+      PROFILE_LOG_SCOPE(name);
+
+      gSpawnCount = 0;
+      Job *root = JobCreate( JOB_GENERIC, SpawnTreeJob, (void*)(uintptr_t)TREE_DEPTH );
+      JobDispatchAndRelease( root );
+
+      while (gSpawnCount < TREE_JOBS) {
+         ThreadYield();
+      }
+   }
+
+   JobSystemShutdown();
+}
+
+//--------------------------------------------------------------------
+void JobSystemScalingTest()
+{
+   uint max_threads = (uint)std::thread::hardware_concurrency();
+   max_threads = (max_threads > 0) ? max_threads : 1;
+
+   uint thread_count = 1;
+   while (true) {
+      RunScalingTest( thread_count, 0 );
+      RunScalingTest( thread_count, JOB_SYSTEM_FLAG_WORK_STEALING );
+      printf( "\n" );
+
+      if (thread_count == max_threads) {
+         break;
+      }
+      thread_count = ((thread_count * 2) < max_threads) ? (thread_count * 2) : max_threads;
+   }
+}
+
+//--------------------------------------------------------------------
+void JobDispatchBatchTest()
+{
+   uint const JOB_COUNT = 4096 * 4;
+   uint const BATCH_SIZES[] = { 1, 16, 256, 4096 };
+
+   JobSystemStartup( JOB_TYPE_COUNT );
+
+   std::vector<Job*> jobs( JOB_COUNT );
+   for (uint b = 0; b < (sizeof(BATCH_SIZES) / sizeof(BATCH_SIZES[0])); ++b) {
+      uint const batch_size = BATCH_SIZES[b];
+
+      uint count = 0;
+      for (uint i = 0; i < JOB_COUNT; ++i) {
+         jobs[i] = JobCreate( JOB_GENERIC, EmptyJob, &count );
+      }
+
+      // only the dispatches are timed - workers are running the first ones while we go
+      uint64_t start_op = TimeGetOpCount();
+      for (uint i = 0; i < JOB_COUNT; i += batch_size) {
+         JobDispatchBatch( &jobs[i], batch_size );
+      }
+      uint64_t op = TimeGetOpCount() - start_op;
+
+      for (uint i = 0; i < JOB_COUNT; ++i) {
+         JobRelease( jobs[i] );
+      }
+      while (count < JOB_COUNT) {
+         ThreadYield();
+      }
+
+      printf( "JobDispatchBatchTest [batch %4u]: %.1f ns per job\n",
+         batch_size, 
+         TimeOpCountTo_ms( op ) * 1000000.0 / (double)JOB_COUNT );
+   }
+
+   JobSystemShutdown();
+}
+
+//--------------------------------------------------------------------
+void JobHandleTest()
+{
+   uint const JOB_COUNT = 64 * 1024;
+
+   JobSystemStartup( JOB_TYPE_COUNT );
+
+   // a recycled slot - the old handle stays finished, the new one isn't
+   {
+      Job *old_job = JobCreate( JOB_GENERIC, EmptyJob, nullptr );
+      JobHandle old_handle = JobGetHandle( old_job );
+      JobRelease( old_job );
+
+      uint count = 0;
+      Job *new_job = JobCreate( JOB_GENERIC, EmptyJob, &count );
+      JobHandle new_handle = JobGetHandle( new_job );
+      if ((new_job->slot == old_handle.slot) && (!old_handle.is_finished() || new_handle.is_finished())) {
+         __debugbreak();
+      }
+
+      JobDispatchAndRelease( new_job );
+      JobWait( new_handle );
+      JobWait( old_handle );  // returns right away
+      if (1 != count) {
+         __debugbreak();
+      }
+   }
+
+   std::vector<Job*> jobs( JOB_COUNT );
+   std::vector<JobHandle> handles( JOB_COUNT );
+   for (uint pass = 0; pass < 2; ++pass) {
+      uint count = 0;
+
+      // holding a reference to every job until we've waited on it
+      uint64_t start_op = TimeGetOpCount();
+      for (uint i = 0; i < JOB_COUNT; ++i) {
+         jobs[i] = JobCreate( JOB_GENERIC, EmptyJob, &count );
+         JobDispatch( jobs[i] );
+      }
+      for (uint i = 0; i < JOB_COUNT; ++i) {
+         JobWaitAndRelease( jobs[i] );
+      }
+      uint64_t ref_op = TimeGetOpCount() - start_op;
+
+      // handles only - each job goes back to the pool as soon as it is done
+      start_op = TimeGetOpCount();
+      for (uint i = 0; i < JOB_COUNT; ++i) {
+         handles[i] = JobDispatchAndRelease( JobCreate( JOB_GENERIC, EmptyJob, &count ) );
+      }
+      for (uint i = 0; i < JOB_COUNT; ++i) {
+         JobWait( handles[i] );
+      }
+      uint64_t handle_op = TimeGetOpCount() - start_op;
+
+      if (count != (2 * JOB_COUNT)) {
+         __debugbreak();
+      }
+
+      printf( "JobHandleTest [pass %u]: Job* with references %.1f ns per job, handles %.1f ns per job\n",
+         pass,
+         TimeOpCountTo_ms( ref_op ) * 1000000.0 / (double)JOB_COUNT,
+         TimeOpCountTo_ms( handle_op ) * 1000000.0 / (double)JOB_COUNT );
+   }
+
+   JobSystemShutdown();
+}
+
+//--------------------------------------------------------------------
+struct lambda_test_params_t
+{
+   uint *count;
+   uint add;
+};
+
+//--------------------------------------------------------------------
+static void AddParamsJob( void *ptr )
+{
+   lambda_test_params_t *params = (lambda_test_params_t*)ptr;
+   AtomicAdd( params->count, params->add );
+   delete params;
+}
+
+//--------------------------------------------------------------------
+void JobLambdaTest()
+{
+   uint const JOB_COUNT = 64 * 1024;
+
+   JobSystemStartup( JOB_TYPE_COUNT );
+
+   std::vector<JobHandle> handles( JOB_COUNT );
+   for (uint pass = 0; pass < 2; ++pass) {
+      uint count = 0;
+
+      // the old way - a struct per job for its arguments
+      uint64_t start_op = TimeGetOpCount();
+      for (uint i = 0; i < JOB_COUNT; ++i) {
+         lambda_test_params_t *params = new lambda_test_params_t();
+         params->count = &count;
+         params->add = 1;
+         handles[i] = JobDispatchAndRelease( JobCreate( JOB_GENERIC, AddParamsJob, params ) );
+      }
+      for (uint i = 0; i < JOB_COUNT; ++i) {
+         JobWait( handles[i] );
+      }
+      uint64_t struct_op = TimeGetOpCount() - start_op;
+
+      // same arguments, captured
+      uint start_allocs = gJobHeapAllocCount;
+      start_op = TimeGetOpCount();
+      for (uint i = 0; i < JOB_COUNT; ++i) {
+         uint *count_ptr = &count;
+         uint add = 1;
+         handles[i] = JobDispatchAndRelease( JobCreate( JOB_GENERIC, [=]() { AtomicAdd( count_ptr, add ); } ) );
+      }
+      for (uint i = 0; i < JOB_COUNT; ++i) {
+         JobWait( handles[i] );
+      }
+      uint64_t lambda_op = TimeGetOpCount() - start_op;
+      uint lambda_allocs = gJobHeapAllocCount - start_allocs;
+
+      if (count != (2 * JOB_COUNT)) {
+         __debugbreak();
+      }
+
+      printf( "JobLambdaTest [pass %u]: parameter struct %.1f ns per job, lambda %.1f ns per job [%u job system allocations]\n",
+         pass,
+         TimeOpCountTo_ms( struct_op ) * 1000000.0 / (double)JOB_COUNT,
+         TimeOpCountTo_ms( lambda_op ) * 1000000.0 / (double)JOB_COUNT,
+         lambda_allocs );
+   }
+
+   // too big to keep inline - make sure the captures still come through, and get destroyed
+   {
+      std::vector<uint> values( 100, 1 );
+      uint total = 0;
+      uint big[32] = {};
+      uint huge[128] = {};
+      big[31] = 1;
+      huge[127] = 2;
+
+      Job *pool_job = JobCreate( JOB_GENERIC, [=, &total]() { total += big[31]; } );
+      Job *heap_job = JobCreate( JOB_GENERIC, [=, &total]() { total += (uint)values.size() + huge[127]; } );
+      heap_job->dependent_on( pool_job );
+
+      JobHandle handle = JobDispatchAndRelease( heap_job );
+      JobDispatchAndRelease( pool_job );
+      JobWait( handle );
+
+      if (103 != total) {
+         __debugbreak();
+      }
+   }
+
+   JobSystemShutdown();
+}
+
+//--------------------------------------------------------------------
+// Keeps going until it's cancelled [or a second passes]
+static void PollingJob( void *ptr )
+{
+   uint64_t end_op = TimeGetOpCount() + TimeOpCountFrom_ms( 1000.0 );
+   uint *started = (uint*)ptr;
+   *started = 1;
+
+   while (!JobIsCurrentCancelled() && (TimeGetOpCount() < end_op)) {
+      ThreadYield();
+   }
+}
+
+//--------------------------------------------------------------------
+struct cancel_frame_guard_t
+{
+   uint *destroyed;
+   ~cancel_frame_guard_t()    { AtomicIncrement( destroyed ); }
+};
+
+//--------------------------------------------------------------------
+// The guard lives in the frame, so it only goes when the frame does
+static JobTask SuspendedCoroutine( Job *gate, uint *started, uint *resumed, uint *destroyed )
+{
+   cancel_frame_guard_t guard = { destroyed };
+   *started = 1;
+
+   co_await JobAwait( gate );
+   *resumed = 1;
+}
+
+//--------------------------------------------------------------------
+void JobCancelTest()
+{
+   uint const SPECULATIVE_COUNT = 1000;
+
+   JobSystemStartup( JOB_TYPE_COUNT );
+
+   // speculative work waiting on a gate - cancelled before the gate opens.  What 
+   // depends on it [without the token] still has to run.
+   {
+      JobCancelToken *token = JobCancelTokenCreate();
+
+      uint count = 0;
+      uint gate_count = 0;
+      uint final_count = 0;
+      Job *gate = JobCreate( JOB_GENERIC, EmptyJob, &gate_count );
+      Job *final_job = JobCreate( JOB_GENERIC, EmptyJob, &final_count );
+      for (uint i = 0; i < SPECULATIVE_COUNT; ++i) {
+         Job *job = JobCreate( JOB_GENERIC, EmptyJob, &count );
+         JobSetCancelToken( job, token );
+         job->dependent_on( gate );
          final_job->dependent_on( job );
          JobDispatchAndRelease( job );
       }
+      JobHandle final_handle = JobDispatchAndRelease( final_job );
 
-      // now I can dispatch myself [if I do it first, it has no dependancies and will immediately run]
-      JobDispatch( final_job );
+      JobCancel( token );
+      JobCancelTokenRelease( token );   // the jobs keep it alive
 
-      // wait for it to finish
-      JobWaitAndRelease( final_job );
+      JobDispatchAndRelease( gate );
+      JobWait( final_handle );
 
-      // And after this is done, I should KNOW the count is 1000 [1001 jobs ran]
-      if (count != 1000) {
+      if ((0 != count) || (1 != final_count)) {
+         __debugbreak();
+      }
+      printf( "JobCancelTest [speculative]: %u of %u cancelled jobs ran, their dependent ran %u time\n", 
+         count, SPECULATIVE_COUNT, final_count );
+   }
+
+   // a whole chain from its root
+   {
+      JobCancelToken *token = JobCancelTokenCreate();
+
+      uint count = 0;
+      Job *root = JobCreate( JOB_GENERIC, EmptyJob, &count );
+      Job *prev = root;
+      for (uint i = 0; i < 16; ++i) {
+         Job *job = JobCreate( JOB_GENERIC, EmptyJob, &count );
+         job->dependent_on( prev );
+         if (prev != root) {
+            JobDispatchAndRelease( prev );
+         }
+         prev = job;
+      }
+      JobHandle last = JobDispatchAndRelease( prev );
+
+      JobSetCancelToken( root, token, true );
+      JobCancel( token );
+      JobCancelTokenRelease( token );
+
+      JobDispatchAndRelease( root );
+      JobWait( last );
+
+      if (0 != count) {
+         __debugbreak();
+      }
+   }
+
+   // already running - it has to notice for itself
+   {
+      JobCancelToken *token = JobCancelTokenCreate();
+
+      uint started = 0;
+      Job *job = JobCreate( JOB_GENERIC, PollingJob, &started );
+      JobSetCancelToken( job, token );
+      JobHandle handle = JobDispatchAndRelease( job );
+      while (0 == started) {
+         ThreadYield();
+      }
+
+      uint64_t start_op = TimeGetOpCount();
+      JobCancel( token );
+      JobWait( handle );
+      JobCancelTokenRelease( token );
+
+      printf( "JobCancelTest [running]: stopped %.3f ms after being cancelled\n", 
+         TimeOpCountTo_ms( TimeGetOpCount() - start_op ) );
+   }
+
+   // a coroutine suspended on a job - it never resumes, but its frame still has to be destroyed
+   {
+      JobCancelToken *token = JobCancelTokenCreate();
+
+      uint started = 0;
+      uint resumed = 0;
+      uint destroyed = 0;
+      uint gate_count = 0;
+      Job *gate = JobCreate( JOB_GENERIC, EmptyJob, &gate_count );
+      Job *job = JobCreateCoroutine( JOB_GENERIC, SuspendedCoroutine( gate, &started, &resumed, &destroyed ) );
+      JobSetCancelToken( job, token );
+      JobHandle handle = JobDispatchAndRelease( job );
+      while (0 == started) {
+         ThreadYield();
+      }
+
+      JobCancel( token );
+      JobCancelTokenRelease( token );
+
+      JobDispatchAndRelease( gate );
+      JobWait( handle );
+
+      // the frame goes when the job is recycled, which can be just after the wait returns
+      uint64_t end_op = TimeGetOpCount() + TimeOpCountFrom_ms( 1000.0 );
+      while ((0 == destroyed) && (TimeGetOpCount() < end_op)) {
+         ThreadYield();
+      }
+
+      if ((0 != resumed) || (1 != destroyed)) {
          __debugbreak();
       }
    }
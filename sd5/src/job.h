@@ -9,15 +9,40 @@
 /************************************************************************/
 #include "common.h"
 
-#include "ts_queue.h"
+#include "criticalsection.h"
 #include "signal.h"
 #include "atomic.h"
+#include "mpmc_queue.h"
+#include "job_trace.h"
+
+#include <queue>
+#include <vector>
+#include <new>
+#include <type_traits>
+#include <utility>
 
 /************************************************************************/
 /*                                                                      */
 /* DEFINES AND CONSTANTS                                                */
 /*                                                                      */
 /************************************************************************/
+// dependents stored in the job itself before spilling to the heap
+#define JOB_INLINE_DEPENDENT_COUNT (4)
+
+// normal priority jobs a queue holds without taking its lock - past this they spill to the locked FIFO
+#define JOB_QUEUE_LOCKLESS_CAPACITY (4096)
+
+// JobDispatchBatch works through its jobs this many at a time
+#define JOB_DISPATCH_CHUNK_SIZE (64)
+
+// Jobs are carved this many at a time, and the pool can hold at most JOB_MAX_SLABS of those
+#define JOB_SLAB_COUNT (256)
+#define JOB_MAX_SLABS (4096)
+
+// Lambda captures up to this size are kept in the job itself.  Up to 
+// JOB_PAYLOAD_POOL_SIZE they come from a shared pool, past that the heap.
+#define JOB_PAYLOAD_SIZE (64)
+#define JOB_PAYLOAD_POOL_SIZE (256)
 
 /************************************************************************/
 /*                                                                      */
@@ -48,12 +73,64 @@ enum eJobState : uint
    JOB_STATE_FINISHED,  // job has completed - JobWait spins until this is present
 };
 
+// Within a queue the most urgent job runs first.  Urgency is a deadline - either the
+// one set on the job, or how long it has been queued plus an allowance for its 
+// priority.  So lower priorities wait longer, but can't wait forever.
+enum eJobPriority : uint
+{
+   JOB_PRIORITY_CRITICAL = 0, // frame critical - goes ahead of everything else queued
+   JOB_PRIORITY_HIGH, 
+   JOB_PRIORITY_NORMAL,       // default
+   JOB_PRIORITY_LOW,          // background work 
+
+   JOB_PRIORITY_COUNT,
+};
+
+enum eJobSystemFlag : uint
+{
+   // Each generic worker owns a deque it pushes newly ready jobs to, and idle workers
+   // steal from each other.  Without it every job goes through the shared category queue.
+   JOB_SYSTEM_FLAG_WORK_STEALING = (1 << 0),
+
+   // Pin each generic worker to its own core [see cpu_topology.h] - a core each before 
+   // doubling up on SMT siblings - and steal from workers sharing a cache first.
+   JOB_SYSTEM_FLAG_PIN_WORKERS = (1 << 1),
+
+   JOB_SYSTEM_DEFAULT_FLAGS = JOB_SYSTEM_FLAG_WORK_STEALING | JOB_SYSTEM_FLAG_PIN_WORKERS,
+};
+
+enum eJobShutdownPolicy : uint
+{
+   JOB_SHUTDOWN_DRAIN,     // everything queued [and everything that makes ready] runs before we stop
+   JOB_SHUTDOWN_CANCEL,    // queued jobs finish without running - dependents and waiters are still released
+};
+
 /************************************************************************/
 /*                                                                      */
 /* STRUCTS                                                              */
 /*                                                                      */
 /************************************************************************/
+// How long jobs sat in a queue before someone picked them up [one per priority]
+struct job_wait_stats_t
+{
+   uint count;
+   uint deadline_misses;      // jobs with a deadline that weren't even started by it
+   uint64_t total_wait_op;
+   uint64_t max_wait_op;
+};
+
+//--------------------------------------------------------------------
+// Which slot of the job pool, and which use of that slot.  Finished jobs go 
+// straight back to the pool - a handle to one just reads as finished from 
+// then on, so holding a handle needs no reference.
+struct JobHandle
+{
+   uint slot;
+   uint generation;     // never 0 for a real job
 
+   inline bool is_valid() const  { return 0 != generation; }
+   bool is_finished() const;
+};
 
 /************************************************************************/
 /*                                                                      */
@@ -62,17 +139,88 @@ enum eJobState : uint
 /************************************************************************/
 class Job;
 
+//--------------------------------------------------------------------
+// Revokes work that hasn't run yet.  Jobs holding a cancelled token finish
+// without running when they come out of the queue - dependents and waiters 
+// are released like any other finish.  Work that is already running has
+// to check for itself [JobIsCurrentCancelled].
+//
+// Reference counted - each job holding it keeps it alive.
+class JobCancelToken
+{
+   public:
+      inline bool is_cancelled() const    { return 0 != cancelled; }
+
+   public:
+      uint volatile cancelled;
+      uint ref_count;
+};
+
 typedef void (*job_work_cb)( void* );
-typedef ThreadSafeQueue<Job*> JobQueue;
+
+// How a lambda job runs and gets rid of its captures - one per lambda type.  Coroutine
+// jobs have one too, with a size of 0, so a frame that never finished is destroyed.
+struct job_payload_vtable_t
+{
+   job_work_cb run;
+   job_work_cb destroy;
+   size_t size;
+};
+
+//--------------------------------------------------------------------
+// Most jobs have zero or one dependent - so keep the first few inline and
+// only go to the heap for big fan-ins.
+class JobDependentList
+{
+   public:
+      JobDependentList()
+         : heap(nullptr)
+         , count(0)
+         , capacity(JOB_INLINE_DEPENDENT_COUNT) {}
+
+      ~JobDependentList()
+      {
+         ::free( heap );
+      }
+
+      void push_back( Job *job );
+      void clear()                              { count = 0; }
+
+      inline uint size() const                  { return count; }
+      inline Job* operator[]( uint idx ) const  { return (nullptr == heap) ? inline_items[idx] : heap[idx]; }
+      inline Job** data()                       { return (nullptr == heap) ? inline_items : heap; }
+
+   public:
+      Job *inline_items[JOB_INLINE_DEPENDENT_COUNT];
+      Job **heap;
+      uint count;
+      uint capacity;
+};
 
 //--------------------------------------------------------------------
 //--------------------------------------------------------------------
 class Job
 {
    public:
+      // the job pool keeps its free list link here while the job is free, so
+      // nothing a stale handle reads can be in the first pointer's worth.
+      void *pool_link;
+
+      // Side by side so a waiter can sleep on both - a job that gets recycled
+      // changes the word even if it ends up back in the state the waiter saw.
+      union {
+         struct {
+            eJobState volatile state;   // read by waiters on other threads
+            uint volatile generation;   // bumped each time the job goes back to the pool
+         };
+         uint64_t volatile state_and_generation;
+      };
+
+      // index into the pool - never changes
+      uint slot;
+
       // The queue I add myself too upon reading a dependancy count of 0
       eJobType type; 
-      eJobState state;
 
       // function associated with this job
       job_work_cb work_cb;
@@ -86,21 +234,104 @@ class Job
       // how many releases are required before deleting?
       uint ref_count;
 
-      std::vector<Job*> dependents;
+      // threads parked in JobWait on this job - finishing only wakes if this is non-zero.
+      // Waiters with a stale handle can still touch it, so it is never reset.
+      uint waiter_count;
+
+      eJobPriority priority;
+      uint64_t deadline_op;   // 0 for none - otherwise the TimeGetOpCount() it should be done by
+      uint64_t enqueue_op;    // when it last went into a queue
+
+      // held while adding a dependent, and while finishing - so a dependent
+      // can't be added after we've already told everyone we're done.
+      uint volatile dependents_lock;
+
+      // set when the work parked itself on another job [JobSuspendOn] instead of finishing
+      bool is_suspended;
+
+      // Called with user_data once the job is marked finished, before its dependents 
+      // are told.  Job graphs use it to release their nodes' dependents.
+      job_work_cb finish_cb;
+
+#if JOB_TRACE_ENABLED
+      uint64_t trace_id;      // 0 if it was created while not recording
+#endif
+
+      JobDependentList dependents;
+
+      // nullptr for none - a job keeps the first one it's given
+      JobCancelToken * volatile cancel_token;
+
+      // Lambda jobs only - user_data points at the captures, which are in payload if they fit.
+      // They're destroyed when the last reference goes.  Coroutine jobs set it too, for a
+      // frame that never finished.
+      job_payload_vtable_t const *payload_vtable;
+      uint64_t payload[JOB_PAYLOAD_SIZE / sizeof(uint64_t)];
       
    public:
       void on_finish();
-      void on_dependancy_finished(); 
 
-      void dependent_on( Job *parent );
+      // returns false [and adds nothing] if parent has already finished
+      bool dependent_on( Job *parent );
+
+      // both only matter if set before the job is dispatched
+      void set_priority( eJobPriority pri )     { priority = pri; }
+      void set_deadline_ms( double ms );        // from now
 
       inline bool is_finished() const { return state == JOB_STATE_FINISHED; }
+      inline bool is_cancelled() const { return (nullptr != cancel_token) && cancel_token->is_cancelled(); }
 
    public:
       // used internally
       void set_state( eJobState new_state );
 };
 
+//--------------------------------------------------------------------
+//--------------------------------------------------------------------
+// One per category.  Plain normal priority work - nearly all of it - goes
+// through a lock-free MPMCQueue.  Everything else is kept under a lock in a 
+// FIFO per priority and a heap for jobs with a deadline, where the job with 
+// the earliest deadline [real or from its priority] comes out first.
+//
+// Urgent work always goes ahead of the normal queue, and low priority work 
+// does once it has waited out its allowance.
+class JobQueue
+{
+   public:
+      JobQueue();
+
+      void enqueue( Job *job );
+      void enqueue_batch( Job **jobs, uint count );   // may reorder jobs
+      bool dequeue( Job **out );
+
+      // not locked - only good as a hint for whether to bother with dequeue
+      inline bool empty() const        { return normal.empty() && (0 == locked_count); }
+      inline bool has_urgent() const   { return urgent_count > 0; }
+      inline uint size_approx() const  { return normal.size_approx() + locked_count; }
+
+      void get_stats( job_wait_stats_t out[JOB_PRIORITY_COUNT] );
+      void reset_stats();
+
+   private:
+      bool dequeue_locked( Job **out, uint64_t before_key );
+      uint64_t get_normal_front_key() const;
+      void update_next_due();
+      void record_wait( Job *job );
+
+   public:
+      MPMCQueue<Job*> normal;
+
+      CriticalSection lock;
+      std::queue<Job*> fifos[JOB_PRIORITY_COUNT];
+      std::vector<Job*> deadlines;  // min-heap on deadline_op
+
+      job_wait_stats_t stats[JOB_PRIORITY_COUNT];
+
+      uint volatile locked_count;
+      uint volatile urgent_count;   // above normal priority, or has a deadline
+      uint64_t volatile next_due_op;   // smallest sort key under the lock - lets dequeue skip the lock when normal work is ahead
+};
+
 //--------------------------------------------------------------------
 //--------------------------------------------------------------------
 class JobConsumer
@@ -114,6 +345,9 @@ class JobConsumer
 
    public:
       std::vector<JobQueue*> queues;
+
+      // set when consuming JOB_GENERIC - allowed to steal from the workers' deques.
+      bool can_steal = false;
 };
 
 /************************************************************************/
@@ -127,42 +361,175 @@ class JobConsumer
 /* FUNCTION PROTOTYPES                                                  */
 /*                                                                      */
 /************************************************************************/
-void JobSystemStartup( uint job_category_count, int generic_thread_count = -1 );
-void JobSystemShutdown();
+// generic_thread_count > 0 creates exactly that many workers, otherwise
+// hardware_concurrency() + generic_thread_count (so -1 leaves a core for the main thread)
+void JobSystemStartup( uint job_category_count, int generic_thread_count = -1, uint flags = JOB_SYSTEM_DEFAULT_FLAGS );
+
+// Stops every worker and frees everything.  keep_threads leaves the worker threads
+// parked so the next startup can pick them up instead of creating new ones - a
+// shutdown without it [even with the system already down] lets them go.
+void JobSystemShutdown( eJobShutdownPolicy policy = JOB_SHUTDOWN_DRAIN, bool keep_threads = false );
 
 void JobSystemSetSignal( uint category, Signal *signal );
 JobQueue* JobSystemGetQueue( uint category );
 
-// Creating a job starts with a depedency and reference [the caller]
+// number of generic workers (0 if the system isn't running)
+uint JobSystemGetWorkerCount();
+
+// index of the worker the calling thread is, or -1 if it isn't one
+int JobSystemGetCurrentWorkerIndex();
+
+// Jobs waiting right now - one per category queue, and one per generic worker's deque [a hint]
+void JobSystemGetQueueDepths( std::vector<uint> *queues, std::vector<uint> *deques );
+
+// Keeps whole cores away from the generic workers for a category's own consumer 
+// thread [ie, one for JOB_IO].  Taken from the end of the core list, and only 
+// applied at the next startup.  0 gives them back.
+void JobSystemReserveCores( uint category, uint core_count );
+
+// Pins the calling thread to the cores reserved for category - false if there are none.
+bool JobSystemPinCurrentThread( uint category );
+
+// Queue wait times for a category since startup [or the last reset]
+void JobSystemGetWaitStats( uint category, job_wait_stats_t out[JOB_PRIORITY_COUNT] );
+void JobSystemResetWaitStats();
+void JobSystemPrintWaitStats();
+
+// Creating a job starts with a depedency and reference [the caller].  nullptr if the
+// pool is out of jobs [JOB_MAX_SLABS slabs of them are in use] or memory.
 Job* JobCreate( eJobType type, job_work_cb work_cb, void *user_data );
 
+// Where the lambda JobCreate [below] keeps captures too big for the job
+void* JobPayloadAlloc( size_t size );
+void JobPayloadFree( void *ptr, size_t size );
+
 // Dispatch will attempt to run the job by decrementing the dependency count
 // If the dependency count reaches 0, the job is enqueued and allowed to be
 // picked up by a consumer.  If it is not 0, the function does nothing else 
 // [it is still dependent on someone]
 void JobDispatch( Job *job );
 
+// JobDispatch on each of them, but what becomes ready goes in with one push per 
+// category, and only as many sleeping workers are woken as there are new jobs.
+void JobDispatchBatch( Job **jobs, uint count );
+
 // Job release removes a single reference to the object.  Upon reaching 0 references
 // the job is freed up.
 void JobAcquire( Job *job );
 void JobRelease( Job *job );
 
 // Exactly as the name implies.
-// Equivalent of a ThreadDetach for jobs.
-void JobDispatchAndRelease( Job *job );
+// Equivalent of a ThreadDetach for jobs.  Our reference is handed to whoever
+// runs it instead of being released, and the handle is all we can keep.
+JobHandle JobDispatchAndRelease( Job *job );
+
+// Only good while you hold a reference - the handle outlives it.
+JobHandle JobGetHandle( Job *job );
 
-// Wait on a job.  If a consumer is passed in
-// we'll consume jobs while we wait using that consumer;
-// (another way to do this is associate a consumer with a thread id
-// and use that)
+// true once the job finished - including long after it has been recycled
+bool JobIsFinished( JobHandle handle );
+
+// Wait on a job.  While waiting we help - first with the consumer passed in (if any), 
+// then with generic work [including stealing from the workers].  Once there is nothing
+// to help with we spin a little, then go to sleep until the job finishes.
+void JobWait( JobHandle handle, JobConsumer *consumer = nullptr );
 void JobWait( Job *job, JobConsumer *consumer = nullptr );
 
 // equivalent of a ThreadJoin for this system.
 void JobWaitAndRelease( Job *job, JobConsumer *consumer = nullptr );
 
+// Starts with a single reference [the caller]
+JobCancelToken* JobCancelTokenCreate();
+void JobCancelTokenAcquire( JobCancelToken *token );
+void JobCancelTokenRelease( JobCancelToken *token );
+
+// Everything holding the token that hasn't started yet will be skipped
+void JobCancel( JobCancelToken *token );
+
+// Attach before dispatching.  include_dependents also gives it to everything 
+// that depends on job [and what depends on them...] as of this call.  Jobs 
+// that already have a token keep theirs.
+void JobSetCancelToken( Job *job, JobCancelToken *token, bool include_dependents = false );
+
+// For long running work to poll - false when not called from inside a job.
+bool JobIsCurrentCancelled();
+
+// Only from inside job's work - instead of finishing when the work returns, job
+// goes back to waiting and is dispatched again once awaited finishes.  Returns false 
+// if awaited was already done, in which case nothing changes.  [see job_coroutine.h]
+bool JobSuspendOn( Job *job, Job *awaited );
+
 
 
 void JobSystemTest();
 
+// Compares the single shared queue against work stealing for 1..N workers
+void JobSystemScalingTest();
+
+// Heap allocations and time per job for the JobSystemTest workload
+void JobAllocationTest();
+
+// Wake up latency and CPU use of JobWait against spinning, for short and long jobs
+void JobWaitTest();
+
+// How long a critical job waits behind a flood of background jobs
+void JobPriorityTest();
+
+// Startup/shutdown latency over 64 cycles, with and without keeping threads
+void JobSystemRestartTest();
+
+// Dispatch cost per job for batches of 1, 16, 256 and 4096
+void JobDispatchBatchTest();
+
+// Fire and forget through handles against holding a Job* reference, and stale handles after recycling
+void JobHandleTest();
+
+// Lambda jobs against a heap allocated parameter struct, and big captures getting cleaned up
+void JobLambdaTest();
+
+// Skipping cancelled jobs and subtrees, and polling from a running job
+void JobCancelTest();
+
+/************************************************************************/
+/*                                                                      */
+/* TEMPLATES                                                            */
+/*                                                                      */
+/************************************************************************/
+
+//------------------------------------------------------------------------
+template <typename CB>
+struct job_payload_t
+{
+   static void run( void *ptr )        { (*(CB*)ptr)(); }
+   static void destroy( void *ptr )    { ((CB*)ptr)->~CB(); }
+
+   static job_payload_vtable_t const vtable;
+};
+
+template <typename CB>
+job_payload_vtable_t const job_payload_t<CB>::vtable = { job_payload_t<CB>::run, job_payload_t<CB>::destroy, sizeof(CB) };
+
+//------------------------------------------------------------------------
+// body() - a copy of it [captures and all] is kept with the job, so
+// there's no parameter struct to allocate and free.
+template <typename CB>
+Job* JobCreate( eJobType type, CB &&body )
+{
+   typedef typename std::decay<CB>::type functor_t;
+   static_assert( alignof(functor_t) <= alignof(uint64_t), "over-aligned captures aren't supported" );
+
+   Job *job = JobCreate( type, job_payload_t<functor_t>::run, nullptr );
+   if (nullptr == job) {
+      return nullptr;
+   }
+
+   void *mem = (sizeof(functor_t) <= JOB_PAYLOAD_SIZE) ? (void*)job->payload : JobPayloadAlloc( sizeof(functor_t) );
+   new (mem) functor_t( std::forward<CB>(body) );
+
+   job->user_data = mem;
+   job->payload_vtable = &job_payload_t<functor_t>::vtable;
+   return job;
+}
+
 
 #endif 
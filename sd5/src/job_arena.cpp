@@ -0,0 +1,395 @@
+/************************************************************************/
+/*                                                                      */
+/* INCLUDE                                                              */
+/*                                                                      */
+/************************************************************************/
+#include "job_arena.h"
+
+#include "job.h"
+#include "atomic.h"
+#include "criticalsection.h"
+#include "time.h"
+
+#include <vector>
+
+/************************************************************************/
+/*                                                                      */
+/* STRUCTS                                                              */
+/*                                                                      */
+/************************************************************************/
+
+//------------------------------------------------------------------------
+// A heap allocation made because an arena was full.  start is where it would have
+// been in the arena had it been big enough - so rewinding past it frees it.
+struct job_spill_t
+{
+   job_spill_t *next;
+   size_t start;
+};
+
+//------------------------------------------------------------------------
+// Only the owning thread touches it [stats are read without locking]
+struct job_scratch_t
+{
+   byte_t *buffer;
+   size_t used;            // can go past JOB_SCRATCH_SIZE - everything past it is spills
+   size_t high_water;
+   uint overflow_count;
+
+   job_spill_t *spills;    // newest first
+};
+
+//------------------------------------------------------------------------
+// Owned by a thread - gives the memory back when it exits.  The arena itself
+// stays registered so its stats survive.
+struct job_scratch_holder_t
+{
+   job_scratch_t *scratch = nullptr;
+
+   ~job_scratch_holder_t()
+   {
+      if (nullptr != scratch) {
+         JobScratchRewind( 0 );
+         ::free( scratch->buffer );
+         scratch->buffer = nullptr;
+      }
+   }
+};
+
+/************************************************************************/
+/*                                                                      */
+/* LOCAL VARIABLES                                                      */
+/*                                                                      */
+/************************************************************************/
+static CriticalSection gScratchLock;
+static std::vector<job_scratch_t*> gScratches;
+static thread_local job_scratch_holder_t tScratch;
+
+static byte_t *gFrameBuffer = nullptr;
+static uint64_t volatile gFrameUsed = 0;
+static size_t gFrameHighWater = 0;
+static uint gFrameOverflowCount = 0;
+
+static CriticalSection gFrameSpillLock;
+static job_spill_t *gFrameSpills = nullptr;
+static size_t gFrameSpillBytes = 0;
+
+/************************************************************************/
+/*                                                                      */
+/* LOCAL FUNCTIONS                                                      */
+/*                                                                      */
+/************************************************************************/
+
+//------------------------------------------------------------------------
+static inline uintptr_t AlignUp( uintptr_t v, size_t align )
+{
+   return (v + (align - 1)) & ~((uintptr_t)align - 1);
+}
+
+//------------------------------------------------------------------------
+static job_spill_t* AllocSpill( size_t size, size_t align, void **out )
+{
+   byte_t *mem = (byte_t*) ::malloc( sizeof(job_spill_t) + size + align );
+   job_spill_t *spill = (job_spill_t*)mem;
+   *out = (void*) AlignUp( (uintptr_t)(mem + sizeof(job_spill_t)), align );
+   return spill;
+}
+
+//------------------------------------------------------------------------
+static job_scratch_t* GetScratch()
+{
+   job_scratch_t *scratch = tScratch.scratch;
+   if (nullptr != scratch) {
+      return scratch;
+   }
+
+   scratch = new job_scratch_t();
+   scratch->buffer = (byte_t*) ::malloc( JOB_SCRATCH_SIZE );
+   scratch->used = 0;
+   scratch->high_water = 0;
+   scratch->overflow_count = 0;
+   scratch->spills = nullptr;
+
+   {
+      SCOPE_LOCK(gScratchLock);
+      gScratches.push_back( scratch );
+   }
+
+   tScratch.scratch = scratch;
+   return scratch;
+}
+
+//------------------------------------------------------------------------
+// racing here just frees the loser
+static byte_t* GetFrameBuffer()
+{
+   byte_t *buffer = gFrameBuffer;
+   if (nullptr != buffer) {
+      return buffer;
+   }
+
+   buffer = (byte_t*) ::malloc( JOB_FRAME_ARENA_SIZE );
+   byte_t *prev = CompareAndSetPointer( &gFrameBuffer, (byte_t*)nullptr, buffer );
+   if (nullptr != prev) {
+      ::free( buffer );
+      return prev;
+   }
+   return buffer;
+}
+
+/************************************************************************/
+/*                                                                      */
+/* GLOBAL FUNCTIONS                                                     */
+/*                                                                      */
+/************************************************************************/
+
+//------------------------------------------------------------------------
+void* JobScratchAlloc( size_t size, size_t align /*= JOB_ARENA_DEFAULT_ALIGN*/ )
+{
+   job_scratch_t *scratch = GetScratch();
+
+   if (scratch->used < JOB_SCRATCH_SIZE) {
+      uintptr_t base = (uintptr_t)scratch->buffer;
+      uintptr_t start = AlignUp( base + scratch->used, align );
+      if ((start + size) <= (base + JOB_SCRATCH_SIZE)) {
+         scratch->used = (start + size) - base;
+         scratch->high_water = (scratch->used > scratch->high_water) ? scratch->used : scratch->high_water;
+         return (void*)start;
+      }
+   }
+
+   // didn't fit - it goes on the heap until we rewind past it
+   void *ptr;
+   job_spill_t *spill = AllocSpill( size, align, &ptr );
+   spill->start = (scratch->used > JOB_SCRATCH_SIZE) ? scratch->used : JOB_SCRATCH_SIZE;
+   spill->next = scratch->spills;
+   scratch->spills = spill;
+
+   scratch->used = spill->start + size;
+   scratch->high_water = (scratch->used > scratch->high_water) ? scratch->used : scratch->high_water;
+   ++scratch->overflow_count;
+   return ptr;
+}
+
+//------------------------------------------------------------------------
+size_t JobScratchGetMark()
+{
+   job_scratch_t *scratch = tScratch.scratch;
+   return (nullptr != scratch) ? scratch->used : 0;
+}
+
+//------------------------------------------------------------------------
+void JobScratchRewind( size_t mark )
+{
+   job_scratch_t *scratch = tScratch.scratch;
+   if (nullptr == scratch) {
+      return;
+   }
+
+   while ((nullptr != scratch->spills) && (scratch->spills->start >= mark)) {
+      job_spill_t *spill = scratch->spills;
+      scratch->spills = spill->next;
+      ::free( spill );
+   }
+
+   scratch->used = mark;
+}
+
+//------------------------------------------------------------------------
+void* JobFrameAlloc( size_t size, size_t align /*= JOB_ARENA_DEFAULT_ALIGN*/ )
+{
+   byte_t *buffer = GetFrameBuffer();
+   uintptr_t base = (uintptr_t)buffer;
+
+   uint64_t used = gFrameUsed;
+   while (true) {
+      uint64_t start = AlignUp( base + (uintptr_t)used, align ) - base;
+      uint64_t end = start + size;
+      if (end > JOB_FRAME_ARENA_SIZE) {
+         break;
+      }
+
+      uint64_t prev = CompareAndSet64( &gFrameUsed, used, end );
+      if (prev == used) {
+         return buffer + start;
+      }
+      used = prev;
+   }
+
+   // full - spill to the heap until the reset
+   void *ptr;
+   job_spill_t *spill = AllocSpill( size, align, &ptr );
+   spill->start = 0;
+
+   SCOPE_LOCK(gFrameSpillLock);
+   spill->next = gFrameSpills;
+   gFrameSpills = spill;
+   gFrameSpillBytes += size;
+   ++gFrameOverflowCount;
+   return ptr;
+}
+
+//------------------------------------------------------------------------
+void JobFrameReset()
+{
+   size_t used = (size_t)gFrameUsed + gFrameSpillBytes;
+   gFrameHighWater = (used > gFrameHighWater) ? used : gFrameHighWater;
+
+   SCOPE_LOCK(gFrameSpillLock);
+   while (nullptr != gFrameSpills) {
+      job_spill_t *spill = gFrameSpills;
+      gFrameSpills = spill->next;
+      ::free( spill );
+   }
+   gFrameSpillBytes = 0;
+   gFrameUsed = 0;
+}
+
+//------------------------------------------------------------------------
+void JobArenaGetStats( job_arena_stats_t *scratch, job_arena_stats_t *frame )
+{
+   if (nullptr != scratch) {
+      scratch->capacity = JOB_SCRATCH_SIZE;
+      scratch->high_water = 0;
+      scratch->overflow_count = 0;
+
+      SCOPE_LOCK(gScratchLock);
+      scratch->arena_count = (uint)gScratches.size();
+      for (uint i = 0; i < gScratches.size(); ++i) {
+         job_scratch_t *s = gScratches[i];
+         scratch->high_water = (s->high_water > scratch->high_water) ? s->high_water : scratch->high_water;
+         scratch->overflow_count += s->overflow_count;
+      }
+   }
+
+   if (nullptr != frame) {
+      size_t used = (size_t)gFrameUsed + gFrameSpillBytes;
+      frame->capacity = JOB_FRAME_ARENA_SIZE;
+      frame->high_water = (used > gFrameHighWater) ? used : gFrameHighWater;
+      frame->arena_count = 1;
+      frame->overflow_count = gFrameOverflowCount;
+   }
+}
+
+//------------------------------------------------------------------------
+void JobArenaResetStats()
+{
+   {
+      SCOPE_LOCK(gScratchLock);
+      for (uint i = 0; i < gScratches.size(); ++i) {
+         gScratches[i]->high_water = gScratches[i]->used;
+         gScratches[i]->overflow_count = 0;
+      }
+   }
+
+   gFrameHighWater = 0;
+   gFrameOverflowCount = 0;
+}
+
+//------------------------------------------------------------------------
+void JobArenaPrintStats()
+{
+   job_arena_stats_t scratch;
+   job_arena_stats_t frame;
+   JobArenaGetStats( &scratch, &frame );
+
+   printf( "Job scratch: %u arenas of %u KB, high water %.1f KB, %u allocations spilled to the heap\n",
+      scratch.arena_count, (uint)(scratch.capacity / 1024), (double)scratch.high_water / 1024.0, scratch.overflow_count );
+   printf( "Job frame arena: %u KB, high water %.1f KB, %u allocations spilled to the heap\n",
+      (uint)(frame.capacity / 1024), (double)frame.high_water / 1024.0, frame.overflow_count );
+}
+
+
+//--------------------------------------------------------------------
+// Some test code
+//--------------------------------------------------------------------
+
+//--------------------------------------------------------------------
+// Stand in for real work - fill some temporaries and boil them down.
+static uint SumTemporaries( uint *values, uint count, uint seed )
+{
+   for (uint i = 0; i < count; ++i) {
+      values[i] = (seed + i) * 2654435761U;
+   }
+
+   uint sum = 0;
+   for (uint i = 0; i < count; ++i) {
+      sum += values[i] >> 16;
+   }
+   return sum;
+}
+
+//--------------------------------------------------------------------
+void JobArenaTest()
+{
+   uint const JOB_COUNT = 16 * 1024;
+   uint const TEMP_COUNT = 1024;
+
+   JobSystemStartup( JOB_TYPE_COUNT );
+   JobArenaResetStats();
+
+   std::vector<JobHandle> handles( JOB_COUNT );
+   for (uint pass = 0; pass < 2; ++pass) {
+      uint heap_sum = 0;
+      uint scratch_sum = 0;
+
+      uint64_t start_op = TimeGetOpCount();
+      for (uint i = 0; i < JOB_COUNT; ++i) {
+         uint *sum = &heap_sum;
+         handles[i] = JobDispatchAndRelease( JobCreate( JOB_GENERIC, [=]() {
+            uint *values = new uint[TEMP_COUNT];
+            AtomicAdd( sum, SumTemporaries( values, TEMP_COUNT, i ) );
+            delete[] values;
+         }));
+      }
+      for (uint i = 0; i < JOB_COUNT; ++i) {
+         JobWait( handles[i] );
+      }
+      uint64_t heap_op = TimeGetOpCount() - start_op;
+
+      start_op = TimeGetOpCount();
+      for (uint i = 0; i < JOB_COUNT; ++i) {
+         uint *sum = &scratch_sum;
+         handles[i] = JobDispatchAndRelease( JobCreate( JOB_GENERIC, [=]() {
+            uint *values = JobScratchAllocArray<uint>( TEMP_COUNT );
+            AtomicAdd( sum, SumTemporaries( values, TEMP_COUNT, i ) );
+         }));
+      }
+      for (uint i = 0; i < JOB_COUNT; ++i) {
+         JobWait( handles[i] );
+      }
+      uint64_t scratch_op = TimeGetOpCount() - start_op;
+
+      if (heap_sum != scratch_sum) {
+         __debugbreak();
+      }
+
+      printf( "JobArenaTest [pass %u]: new/delete %.1f ns per job, scratch %.1f ns per job\n",
+         pass,
+         TimeOpCountTo_ms( heap_op ) * 1000000.0 / (double)JOB_COUNT,
+         TimeOpCountTo_ms( scratch_op ) * 1000000.0 / (double)JOB_COUNT );
+   }
+
+   // results that outlive their jobs - each one in the frame arena, read back after
+   std::vector<uint*> results( JOB_COUNT );
+   for (uint i = 0; i < JOB_COUNT; ++i) {
+      uint **out = &results[i];
+      handles[i] = JobDispatchAndRelease( JobCreate( JOB_GENERIC, [=]() {
+         uint *result = JobFrameAllocArray<uint>( 4 );
+         for (uint j = 0; j < 4; ++j) {
+            result[j] = i + j;
+         }
+         *out = result;
+      }));
+   }
+   for (uint i = 0; i < JOB_COUNT; ++i) {
+      JobWait( handles[i] );
+      if (results[i][3] != (i + 3)) {
+         __debugbreak();
+      }
+   }
+   JobFrameReset();
+
+   JobArenaPrintStats();
+   JobSystemShutdown();
+}
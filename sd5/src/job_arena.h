@@ -0,0 +1,102 @@
+#pragma once
+#if !defined( __JOB_ARENA__ )
+#define __JOB_ARENA__
+
+// Memory for jobs that doesn't go near the heap.
+//
+// Scratch - every thread that runs jobs has its own linear arena.  A job bump
+// allocates from it while it runs, and all of it is given back the moment the
+// job returns, so there is nothing to free.  Only from inside a job's work.
+//
+//    void BuildPath( void *ptr )
+//    {
+//       vec3 *points = JobScratchAllocArray<vec3>( 1024 );
+//       ...
+//    }  // points are gone here
+//
+// Frame - one arena shared by everyone, for results that have to outlive the
+// job that made them but not the frame.  The main loop resets it once nothing
+// is using it anymore.
+//
+// Either one running out spills to the heap instead of failing - the stats say
+// how often, and how much was used at most, so the sizes can be tuned.
+
+/************************************************************************/
+/*                                                                      */
+/* INCLUDE                                                              */
+/*                                                                      */
+/************************************************************************/
+#include "common.h"
+
+/************************************************************************/
+/*                                                                      */
+/* DEFINES AND CONSTANTS                                                */
+/*                                                                      */
+/************************************************************************/
+// per thread
+#define JOB_SCRATCH_SIZE         (1024 * 1024)
+
+#define JOB_FRAME_ARENA_SIZE     (16 * 1024 * 1024)
+
+#define JOB_ARENA_DEFAULT_ALIGN  (16)
+
+/************************************************************************/
+/*                                                                      */
+/* STRUCTS                                                              */
+/*                                                                      */
+/************************************************************************/
+struct job_arena_stats_t
+{
+   size_t capacity;        // per arena
+   size_t high_water;      // most ever in use at once [in any one of them]
+   uint arena_count;
+   uint overflow_count;    // allocations that didn't fit and went to the heap
+};
+
+/************************************************************************/
+/*                                                                      */
+/* FUNCTION PROTOTYPES                                                  */
+/*                                                                      */
+/************************************************************************/
+// Only from inside a job's work - given back when it returns
+void* JobScratchAlloc( size_t size, size_t align = JOB_ARENA_DEFAULT_ALIGN );
+
+// Used by the job system around each job's work.  Rewind frees everything allocated since the mark.
+size_t JobScratchGetMark();
+void JobScratchRewind( size_t mark );
+
+// Any thread.  Good until the next JobFrameReset.
+void* JobFrameAlloc( size_t size, size_t align = JOB_ARENA_DEFAULT_ALIGN );
+
+// Only once no job is holding frame memory - ie, end of the frame after waiting on its jobs.
+void JobFrameReset();
+
+void JobArenaGetStats( job_arena_stats_t *scratch, job_arena_stats_t *frame );
+void JobArenaResetStats();
+void JobArenaPrintStats();
+
+// Scratch against new/delete for a job's temporaries, and frame results surviving their jobs
+void JobArenaTest();
+
+/************************************************************************/
+/*                                                                      */
+/* TEMPLATES                                                            */
+/*                                                                      */
+/************************************************************************/
+
+//------------------------------------------------------------------------
+// Not constructed - plain data only
+template <typename T>
+T* JobScratchAllocArray( uint count )
+{
+   return (T*) JobScratchAlloc( sizeof(T) * count, alignof(T) );
+}
+
+//------------------------------------------------------------------------
+template <typename T>
+T* JobFrameAllocArray( uint count )
+{
+   return (T*) JobFrameAlloc( sizeof(T) * count, alignof(T) );
+}
+
+#endif
@@ -0,0 +1,172 @@
+/************************************************************************/
+/*                                                                      */
+/* INCLUDE                                                              */
+/*                                                                      */
+/************************************************************************/
+#include "job_coroutine.h"
+
+#include "atomic.h"
+#include "profile.h"
+
+/************************************************************************/
+/*                                                                      */
+/* LOCAL FUNCTIONS                                                      */
+/*                                                                      */
+/************************************************************************/
+
+//------------------------------------------------------------------------
+// work_cb for every coroutine job.  Returns either because the coroutine
+// finished, or because it suspended on another job [see JobSuspendOn]
+static void ResumeCoroutineJob( void *ptr )
+{
+   coro::coroutine_handle<JobTask::promise_type> handle = coro::coroutine_handle<JobTask::promise_type>::from_address( ptr );
+   handle.resume();
+
+   if (handle.done()) {
+      // gone - nothing left for the job to clean up when it's recycled
+      handle.promise().job->payload_vtable = nullptr;
+      handle.destroy();
+   }
+}
+
+//------------------------------------------------------------------------
+// The job is being recycled without its coroutine ever finishing [cancelled, or
+// thrown away on shutdown] - the frame and everything in it still has to go
+static void DestroyCoroutineJob( void *ptr )
+{
+   coro::coroutine_handle<>::from_address( ptr ).destroy();
+}
+
+/************************************************************************/
+/*                                                                      */
+/* LOCAL VARIABLES                                                      */
+/*                                                                      */
+/************************************************************************/
+// size 0 - the frame isn't in the job's payload, and isn't the job's to free
+static job_payload_vtable_t const gCoroutineVtable = { ResumeCoroutineJob, DestroyCoroutineJob, 0 };
+
+/************************************************************************/
+/*                                                                      */
+/* GLOBAL FUNCTIONS                                                     */
+/*                                                                      */
+/************************************************************************/
+
+//------------------------------------------------------------------------
+Job* JobCreateCoroutine( eJobType type, JobTask &&task )
+{
+   Job *job = JobCreate( type, ResumeCoroutineJob, task.handle.address() );
+   if (nullptr == job) {
+      // the task still has it, and destroys it
+      return nullptr;
+   }
+
+   job->payload_vtable = &gCoroutineVtable;
+   task.handle.promise().job = job;
+
+   // the job owns it now
+   task.handle = nullptr;
+   return job;
+}
+
+
+//--------------------------------------------------------------------
+// Some test code
+//--------------------------------------------------------------------
+
+//--------------------------------------------------------------------
+static void IncrementJob( void *ptr )
+{
+   AtomicIncrement( (uint*)ptr );
+}
+
+//--------------------------------------------------------------------
+static void NothingJob( void* ) {}
+
+//--------------------------------------------------------------------
+static JobTask StepsCoroutine( uint *count, uint steps )
+{
+   for (uint i = 0; i < steps; ++i) {
+      Job *step = JobCreate( JOB_GENERIC, IncrementJob, count );
+      JobDispatch( step );
+      co_await JobAwait( step );
+
+      // already finished - doesn't suspend
+      co_await JobAwait( step );
+      JobRelease( step );
+   }
+}
+
+//--------------------------------------------------------------------
+// waits on another coroutine - the whole chain is suspended without a thread
+static JobTask PipelineCoroutine( uint *count, uint steps, uint *done )
+{
+   Job *inner = JobCreateCoroutine( JOB_GENERIC, StepsCoroutine( count, steps ) );
+   JobDispatch( inner );
+   co_await JobAwait( inner );
+   JobRelease( inner );
+
+   AtomicIncrement( done );
+}
+
+//--------------------------------------------------------------------
+struct blocking_pipeline_t
+{
+   uint *count;
+   uint steps;
+   uint *done;
+};
+
+//--------------------------------------------------------------------
+// the same pipeline without coroutines - the worker sits in JobWait for every step
+static void BlockingPipelineJob( void *ptr )
+{
+   blocking_pipeline_t *pipeline = (blocking_pipeline_t*)ptr;
+   for (uint i = 0; i < pipeline->steps; ++i) {
+      Job *step = JobCreate( JOB_GENERIC, IncrementJob, pipeline->count );
+      JobDispatch( step );
+      JobWaitAndRelease( step );
+   }
+
+   AtomicIncrement( pipeline->done );
+}
+
+//--------------------------------------------------------------------
+void JobCoroutineTest()
+{
+   uint const PIPELINES = 1000;
+   uint const STEPS = 10;
+
+   JobSystemStartup( JOB_TYPE_COUNT );
+
+   for (uint use_coroutines = 0; use_coroutines < 2; ++use_coroutines) {
+      uint count = 0;
+      uint done = 0;
+      blocking_pipeline_t pipeline = { &count, STEPS, &done };
+
+      {
+         PROFILE_LOG_SCOPE( use_coroutines ? "JobCoroutineTest [coroutines]" : "JobCoroutineTest [blocking JobWait]" );
+
+         Job *final_job = JobCreate( JOB_GENERIC, NothingJob, nullptr );
+         for (uint i = 0; i < PIPELINES; ++i) {
+            Job *job;
+            if (use_coroutines) {
+               job = JobCreateCoroutine( JOB_GENERIC, PipelineCoroutine( &count, STEPS, &done ) );
+            } else {
+               job = JobCreate( JOB_GENERIC, BlockingPipelineJob, &pipeline );
+            }
+
+            final_job->dependent_on( job );
+            JobDispatchAndRelease( job );
+         }
+
+         JobDispatch( final_job );
+         JobWaitAndRelease( final_job );
+      }
+
+      if ((count != PIPELINES * STEPS) || (done != PIPELINES)) {
+         __debugbreak();
+      }
+   }
+
+   JobSystemShutdown();
+}
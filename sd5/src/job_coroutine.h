@@ -0,0 +1,124 @@
+#pragma once
+#if !defined( __JOB_COROUTINE__ )
+#define __JOB_COROUTINE__
+
+// Jobs written as coroutines.  A coroutine job can co_await another job - instead
+// of blocking the worker, it adds itself as a dependent of that job and returns.
+// When that job finishes it is dispatched again like any other dependent, and
+// picks up where it left off on whichever worker gets to it.
+//
+//    JobTask LoadThing( thing_t *thing )
+//    {
+//       Job *read = JobCreate( JOB_IO, ReadThing, thing );
+//       JobDispatch( read );
+//       co_await JobAwait( read );
+//       JobRelease( read );
+//
+//       // ...do something with it
+//    }
+//
+//    Job *job = JobCreateCoroutine( JOB_GENERIC, LoadThing( thing ) );
+//    JobDispatchAndRelease( job );
+//
+// The job doesn't finish [and release its dependents] until the coroutine returns.
+
+/************************************************************************/
+/*                                                                      */
+/* INCLUDE                                                              */
+/*                                                                      */
+/************************************************************************/
+#include "common.h"
+#include "job.h"
+
+// VS2017 only has the coroutines TS [compile with /await]
+#if (defined(_MSVC_LANG) && (_MSVC_LANG > 201703L)) || (__cplusplus > 201703L)
+   #include <coroutine>
+   namespace coro = std;
+#else
+   #include <experimental/coroutine>
+   namespace coro = std::experimental;
+#endif
+
+/************************************************************************/
+/*                                                                      */
+/* CLASSES                                                              */
+/*                                                                      */
+/************************************************************************/
+
+//--------------------------------------------------------------------
+// Return type of a coroutine job.  Nothing runs until it is handed
+// to JobCreateCoroutine and that job is dispatched.
+class JobTask
+{
+   public:
+      struct promise_type
+      {
+         Job *job = nullptr;
+
+         JobTask get_return_object()                     { return JobTask( coro::coroutine_handle<promise_type>::from_promise(*this) ); }
+         coro::suspend_always initial_suspend()          { return {}; }
+         coro::suspend_always final_suspend() noexcept   { return {}; } // job destroys the frame once it's done
+         void return_void()                              {}
+         void unhandled_exception()                      { __debugbreak(); }
+      };
+
+   public:
+      JobTask( coro::coroutine_handle<promise_type> h )
+         : handle(h) {}
+
+      JobTask( JobTask &&other )
+         : handle(other.handle)
+      {
+         other.handle = nullptr;
+      }
+
+      JobTask( JobTask const& ) = delete;
+
+      ~JobTask()
+      {
+         // never made into a job
+         if (handle) {
+            handle.destroy();
+         }
+      }
+
+   public:
+      coro::coroutine_handle<promise_type> handle;
+};
+
+//--------------------------------------------------------------------
+// co_await JobAwait( job ) - only from inside a JobTask.
+// Caller still needs to hold a reference to job while awaiting it.
+struct job_awaiter_t
+{
+   Job *job;
+
+   bool await_ready() const
+   {
+      return job->is_finished();
+   }
+
+   // returning false [it finished while we were getting ready] resumes right away
+   template <typename PROMISE>
+   bool await_suspend( coro::coroutine_handle<PROMISE> handle )
+   {
+      return JobSuspendOn( handle.promise().job, job );
+   }
+
+   void await_resume() const {}
+};
+
+/************************************************************************/
+/*                                                                      */
+/* FUNCTION PROTOTYPES                                                  */
+/*                                                                      */
+/************************************************************************/
+// Job that runs the coroutine - takes ownership of it.  Dispatch/release like any other job.
+// nullptr if JobCreate fails [the coroutine is destroyed with the task].
+Job* JobCreateCoroutine( eJobType type, JobTask &&task );
+
+inline job_awaiter_t JobAwait( Job *job )    { return job_awaiter_t{ job }; }
+
+void JobCoroutineTest();
+
+#endif
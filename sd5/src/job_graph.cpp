@@ -0,0 +1,336 @@
+/************************************************************************/
+/*                                                                      */
+/* INCLUDE                                                              */
+/*                                                                      */
+/************************************************************************/
+#include "job_graph.h"
+
+#include "atomic.h"
+#include "time.h"
+
+/************************************************************************/
+/*                                                                      */
+/* LOCAL FUNCTIONS                                                      */
+/*                                                                      */
+/************************************************************************/
+
+//------------------------------------------------------------------------
+static void RunGraphNode( void *ptr )
+{
+   job_graph_node_t *node = (job_graph_node_t*)ptr;
+   if (nullptr != node->cb) {
+      node->cb( node->node_data, node->graph->launch_data );
+   }
+}
+
+//------------------------------------------------------------------------
+// Dispatches the nodes' jobs in batches, so a wide fan out is one wake up per job, not per dispatch.
+static void DispatchNodes( JobGraph *graph, uint const *indices, uint count )
+{
+   Job *jobs[JOB_DISPATCH_CHUNK_SIZE];
+   for (uint i = 0; i < count; i += JOB_DISPATCH_CHUNK_SIZE) {
+      uint batch = ((count - i) < JOB_DISPATCH_CHUNK_SIZE) ? (count - i) : JOB_DISPATCH_CHUNK_SIZE;
+      for (uint j = 0; j < batch; ++j) {
+         jobs[j] = graph->nodes[indices[i + j]].job;
+      }
+      JobDispatchBatch( jobs, batch );
+   }
+}
+
+//------------------------------------------------------------------------
+// finish_cb for every node - our dependents live in the graph, not the job.
+static void ReleaseGraphDependents( void *ptr )
+{
+   job_graph_node_t *node = (job_graph_node_t*)ptr;
+   JobGraph *graph = node->graph;
+
+   DispatchNodes( graph, graph->dependents.data() + node->first_dependent, node->dependent_count );
+}
+
+/************************************************************************/
+/*                                                                      */
+/* GLOBAL FUNCTIONS                                                     */
+/*                                                                      */
+/************************************************************************/
+
+//------------------------------------------------------------------------
+JobGraph::JobGraph()
+   : finish_node(0)
+   , launch_data(nullptr)
+   , is_compiled(false)
+   , launch_count(0)
+{
+}
+
+//------------------------------------------------------------------------
+JobGraph::~JobGraph()
+{
+   if (!is_compiled) {
+      return;
+   }
+
+   wait();
+   for (uint i = 0; i < nodes.size(); ++i) {
+      JobRelease( nodes[i].job );
+   }
+}
+
+//------------------------------------------------------------------------
+uint JobGraph::add_node( eJobType type, job_graph_cb cb, void *node_data /*= nullptr*/ )
+{
+   if (is_compiled) {
+      __debugbreak();
+   }
+
+   job_graph_node_t node;
+   node.graph = this;
+   node.job = nullptr;
+   node.cb = cb;
+   node.node_data = node_data;
+   node.type = type;
+   node.dependency_count = 0;
+   node.first_dependent = 0;
+   node.dependent_count = 0;
+
+   nodes.push_back( node );
+   return (uint)nodes.size() - 1;
+}
+
+//------------------------------------------------------------------------
+void JobGraph::add_edge( uint before, uint after )
+{
+   if (is_compiled) {
+      __debugbreak();
+   }
+
+   edges.push_back( before );
+   edges.push_back( after );
+}
+
+//------------------------------------------------------------------------
+void JobGraph::compile()
+{
+   if (is_compiled) {
+      return;
+   }
+
+   // everything nothing else is waiting on feeds the finish node.
+   finish_node = add_node( JOB_GENERIC, nullptr );
+   for (uint i = 0; i < edges.size(); i += 2) {
+      ++nodes[edges[i]].dependent_count;
+   }
+   for (uint i = 0; i < finish_node; ++i) {
+      if (0 == nodes[i].dependent_count) {
+         add_edge( i, finish_node );
+         ++nodes[i].dependent_count;
+      }
+   }
+
+   // lay the dependents out back to back
+   uint offset = 0;
+   for (uint i = 0; i < nodes.size(); ++i) {
+      nodes[i].first_dependent = offset;
+      offset += nodes[i].dependent_count;
+      nodes[i].dependent_count = 0; // recounted as we fill
+   }
+
+   dependents.resize( offset );
+   for (uint i = 0; i < edges.size(); i += 2) {
+      job_graph_node_t *before = &nodes[edges[i]];
+      job_graph_node_t *after = &nodes[edges[i + 1]];
+
+      dependents[before->first_dependent + before->dependent_count] = edges[i + 1];
+      ++before->dependent_count;
+      ++after->dependency_count;
+   }
+
+   // nodes don't move from here on, so the jobs can point at them
+   for (uint i = 0; i < nodes.size(); ++i) {
+      job_graph_node_t *node = &nodes[i];
+      if (0 == node->dependency_count) {
+         roots.push_back( i );
+      }
+
+      node->job = JobCreate( node->type, RunGraphNode, node );
+      node->job->finish_cb = ReleaseGraphDependents;
+   }
+
+   edges.clear();
+   edges.shrink_to_fit();
+   is_compiled = true;
+}
+
+//------------------------------------------------------------------------
+void JobGraph::launch( void *data /*= nullptr*/ )
+{
+   compile();
+
+   if (!is_finished()) {
+      // still running from last time
+      __debugbreak();
+   }
+
+   // Every node is marked finished before its worker is done with it [telling its
+   // dependents, the finish job telling its own] - the queue's reference is only
+   // dropped after that.  Until every node is back down to our reference a worker
+   // could still be touching it.
+   for (uint i = 0; i < nodes.size(); ++i) {
+      Job *job = nodes[i].job;
+      while (*(uint volatile*)&job->ref_count > 1) {
+         YieldProcessor();
+      }
+   }
+
+   launch_data = data;
+
+   // reset everything before dispatching anything
+   for (uint i = 0; i < nodes.size(); ++i) {
+      job_graph_node_t *node = &nodes[i];
+      node->job->state = JOB_STATE_WAITING;
+      node->job->dependancy_count = (node->dependency_count > 0) ? node->dependency_count : 1;
+   }
+
+   ++launch_count;
+   DispatchNodes( this, roots.data(), (uint)roots.size() );
+}
+
+//------------------------------------------------------------------------
+void JobGraph::wait( JobConsumer *consumer /*= nullptr*/ )
+{
+   if (launch_count > 0) {
+      JobWait( get_finish_job(), consumer );
+   }
+}
+
+//------------------------------------------------------------------------
+bool JobGraph::is_finished() const
+{
+   return (0 == launch_count) || get_finish_job()->is_finished();
+}
+
+
+//--------------------------------------------------------------------
+// Some test code
+//--------------------------------------------------------------------
+
+//--------------------------------------------------------------------
+#define GRAPH_TEST_LAYERS (10)
+#define GRAPH_TEST_WIDTH  (50)
+#define GRAPH_TEST_NODES  (GRAPH_TEST_LAYERS * GRAPH_TEST_WIDTH)
+
+//--------------------------------------------------------------------
+// every node past the first layer waits on three nodes in the layer before it
+static void GetGraphTestParents( uint node, uint parents[3] )
+{
+   uint layer = node / GRAPH_TEST_WIDTH;
+   uint idx = node % GRAPH_TEST_WIDTH;
+   uint prev = (layer - 1) * GRAPH_TEST_WIDTH;
+
+   parents[0] = prev + idx;
+   parents[1] = prev + ((idx + 1) % GRAPH_TEST_WIDTH);
+   parents[2] = prev + ((idx + 7) % GRAPH_TEST_WIDTH);
+}
+
+//--------------------------------------------------------------------
+static void CountNode( void*, void *launch_data )
+{
+   AtomicIncrement( (uint*)launch_data );
+}
+
+//--------------------------------------------------------------------
+static void CountJob( void *ptr )
+{
+   AtomicIncrement( (uint*)ptr );
+}
+
+//--------------------------------------------------------------------
+static void NothingJob( void* ) {}
+
+//--------------------------------------------------------------------
+// What we'd do every frame without a graph
+static void RebuildGraphTestFrame( uint *count )
+{
+   Job *jobs[GRAPH_TEST_NODES];
+   Job *final_job = JobCreate( JOB_GENERIC, NothingJob, nullptr );
+
+   for (uint i = 0; i < GRAPH_TEST_NODES; ++i) {
+      jobs[i] = JobCreate( JOB_GENERIC, CountJob, count );
+      if (i >= GRAPH_TEST_WIDTH) {
+         uint parents[3];
+         GetGraphTestParents( i, parents );
+         for (uint p = 0; p < 3; ++p) {
+            jobs[i]->dependent_on( jobs[parents[p]] );
+         }
+      }
+   }
+
+   for (uint i = GRAPH_TEST_NODES - GRAPH_TEST_WIDTH; i < GRAPH_TEST_NODES; ++i) {
+      final_job->dependent_on( jobs[i] );
+   }
+
+   for (uint i = 0; i < GRAPH_TEST_NODES; ++i) {
+      JobDispatchAndRelease( jobs[i] );
+   }
+
+   JobDispatch( final_job );
+   JobWaitAndRelease( final_job );
+}
+
+//--------------------------------------------------------------------
+static void RunGraphTest( uint frames, uint flags )
+{
+   char const *placement = (flags & JOB_SYSTEM_FLAG_PIN_WORKERS) ? "pinned" : "unpinned";
+   JobSystemStartup( JOB_TYPE_COUNT, -1, flags );
+
+   JobGraph graph;
+   for (uint i = 0; i < GRAPH_TEST_NODES; ++i) {
+      graph.add_node( JOB_GENERIC, CountNode );
+      if (i >= GRAPH_TEST_WIDTH) {
+         uint parents[3];
+         GetGraphTestParents( i, parents );
+         for (uint p = 0; p < 3; ++p) {
+            graph.add_edge( parents[p], i );
+         }
+      }
+   }
+   graph.compile();
+
+   for (uint use_graph = 0; use_graph < 2; ++use_graph) {
+      uint64_t total_op = 0;
+      for (uint frame = 0; frame < frames; ++frame) {
+         uint count = 0;
+         uint64_t start_op = TimeGetOpCount();
+
+         if (use_graph) {
+            // each launch gets its own counter
+            graph.launch( &count );
+            graph.wait();
+         } else {
+            RebuildGraphTestFrame( &count );
+         }
+
+         total_op += TimeGetOpCount() - start_op;
+         if (count != GRAPH_TEST_NODES) {
+            __debugbreak();
+         }
+      }
+
+      printf( "JobGraphTest [%s, %s]: %u nodes, %.1f us/frame\n",
+         use_graph ? "compiled graph" : "rebuilt every frame",
+         placement,
+         GRAPH_TEST_NODES,
+         TimeOpCountTo_ms( total_op ) * 1000.0 / (double)frames );
+   }
+
+   JobSystemShutdown();
+}
+
+//--------------------------------------------------------------------
+void JobGraphTest()
+{
+   uint const FRAMES = 200;
+
+   for (uint pinned = 0; pinned < 2; ++pinned) {
+      RunGraphTest( FRAMES, pinned ? JOB_SYSTEM_DEFAULT_FLAGS : JOB_SYSTEM_FLAG_WORK_STEALING );
+   }
+}
@@ -0,0 +1,115 @@
+#pragma once
+#if !defined( __JOB_GRAPH__ )
+#define __JOB_GRAPH__
+
+// A DAG of jobs that is described once and launched as many times as you want.
+// Compiling flattens it into an array of nodes, each with its dependency count
+// and a range into a shared dependents array.  The jobs themselves are created
+// once and kept - a launch only resets counters and dispatches the roots.
+//
+//    uint a = graph.add_node( JOB_GENERIC, UpdateA, &a_data );
+//    uint b = graph.add_node( JOB_GENERIC, UpdateB, &b_data );
+//    graph.add_edge( a, b ); // b runs after a
+//    graph.compile();
+//
+//    // every frame
+//    graph.launch( &frame_data );
+//    graph.wait();
+
+/************************************************************************/
+/*                                                                      */
+/* INCLUDE                                                              */
+/*                                                                      */
+/************************************************************************/
+#include "common.h"
+#include "job.h"
+
+#include <vector>
+
+/************************************************************************/
+/*                                                                      */
+/* TYPES                                                                */
+/*                                                                      */
+/************************************************************************/
+class JobGraph;
+
+// node_data is what was given to add_node, launch_data what was given to launch
+typedef void (*job_graph_cb)( void *node_data, void *launch_data );
+
+/************************************************************************/
+/*                                                                      */
+/* STRUCTS                                                              */
+/*                                                                      */
+/************************************************************************/
+struct job_graph_node_t
+{
+   JobGraph *graph;
+   Job *job;
+
+   job_graph_cb cb;
+   void *node_data;
+   eJobType type;
+
+   // how many nodes must finish before this one can run
+   uint dependency_count;
+
+   // [first_dependent, first_dependent + dependent_count) in the graph's dependents array
+   uint first_dependent;
+   uint dependent_count;
+};
+
+/************************************************************************/
+/*                                                                      */
+/* CLASSES                                                              */
+/*                                                                      */
+/************************************************************************/
+
+//--------------------------------------------------------------------
+//--------------------------------------------------------------------
+class JobGraph
+{
+   public:
+      JobGraph();
+      ~JobGraph();
+
+      // Building - only before compile
+      uint add_node( eJobType type, job_graph_cb cb, void *node_data = nullptr );
+      void add_edge( uint before, uint after );    // after doesn't run until before is done
+
+      void compile();
+
+      // Running - launching again before the last launch finished is an error.
+      // compiles if it hasn't been yet.
+      void launch( void *launch_data = nullptr );
+      void wait( JobConsumer *consumer = nullptr );
+      bool is_finished() const;
+
+      // finishes once every node in the current launch has - other jobs can
+      // depend on it like any other job.
+      inline Job* get_finish_job() const     { return nodes[finish_node].job; }
+      inline uint get_node_count() const     { return (uint)nodes.size() - (is_compiled ? 1 : 0); } // minus the finish node
+
+   public:
+      std::vector<job_graph_node_t> nodes;
+      std::vector<uint> dependents;
+      std::vector<uint> roots;
+
+      // only used while building
+      std::vector<uint> edges;   // before, after pairs
+
+      uint finish_node;
+      void *launch_data;
+      bool is_compiled;
+      uint launch_count;
+};
+
+/************************************************************************/
+/*                                                                      */
+/* FUNCTION PROTOTYPES                                                  */
+/*                                                                      */
+/************************************************************************/
+// Per frame scheduling cost of a ~500 node graph, against building it with JobCreate every frame.
+// Run with the workers unpinned, then pinned by topology.
+void JobGraphTest();
+
+#endif
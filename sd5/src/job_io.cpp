@@ -0,0 +1,587 @@
+/************************************************************************/
+/*                                                                      */
+/* INCLUDE                                                              */
+/*                                                                      */
+/************************************************************************/
+#include "job_io.h"
+
+#include "job.h"
+#include "atomic.h"
+#include "blockallocator.h"
+#include "criticalsection.h"
+#include "signal.h"
+#include "thread.h"
+#include "time.h"
+
+#define WIN32_LEAN_AND_MEAN
+#include <Windows.h>
+
+#include <queue>
+#include <vector>
+
+/************************************************************************/
+/*                                                                      */
+/* STRUCTS                                                              */
+/*                                                                      */
+/************************************************************************/
+
+//------------------------------------------------------------------------
+struct job_io_file_t
+{
+   HANDLE handle;
+   bool is_overlapped;     // tied to the completion port - otherwise reads block an IO thread
+};
+
+//------------------------------------------------------------------------
+struct job_io_request_t
+{
+   // first - the completion port hands back a pointer to it
+   OVERLAPPED overlapped;
+
+   job_io_file_t *file;
+   void *buffer;
+   uint size;
+   uint64_t offset;
+   eJobIOMode op;
+
+   job_io_result_t *result;
+
+   // finishes when we do - the request holds a reference and a dispatch
+   Job *job;
+};
+
+//------------------------------------------------------------------------
+struct job_io_system_t
+{
+   HANDLE port;            // nullptr when everything blocks
+   thread_handle_t completion_thread;
+
+   std::vector<thread_handle_t> threads;
+   Signal *signal;
+   bool volatile is_running;
+
+   // requests past the queue depth wait here for someone to finish
+   CriticalSection pending_lock;
+   std::queue<job_io_request_t*> pending;
+   uint queue_depth;
+   uint in_flight;
+
+   // made but not finished - shutdown waits on this
+   uint volatile outstanding;
+
+   // blocking requests currently in a read
+   uint volatile blocking_count;
+
+   job_io_stats_t stats;
+};
+
+/************************************************************************/
+/*                                                                      */
+/* LOCAL VARIABLES                                                      */
+/*                                                                      */
+/************************************************************************/
+static job_io_system_t *gIO = nullptr;
+static LocklessBlockAllocator gIORequestPool( sizeof(job_io_request_t) );
+
+/************************************************************************/
+/*                                                                      */
+/* LOCAL FUNCTIONS                                                      */
+/*                                                                      */
+/************************************************************************/
+
+//------------------------------------------------------------------------
+static void RecordMax( uint volatile *max, uint value )
+{
+   uint old = *max;
+   while (value > old) {
+      uint prev = CompareAndSet( max, old, value );
+      if (prev == old) {
+         return;
+      }
+      old = prev;
+   }
+}
+
+//------------------------------------------------------------------------
+// Nothing to do - the job is only there to finish when the IO does
+static void IORequestJob( void* )
+{
+}
+
+//------------------------------------------------------------------------
+static void CompleteRequest( job_io_request_t *req, uint bytes, uint error )
+{
+   if (nullptr != req->result) {
+      req->result->bytes = bytes;
+      req->result->error = error;
+   }
+
+   if (0 != error) {
+      AtomicIncrement( &gIO->stats.error_count );
+   }
+   AtomicAdd64( &gIO->stats.total_bytes, bytes );
+
+   Job *job = req->job;
+   gIORequestPool.free( req );
+
+   // drops the hold we had on it along with our reference
+   JobDispatchAndRelease( job );
+   AtomicDecrement( &gIO->outstanding );
+}
+
+//------------------------------------------------------------------------
+static void SetOffset( job_io_request_t *req )
+{
+   memset( &req->overlapped, 0, sizeof(OVERLAPPED) );
+   req->overlapped.Offset = (DWORD)req->offset;
+   req->overlapped.OffsetHigh = (DWORD)(req->offset >> 32);
+}
+
+//------------------------------------------------------------------------
+// Returns false if it failed without ever going to the OS - it's already finished.
+static bool IssueRequest( job_io_request_t *req )
+{
+   SetOffset( req );
+
+   BOOL ok;
+   if (JOB_IO_READ == req->op) {
+      ok = ::ReadFile( req->file->handle, req->buffer, req->size, nullptr, &req->overlapped );
+   } else {
+      ok = ::WriteFile( req->file->handle, req->buffer, req->size, nullptr, &req->overlapped );
+   }
+
+   // the completion comes through the port either way - even if it was done right away
+   if (ok) {
+      return true;
+   }
+
+   DWORD error = ::GetLastError();
+   if (ERROR_IO_PENDING == error) {
+      return true;
+   }
+
+   CompleteRequest( req, 0, error );
+   return false;
+}
+
+//------------------------------------------------------------------------
+// A request came back - its slot goes to the next one waiting, if any
+static void ReleaseQueueSlot()
+{
+   while (true) {
+      job_io_request_t *next = nullptr;
+      {
+         SCOPE_LOCK( gIO->pending_lock );
+         if (gIO->pending.empty()) {
+            --gIO->in_flight;
+            return;
+         }
+
+         next = gIO->pending.front();
+         gIO->pending.pop();
+      }
+
+      if (IssueRequest( next )) {
+         return;
+      }
+   }
+}
+
+//------------------------------------------------------------------------
+static void SubmitRequest( job_io_request_t *req )
+{
+   {
+      SCOPE_LOCK( gIO->pending_lock );
+      if (gIO->in_flight >= gIO->queue_depth) {
+         gIO->pending.push( req );
+         RecordMax( &gIO->stats.max_pending, (uint)gIO->pending.size() );
+         return;
+      }
+
+      ++gIO->in_flight;
+      RecordMax( &gIO->stats.max_in_flight, gIO->in_flight );
+   }
+
+   if (!IssueRequest( req )) {
+      ReleaseQueueSlot();
+   }
+}
+
+//------------------------------------------------------------------------
+// The JOB_IO job a request turns into without a completion port
+static void RunBlockingRequest( void *ptr )
+{
+   job_io_request_t *req = (job_io_request_t*)ptr;
+   SetOffset( req );
+
+   RecordMax( &gIO->stats.max_in_flight, AtomicIncrement( &gIO->blocking_count ) );
+
+   DWORD bytes = 0;
+   BOOL ok;
+   if (JOB_IO_READ == req->op) {
+      ok = ::ReadFile( req->file->handle, req->buffer, req->size, &bytes, &req->overlapped );
+   } else {
+      ok = ::WriteFile( req->file->handle, req->buffer, req->size, &bytes, &req->overlapped );
+   }
+
+   AtomicDecrement( &gIO->blocking_count );
+   CompleteRequest( req, bytes, ok ? 0 : ::GetLastError() );
+}
+
+//------------------------------------------------------------------------
+static Job* CreateRequest( job_io_file_t *file, void *buffer, uint size, uint64_t offset, eJobIOMode op, job_io_result_t *result )
+{
+   if (nullptr == gIO) {
+      // JobIOStartup first
+      __debugbreak();
+   }
+
+   // held back until the IO is done, and kept alive for the request
+   Job *job = JobCreate( JOB_GENERIC, IORequestJob, nullptr );
+   AtomicIncrement( &job->dependancy_count );
+   JobAcquire( job );
+
+   job_io_request_t *req = (job_io_request_t*) gIORequestPool.alloc( sizeof(job_io_request_t) );
+   req->file = file;
+   req->buffer = buffer;
+   req->size = size;
+   req->offset = offset;
+   req->op = op;
+   req->result = result;
+   req->job = job;
+
+   AtomicIncrement( &gIO->outstanding );
+   AtomicIncrement( &gIO->stats.request_count );
+
+   if (file->is_overlapped) {
+      SubmitRequest( req );
+   } else {
+      JobDispatchAndRelease( JobCreate( JOB_IO, RunBlockingRequest, req ) );
+   }
+
+   return job;
+}
+
+//------------------------------------------------------------------------
+static void IOCompletionThread( job_io_system_t *io )
+{
+   ThreadSetNameInVisualStudio( "IO Completion" );
+   JobSystemPinCurrentThread( JOB_IO );
+
+   OVERLAPPED_ENTRY entries[JOB_IO_COMPLETION_BATCH];
+   bool is_quitting = false;
+   while (!is_quitting) {
+      ULONG count = 0;
+      if (!::GetQueuedCompletionStatusEx( io->port, entries, JOB_IO_COMPLETION_BATCH, &count, INFINITE, FALSE )) {
+         continue;
+      }
+
+      for (ULONG i = 0; i < count; ++i) {
+         // shutdown posts an empty one once nothing is left in flight
+         job_io_request_t *req = (job_io_request_t*)entries[i].lpOverlapped;
+         if (nullptr == req) {
+            is_quitting = true;
+            continue;
+         }
+
+         DWORD bytes = 0;
+         DWORD error = 0;
+         if (!::GetOverlappedResult( req->file->handle, &req->overlapped, &bytes, FALSE )) {
+            error = ::GetLastError();
+         }
+
+         ReleaseQueueSlot();
+         CompleteRequest( req, bytes, error );
+      }
+   }
+}
+
+//------------------------------------------------------------------------
+// Runs JOB_IO jobs - the blocking requests, and anything else put there
+static void IOThread( job_io_system_t *io )
+{
+   ThreadSetNameInVisualStudio( "IO Worker" );
+   JobSystemPinCurrentThread( JOB_IO );
+
+   JobConsumer consumer;
+   consumer.add_category( JOB_IO );
+
+   while (io->is_running) {
+      consumer.consume_all_jobs();
+      io->signal->wait();
+   }
+
+   consumer.consume_all_jobs();
+}
+
+/************************************************************************/
+/*                                                                      */
+/* GLOBAL FUNCTIONS                                                     */
+/*                                                                      */
+/************************************************************************/
+
+//------------------------------------------------------------------------
+void JobIOStartup( uint queue_depth /*= JOB_IO_DEFAULT_QUEUE_DEPTH*/, uint thread_count /*= JOB_IO_DEFAULT_THREAD_COUNT*/, uint flags /*= 0*/ )
+{
+   gIO = new job_io_system_t();
+   gIO->queue_depth = (queue_depth > 0) ? queue_depth : 1;
+   gIO->in_flight = 0;
+   gIO->outstanding = 0;
+   gIO->blocking_count = 0;
+   gIO->is_running = true;
+   memset( &gIO->stats, 0, sizeof(gIO->stats) );
+
+   gIO->port = nullptr;
+   if (0 == (flags & JOB_IO_FLAG_BLOCKING)) {
+      gIO->port = ::CreateIoCompletionPort( INVALID_HANDLE_VALUE, nullptr, 0, 1 );
+   }
+
+   if (nullptr != gIO->port) {
+      gIO->completion_thread = ThreadCreate( IOCompletionThread, gIO );
+   } else if (0 == thread_count) {
+      // someone has to do the reads
+      thread_count = 1;
+   }
+
+   gIO->signal = new Signal( (thread_count > 0) ? thread_count : 1 );
+   JobSystemSetSignal( JOB_IO, gIO->signal );
+   for (uint i = 0; i < thread_count; ++i) {
+      gIO->threads.push_back( ThreadCreate( IOThread, gIO ) );
+   }
+}
+
+//------------------------------------------------------------------------
+void JobIOShutdown()
+{
+   if (nullptr == gIO) {
+      return;
+   }
+
+   // everything in flight has to land first
+   while (gIO->outstanding > 0) {
+      ThreadSleep( 1 );
+   }
+
+   if (nullptr != gIO->port) {
+      ::PostQueuedCompletionStatus( gIO->port, 0, 0, nullptr );
+      ThreadJoin( gIO->completion_thread );
+      ::CloseHandle( gIO->port );
+   }
+
+   gIO->is_running = false;
+   JobSystemSetSignal( JOB_IO, nullptr );
+   gIO->signal->signal_n( (uint)gIO->threads.size() );
+   if (!gIO->threads.empty()) {
+      ThreadJoin( gIO->threads.data(), (uint)gIO->threads.size() );
+   }
+
+   delete gIO->signal;
+   delete gIO;
+   gIO = nullptr;
+}
+
+//------------------------------------------------------------------------
+job_io_file_t* JobIOOpen( char const *filename, eJobIOMode mode )
+{
+   DWORD const access = (JOB_IO_READ == mode) ? GENERIC_READ : GENERIC_WRITE;
+   DWORD const creation = (JOB_IO_READ == mode) ? OPEN_EXISTING : CREATE_ALWAYS;
+
+   bool is_overlapped = (nullptr != gIO) && (nullptr != gIO->port);
+   DWORD const attributes = FILE_ATTRIBUTE_NORMAL | (is_overlapped ? FILE_FLAG_OVERLAPPED : 0);
+   HANDLE handle = ::CreateFileA( filename, access, FILE_SHARE_READ, nullptr, creation, attributes, nullptr );
+   if (INVALID_HANDLE_VALUE == handle) {
+      return nullptr;
+   }
+
+   if (is_overlapped && (nullptr == ::CreateIoCompletionPort( handle, gIO->port, 0, 0 ))) {
+      // couldn't tie it to the port - open it again to block instead
+      ::CloseHandle( handle );
+      is_overlapped = false;
+      handle = ::CreateFileA( filename, access, FILE_SHARE_READ, nullptr, OPEN_EXISTING, FILE_ATTRIBUTE_NORMAL, nullptr );
+      if (INVALID_HANDLE_VALUE == handle) {
+         return nullptr;
+      }
+   }
+
+   job_io_file_t *file = new job_io_file_t();
+   file->handle = handle;
+   file->is_overlapped = is_overlapped;
+   return file;
+}
+
+//------------------------------------------------------------------------
+void JobIOClose( job_io_file_t *file )
+{
+   if (nullptr == file) {
+      return;
+   }
+
+   ::CloseHandle( file->handle );
+   delete file;
+}
+
+//------------------------------------------------------------------------
+Job* JobIORead( job_io_file_t *file, void *buffer, uint size, uint64_t offset, job_io_result_t *result /*= nullptr*/ )
+{
+   return CreateRequest( file, buffer, size, offset, JOB_IO_READ, result );
+}
+
+//------------------------------------------------------------------------
+Job* JobIOWrite( job_io_file_t *file, void const *buffer, uint size, uint64_t offset, job_io_result_t *result /*= nullptr*/ )
+{
+   return CreateRequest( file, (void*)buffer, size, offset, JOB_IO_WRITE, result );
+}
+
+//------------------------------------------------------------------------
+void JobIOGetStats( job_io_stats_t *out )
+{
+   if (nullptr == gIO) {
+      memset( out, 0, sizeof(job_io_stats_t) );
+      return;
+   }
+
+   *out = gIO->stats;
+}
+
+//------------------------------------------------------------------------
+void JobIOResetStats()
+{
+   if (nullptr != gIO) {
+      memset( &gIO->stats, 0, sizeof(gIO->stats) );
+   }
+}
+
+
+//--------------------------------------------------------------------
+// Some test code
+//--------------------------------------------------------------------
+
+//--------------------------------------------------------------------
+struct io_test_chunk_t
+{
+   uint *data;
+   uint first_value;
+   uint count;
+   job_io_result_t result;
+   uint volatile *bad_count;
+};
+
+//--------------------------------------------------------------------
+static void CheckChunk( void *ptr )
+{
+   io_test_chunk_t *chunk = (io_test_chunk_t*)ptr;
+   bool ok = (0 == chunk->result.error) && (chunk->result.bytes == (chunk->count * sizeof(uint)));
+   for (uint i = 0; ok && (i < chunk->count); ++i) {
+      ok = (chunk->data[i] == (chunk->first_value + i));
+   }
+
+   if (!ok) {
+      AtomicIncrement( chunk->bad_count );
+   }
+}
+
+//--------------------------------------------------------------------
+static void IOTestBusyWork( void *ptr )
+{
+   uint64_t end_op = TimeGetOpCount() + TimeOpCountFrom_ms( 0.05 );
+   while (TimeGetOpCount() < end_op) {
+      ThreadYield();
+   }
+   AtomicIncrement( (uint*)ptr );
+}
+
+//--------------------------------------------------------------------
+void JobIOTest()
+{
+   char const *FILENAME = "job_io_test.bin";
+   uint const CHUNK_SIZE = 16 * 1024;
+   uint const CHUNK_COUNT = 512;
+   uint const CHUNK_VALUES = CHUNK_SIZE / sizeof(uint);
+   uint const BUSY_COUNT = 256;
+
+   std::vector<uint> source( CHUNK_VALUES * CHUNK_COUNT );
+   for (uint i = 0; i < (uint)source.size(); ++i) {
+      source[i] = i;
+   }
+   std::vector<uint> dest( source.size() );
+   std::vector<io_test_chunk_t> chunks( CHUNK_COUNT );
+   std::vector<Job*> jobs;
+
+   JobSystemStartup( JOB_TYPE_COUNT );
+
+   for (uint mode = 0; mode < 2; ++mode) {
+      JobIOStartup( JOB_IO_DEFAULT_QUEUE_DEPTH, JOB_IO_DEFAULT_THREAD_COUNT, (0 == mode) ? 0 : JOB_IO_FLAG_BLOCKING );
+      char const *mode_name = (0 == mode) ? "completion port" : "blocking";
+
+      // write it out in chunks
+      job_io_file_t *file = JobIOOpen( FILENAME, JOB_IO_WRITE );
+      if (nullptr == file) {
+         printf( "JobIOTest: couldn't create %s\n", FILENAME );
+         JobIOShutdown();
+         break;
+      }
+
+      jobs.clear();
+      for (uint i = 0; i < CHUNK_COUNT; ++i) {
+         jobs.push_back( JobIOWrite( file, &source[i * CHUNK_VALUES], CHUNK_SIZE, (uint64_t)i * CHUNK_SIZE ) );
+      }
+      JobDispatchBatch( jobs.data(), (uint)jobs.size() );
+      for (uint i = 0; i < (uint)jobs.size(); ++i) {
+         JobWaitAndRelease( jobs[i] );
+      }
+      JobIOClose( file );
+
+      // read it back with a check hung off every read, and some compute work alongside
+      memset( dest.data(), 0, dest.size() * sizeof(uint) );
+      JobIOResetStats();
+
+      file = JobIOOpen( FILENAME, JOB_IO_READ );
+      uint bad_count = 0;
+      uint busy_count = 0;
+
+      uint64_t start_op = TimeGetOpCount();
+      jobs.clear();
+      for (uint i = 0; i < BUSY_COUNT; ++i) {
+         jobs.push_back( JobCreate( JOB_GENERIC, IOTestBusyWork, &busy_count ) );
+      }
+
+      for (uint i = 0; i < CHUNK_COUNT; ++i) {
+         io_test_chunk_t *chunk = &chunks[i];
+         chunk->data = &dest[i * CHUNK_VALUES];
+         chunk->first_value = i * CHUNK_VALUES;
+         chunk->count = CHUNK_VALUES;
+         chunk->bad_count = &bad_count;
+
+         Job *read = JobIORead( file, chunk->data, CHUNK_SIZE, (uint64_t)i * CHUNK_SIZE, &chunk->result );
+         Job *check = JobCreate( JOB_GENERIC, CheckChunk, chunk );
+         check->dependent_on( read );
+         JobDispatchAndRelease( read );
+         jobs.push_back( check );
+      }
+
+      // compute work goes out with the checks - none of it should wait on the disk
+      JobDispatchBatch( jobs.data(), (uint)jobs.size() );
+      for (uint i = 0; i < (uint)jobs.size(); ++i) {
+         JobWaitAndRelease( jobs[i] );
+      }
+      uint64_t elapsed_op = TimeGetOpCount() - start_op;
+      JobIOClose( file );
+
+      job_io_stats_t stats;
+      JobIOGetStats( &stats );
+      JobIOShutdown();
+
+      if ((0 != bad_count) || (BUSY_COUNT != busy_count) || (0 != stats.error_count)) {
+         __debugbreak();
+      }
+
+      double ms = TimeOpCountTo_ms( elapsed_op );
+      printf( "JobIOTest [%s]: %u reads of %u KB with %u compute jobs in %.2f ms [%.1f MB/s], at most %u in flight, %u waiting\n",
+         mode_name, CHUNK_COUNT, CHUNK_SIZE / 1024, BUSY_COUNT, ms,
+         ((double)stats.total_bytes / (1024.0 * 1024.0)) / (ms / 1000.0),
+         stats.max_in_flight, stats.max_pending );
+   }
+
+   ::DeleteFileA( FILENAME );
+   JobSystemShutdown();
+}
@@ -0,0 +1,115 @@
+#pragma once
+#if !defined( __JOB_IO__ )
+#define __JOB_IO__
+
+// File reads and writes that don't tie up a worker while the disk gets around to them.
+//
+// Each request comes back as a job that finishes once the IO does - hang work off it
+// like any other job, and dispatch it when you're done adding dependents.  Files opened
+// through here are tied to an IO completion port, so requests are in flight as soon as
+// they're made [up to the queue depth, past that they wait their turn] and a single
+// thread picks up the completions and dispatches the jobs.
+//
+//    job_io_file_t *file = JobIOOpen( "level.pak", JOB_IO_READ );
+//    Job *read = JobIORead( file, buffer, size, offset, &result );
+//    Job *parse = JobCreate( JOB_GENERIC, [&]() { Parse( buffer, result.bytes ); } );
+//    parse->dependent_on( read );
+//    JobDispatchAndRelease( read );
+//    JobDispatchAndRelease( parse );
+//
+// Without a completion port [JOB_IO_FLAG_BLOCKING, or it couldn't be made] requests
+// are JOB_IO jobs run by a small pool of threads that block in the read instead.  Any
+// other JOB_IO job is run by that pool too.
+
+/************************************************************************/
+/*                                                                      */
+/* INCLUDE                                                              */
+/*                                                                      */
+/************************************************************************/
+#include "common.h"
+
+/************************************************************************/
+/*                                                                      */
+/* DEFINES AND CONSTANTS                                                */
+/*                                                                      */
+/************************************************************************/
+// requests in flight at once - the rest queue up behind them
+#define JOB_IO_DEFAULT_QUEUE_DEPTH (256)
+
+// threads running JOB_IO jobs
+#define JOB_IO_DEFAULT_THREAD_COUNT (2)
+
+// completions picked up per wake of the completion thread
+#define JOB_IO_COMPLETION_BATCH (64)
+
+/************************************************************************/
+/*                                                                      */
+/* TYPES                                                                */
+/*                                                                      */
+/************************************************************************/
+class Job;
+struct job_io_file_t;
+
+enum eJobIOMode : uint
+{
+   JOB_IO_READ,
+   JOB_IO_WRITE,     // created [or emptied if it exists]
+};
+
+enum eJobIOFlag : uint
+{
+   // no completion port - every request blocks one of the IO threads
+   JOB_IO_FLAG_BLOCKING = (1 << 0),
+};
+
+/************************************************************************/
+/*                                                                      */
+/* STRUCTS                                                              */
+/*                                                                      */
+/************************************************************************/
+// Filled in before the request's job finishes
+struct job_io_result_t
+{
+   uint bytes;
+   uint error;    // GetLastError() code, 0 on success
+};
+
+struct job_io_stats_t
+{
+   uint request_count;
+   uint error_count;
+   uint max_in_flight;     // most requests the OS had at once
+   uint max_pending;       // most waiting on the queue depth
+   uint64_t total_bytes;
+};
+
+/************************************************************************/
+/*                                                                      */
+/* FUNCTION PROTOTYPES                                                  */
+/*                                                                      */
+/************************************************************************/
+// After JobSystemStartup, and shut down before JobSystemShutdown.  Shutdown waits
+// for everything still in flight.
+void JobIOStartup( uint queue_depth = JOB_IO_DEFAULT_QUEUE_DEPTH, uint thread_count = JOB_IO_DEFAULT_THREAD_COUNT, uint flags = 0 );
+void JobIOShutdown();
+
+// nullptr if it couldn't be opened
+job_io_file_t* JobIOOpen( char const *filename, eJobIOMode mode );
+
+// Nothing can be in flight on it
+void JobIOClose( job_io_file_t *file );
+
+// The returned job finishes once the IO is done - result [optional] is filled in
+// before then.  The buffer has to stay put until it finishes.  Dispatch and release
+// it like any other job - the IO itself doesn't wait on the dispatch.
+Job* JobIORead( job_io_file_t *file, void *buffer, uint size, uint64_t offset, job_io_result_t *result = nullptr );
+Job* JobIOWrite( job_io_file_t *file, void const *buffer, uint size, uint64_t offset, job_io_result_t *result = nullptr );
+
+void JobIOGetStats( job_io_stats_t *out );
+void JobIOResetStats();
+
+// Hundreds of reads in flight, with compute work running alongside - through the completion
+// port first, then again through the blocking pool
+void JobIOTest();
+
+#endif
@@ -0,0 +1,429 @@
+/************************************************************************/
+/*                                                                      */
+/* INCLUDE                                                              */
+/*                                                                      */
+/************************************************************************/
+#include "job_metrics.h"
+
+#include "job.h"
+#include "atomic.h"
+#include "criticalsection.h"
+#include "time.h"
+
+#define WIN32_LEAN_AND_MEAN
+#include <Windows.h>
+
+#include <vector>
+
+/************************************************************************/
+/*                                                                      */
+/* DEFINES AND CONSTANTS                                                */
+/*                                                                      */
+/************************************************************************/
+// job_metrics_counters_t is nothing but these - lets snapshots add and subtract them in one loop
+#define JOB_METRICS_COUNTER_COUNT (sizeof(job_metrics_counters_t) / sizeof(uint64_t))
+
+/************************************************************************/
+/*                                                                      */
+/* STRUCTS                                                              */
+/*                                                                      */
+/************************************************************************/
+
+//------------------------------------------------------------------------
+// Only the owning thread writes counters and the max - snapshots read them
+// without locking, so may come out a job behind.
+struct job_metrics_record_t
+{
+   job_metrics_counters_t counters;
+
+   // longest job since max_epoch started - a new epoch starts it over
+   uint64_t max_job_op;
+   uint max_epoch;
+
+   // counters as of the last snapshot - only snapshots touch it
+   job_metrics_counters_t last;
+
+   char name[32];
+   int worker_index;
+};
+
+/************************************************************************/
+/*                                                                      */
+/* LOCAL VARIABLES                                                      */
+/*                                                                      */
+/************************************************************************/
+// Records are never freed - a thread that goes away still counts toward the snapshot after.
+static CriticalSection gMetricsLock;
+static std::vector<job_metrics_record_t*> gMetricRecords;
+static thread_local job_metrics_record_t *tMetrics = nullptr;
+
+// bumped by every snapshot
+static uint volatile gMetricsEpoch = 1;
+static uint64_t gLastSnapshotOp = 0;
+
+static uint64_t gOpPerMicrosecond = 0;
+
+/************************************************************************/
+/*                                                                      */
+/* LOCAL FUNCTIONS                                                      */
+/*                                                                      */
+/************************************************************************/
+
+//------------------------------------------------------------------------
+static job_metrics_record_t* CreateRecord()
+{
+   if (0 == gOpPerMicrosecond) {
+      uint64_t op = TimeOpCountFrom_ms( 0.001 );
+      gOpPerMicrosecond = (op > 0) ? op : 1;
+   }
+
+   job_metrics_record_t *record = new job_metrics_record_t();
+   memset( record, 0, sizeof(job_metrics_record_t) );
+   record->max_epoch = gMetricsEpoch;
+   record->worker_index = JobSystemGetCurrentWorkerIndex();
+
+   {
+      SCOPE_LOCK(gMetricsLock);
+      if (record->worker_index >= 0) {
+         sprintf_s( record->name, sizeof(record->name), "worker %i", record->worker_index );
+      } else {
+         sprintf_s( record->name, sizeof(record->name), "thread %u", (uint)gMetricRecords.size() );
+      }
+      gMetricRecords.push_back( record );
+   }
+
+   tMetrics = record;
+   return record;
+}
+
+//------------------------------------------------------------------------
+static inline job_metrics_record_t* GetRecord()
+{
+   return (nullptr != tMetrics) ? tMetrics : CreateRecord();
+}
+
+//------------------------------------------------------------------------
+static inline uint GetBucket( uint64_t op )
+{
+   uint64_t us = op / gOpPerMicrosecond;
+   if (0 == us) {
+      return 0;
+   }
+
+   unsigned long bit;
+   _BitScanReverse64( &bit, us );
+   return (bit + 1 < JOB_METRICS_BUCKET_COUNT) ? (uint)(bit + 1) : (JOB_METRICS_BUCKET_COUNT - 1);
+}
+
+//------------------------------------------------------------------------
+static inline uint64_t* AsArray( job_metrics_counters_t *counters )
+{
+   return (uint64_t*)counters;
+}
+
+//------------------------------------------------------------------------
+static double Percent( uint64_t part, uint64_t whole )
+{
+   return (whole > 0) ? (100.0 * (double)part / (double)whole) : 0.0;
+}
+
+//------------------------------------------------------------------------
+static void DumpHistogramText( char const *name, uint64_t const *buckets, FILE *fh )
+{
+   fprintf( fh, "  %-5s", name );
+   for (uint i = 0; i < JOB_METRICS_BUCKET_COUNT; ++i) {
+      if (0 == buckets[i]) {
+         continue;
+      }
+
+      if (0 == i) {
+         fprintf( fh, " <1us:%llu", (unsigned long long)buckets[i] );
+      } else {
+         fprintf( fh, " %s%uus:%llu", (i == (JOB_METRICS_BUCKET_COUNT - 1)) ? ">=" : "", 1U << (i - 1), (unsigned long long)buckets[i] );
+      }
+   }
+   fprintf( fh, "\n" );
+}
+
+//------------------------------------------------------------------------
+static void DumpArrayJSON( char const *name, uint64_t const *values, uint count, FILE *fh )
+{
+   fprintf( fh, "\"%s\":[", name );
+   for (uint i = 0; i < count; ++i) {
+      fprintf( fh, "%s%llu", (i > 0) ? "," : "", (unsigned long long)values[i] );
+   }
+   fprintf( fh, "]" );
+}
+
+//------------------------------------------------------------------------
+static void DumpArrayJSON( char const *name, std::vector<uint> const &values, FILE *fh )
+{
+   fprintf( fh, "\"%s\":[", name );
+   for (uint i = 0; i < (uint)values.size(); ++i) {
+      fprintf( fh, "%s%u", (i > 0) ? "," : "", values[i] );
+   }
+   fprintf( fh, "]" );
+}
+
+//------------------------------------------------------------------------
+static void DumpCountersJSON( job_metrics_counters_t const *c, uint64_t max_job_op, FILE *fh )
+{
+   fprintf( fh, "\"jobs_run\":%llu,\"busy_ms\":%.3f,\"idle_ms\":%.3f,\"steal_attempts\":%llu,\"steals\":%llu,\"max_job_ms\":%.3f,",
+      (unsigned long long)c->jobs_run,
+      TimeOpCountTo_ms( c->busy_op ),
+      TimeOpCountTo_ms( c->idle_op ),
+      (unsigned long long)c->steal_attempts,
+      (unsigned long long)c->steals,
+      TimeOpCountTo_ms( max_job_op ) );
+   DumpArrayJSON( "run_histogram", c->run_histogram, JOB_METRICS_BUCKET_COUNT, fh );
+   fprintf( fh, "," );
+   DumpArrayJSON( "wait_histogram", c->wait_histogram, JOB_METRICS_BUCKET_COUNT, fh );
+}
+
+/************************************************************************/
+/*                                                                      */
+/* GLOBAL FUNCTIONS                                                     */
+/*                                                                      */
+/************************************************************************/
+
+//------------------------------------------------------------------------
+void JobMetricsRecordRun( uint64_t op )
+{
+   job_metrics_record_t *record = GetRecord();
+   ++record->counters.jobs_run;
+   record->counters.busy_op += op;
+   ++record->counters.run_histogram[GetBucket( op )];
+
+   uint epoch = gMetricsEpoch;
+   if (record->max_epoch != epoch) {
+      record->max_epoch = epoch;
+      record->max_job_op = 0;
+   }
+   if (op > record->max_job_op) {
+      record->max_job_op = op;
+   }
+}
+
+//------------------------------------------------------------------------
+void JobMetricsRecordQueueWait( uint64_t op )
+{
+   job_metrics_record_t *record = GetRecord();
+   ++record->counters.wait_histogram[GetBucket( op )];
+}
+
+//------------------------------------------------------------------------
+void JobMetricsRecordSteal( bool found )
+{
+   job_metrics_record_t *record = GetRecord();
+   ++record->counters.steal_attempts;
+   if (found) {
+      ++record->counters.steals;
+   }
+}
+
+//------------------------------------------------------------------------
+void JobMetricsRecordIdle( uint64_t op )
+{
+   GetRecord()->counters.idle_op += op;
+}
+
+//------------------------------------------------------------------------
+void JobMetricsSnapshot( job_metrics_snapshot_t *out )
+{
+   out->threads.clear();
+   memset( &out->total, 0, sizeof(out->total) );
+   out->max_job_op = 0;
+
+   {
+      SCOPE_LOCK(gMetricsLock);
+
+      uint64_t now = TimeGetOpCount();
+      out->elapsed_op = (0 != gLastSnapshotOp) ? (now - gLastSnapshotOp) : 0;
+      gLastSnapshotOp = now;
+
+      uint const epoch = gMetricsEpoch;
+      for (uint i = 0; i < (uint)gMetricRecords.size(); ++i) {
+         job_metrics_record_t *record = gMetricRecords[i];
+
+         job_metrics_thread_t thread;
+         memcpy( thread.name, record->name, sizeof(thread.name) );
+         thread.worker_index = record->worker_index;
+         thread.max_job_op = (record->max_epoch == epoch) ? record->max_job_op : 0;
+
+         job_metrics_counters_t current = record->counters;
+         uint64_t *cur = AsArray( &current );
+         uint64_t *last = AsArray( &record->last );
+         uint64_t *delta = AsArray( &thread.counters );
+         uint64_t *total = AsArray( &out->total );
+         for (uint c = 0; c < JOB_METRICS_COUNTER_COUNT; ++c) {
+            delta[c] = cur[c] - last[c];
+            total[c] += delta[c];
+         }
+         record->last = current;
+
+         out->max_job_op = (thread.max_job_op > out->max_job_op) ? thread.max_job_op : out->max_job_op;
+         out->threads.push_back( thread );
+      }
+
+      // everyone's longest job starts over from here
+      AtomicIncrement( &gMetricsEpoch );
+   }
+
+   double const seconds = TimeOpCountTo_ms( out->elapsed_op ) / 1000.0;
+   out->jobs_per_second = (seconds > 0.0) ? ((double)out->total.jobs_run / seconds) : 0.0;
+
+   JobSystemGetQueueDepths( &out->queue_depths, &out->deque_depths );
+}
+
+//------------------------------------------------------------------------
+void JobMetricsReset()
+{
+   SCOPE_LOCK(gMetricsLock);
+   for (uint i = 0; i < (uint)gMetricRecords.size(); ++i) {
+      gMetricRecords[i]->last = gMetricRecords[i]->counters;
+   }
+
+   gLastSnapshotOp = TimeGetOpCount();
+   AtomicIncrement( &gMetricsEpoch );
+}
+
+//------------------------------------------------------------------------
+void JobMetricsDumpText( job_metrics_snapshot_t const *snapshot, FILE *fh )
+{
+   job_metrics_counters_t const &total = snapshot->total;
+   fprintf( fh, "Job metrics: %.3f ms, %llu jobs [%.0f/s], longest %.3f ms, %llu of %llu steals [%.1f%%]\n",
+      TimeOpCountTo_ms( snapshot->elapsed_op ),
+      (unsigned long long)total.jobs_run,
+      snapshot->jobs_per_second,
+      TimeOpCountTo_ms( snapshot->max_job_op ),
+      (unsigned long long)total.steals, (unsigned long long)total.steal_attempts,
+      Percent( total.steals, total.steal_attempts ) );
+
+   fprintf( fh, "  queued:" );
+   for (uint i = 0; i < (uint)snapshot->queue_depths.size(); ++i) {
+      fprintf( fh, " %u", snapshot->queue_depths[i] );
+   }
+   fprintf( fh, "   deques:" );
+   for (uint i = 0; i < (uint)snapshot->deque_depths.size(); ++i) {
+      fprintf( fh, " %u", snapshot->deque_depths[i] );
+   }
+   fprintf( fh, "\n" );
+
+   DumpHistogramText( "run", total.run_histogram, fh );
+   DumpHistogramText( "wait", total.wait_histogram, fh );
+
+   for (uint i = 0; i < (uint)snapshot->threads.size(); ++i) {
+      job_metrics_thread_t const &thread = snapshot->threads[i];
+      job_metrics_counters_t const &c = thread.counters;
+      if ((0 == c.jobs_run) && (0 == c.idle_op) && (0 == c.steal_attempts)) {
+         continue;
+      }
+
+      fprintf( fh, "  %-10s %7llu jobs, busy %5.1f%%, idle %5.1f%%, %llu of %llu steals, longest %.3f ms\n",
+         thread.name,
+         (unsigned long long)c.jobs_run,
+         Percent( c.busy_op, snapshot->elapsed_op ),
+         Percent( c.idle_op, snapshot->elapsed_op ),
+         (unsigned long long)c.steals, (unsigned long long)c.steal_attempts,
+         TimeOpCountTo_ms( thread.max_job_op ) );
+   }
+}
+
+//------------------------------------------------------------------------
+void JobMetricsDumpJSON( job_metrics_snapshot_t const *snapshot, FILE *fh )
+{
+   fprintf( fh, "{\"elapsed_ms\":%.3f,\"jobs_per_second\":%.1f,", TimeOpCountTo_ms( snapshot->elapsed_op ), snapshot->jobs_per_second );
+   DumpCountersJSON( &snapshot->total, snapshot->max_job_op, fh );
+   fprintf( fh, "," );
+   DumpArrayJSON( "queue_depths", snapshot->queue_depths, fh );
+   fprintf( fh, "," );
+   DumpArrayJSON( "deque_depths", snapshot->deque_depths, fh );
+
+   fprintf( fh, ",\"threads\":[" );
+   for (uint i = 0; i < (uint)snapshot->threads.size(); ++i) {
+      job_metrics_thread_t const &thread = snapshot->threads[i];
+      fprintf( fh, "%s\n  {\"name\":\"%s\",\"worker\":%i,", (i > 0) ? "," : "", thread.name, thread.worker_index );
+      DumpCountersJSON( &thread.counters, thread.max_job_op, fh );
+      fprintf( fh, "}" );
+   }
+   fprintf( fh, "]}\n" );
+}
+
+
+//--------------------------------------------------------------------
+// Some test code
+//--------------------------------------------------------------------
+
+//--------------------------------------------------------------------
+static void MetricsTestSpin( void *ptr )
+{
+   double ms = *(double*)ptr;
+   uint64_t end_op = TimeGetOpCount() + TimeOpCountFrom_ms( ms );
+   while (TimeGetOpCount() < end_op) {
+      // busy
+   }
+}
+
+//--------------------------------------------------------------------
+void JobMetricsTest()
+{
+   uint const FRAME_COUNT = 3;
+   uint const JOBS_PER_FRAME = 2000;
+   double const SMALL_MS = 0.002;
+   double const HUGE_MS = 8.0;
+
+   JobSystemStartup( JOB_TYPE_COUNT );
+
+   // first frame starts here
+   JobMetricsReset();
+
+   job_metrics_snapshot_t frame;
+   std::vector<Job*> jobs;
+   for (uint f = 0; f < FRAME_COUNT; ++f) {
+      jobs.clear();
+
+      // a tree of small jobs, so the workers have something to steal
+      Job *root = JobCreate( JOB_GENERIC, MetricsTestSpin, (void*)&SMALL_MS );
+      for (uint i = 0; i < JOBS_PER_FRAME; ++i) {
+         Job *job = JobCreate( JOB_GENERIC, MetricsTestSpin, (void*)&SMALL_MS );
+         job->dependent_on( root );
+         jobs.push_back( job );
+      }
+
+      // the hitch
+      if (1 == f) {
+         jobs.push_back( JobCreate( JOB_GENERIC, MetricsTestSpin, (void*)&HUGE_MS ) );
+      }
+
+      JobDispatchBatch( jobs.data(), (uint)jobs.size() );
+      JobDispatchAndRelease( root );
+      for (uint i = 0; i < (uint)jobs.size(); ++i) {
+         JobWaitAndRelease( jobs[i] );
+      }
+
+      JobMetricsSnapshot( &frame );
+      printf( "JobMetricsTest [frame %u]\n", f );
+      JobMetricsDumpText( &frame, stdout );
+
+#if JOB_METRICS_ENABLED
+      if (frame.total.jobs_run != (uint64_t)(jobs.size() + 1)) {
+         __debugbreak();
+      }
+
+      bool const has_hitch = TimeOpCountTo_ms( frame.max_job_op ) >= HUGE_MS;
+      if (has_hitch != (1 == f)) {
+         __debugbreak();
+      }
+#endif
+   }
+
+   FILE *fh = nullptr;
+   errno_t err = fopen_s( &fh, "job_metrics.json", "w+" );
+   if ((0 == err) && (nullptr != fh)) {
+      JobMetricsDumpJSON( &frame, fh );
+      fclose( fh );
+      printf( "JobMetricsTest: wrote job_metrics.json\n" );
+   }
+
+   JobSystemShutdown();
+}
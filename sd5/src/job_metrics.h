@@ -0,0 +1,132 @@
+#pragma once
+#if !defined( __JOB_METRICS__ )
+#define __JOB_METRICS__
+
+// Counters and histograms for what the job system is doing - jobs run, time spent
+// running and parked, steals tried and won, how long jobs ran and sat in queues.
+//
+// Every thread that runs jobs has its own set and is the only one that writes to
+// it, so recording is a couple of timer reads and some plain adds per job.  A
+// snapshot adds them up and reports everything since the previous snapshot, so
+// taking one a frame gives that frame:
+//
+//    job_metrics_snapshot_t frame;
+//    JobMetricsSnapshot( &frame );
+//    if (TimeOpCountTo_ms( frame.max_job_op ) > 4.0) {
+//       JobMetricsDumpText( &frame, stdout );
+//    }
+//
+// Define JOB_METRICS_ENABLED to 0 to compile the hooks out of the job system.
+
+/************************************************************************/
+/*                                                                      */
+/* INCLUDE                                                              */
+/*                                                                      */
+/************************************************************************/
+#include "common.h"
+
+#include <stdio.h>
+#include <vector>
+
+/************************************************************************/
+/*                                                                      */
+/* DEFINES AND CONSTANTS                                                */
+/*                                                                      */
+/************************************************************************/
+#if !defined(JOB_METRICS_ENABLED)
+   #define JOB_METRICS_ENABLED (1)
+#endif
+
+// Bucket 0 is under a microsecond, bucket n is [2^(n-1), 2^n) microseconds, and the
+// last one is everything longer [~16ms and up]
+#define JOB_METRICS_BUCKET_COUNT (16)
+
+/************************************************************************/
+/*                                                                      */
+/* MACROS                                                               */
+/*                                                                      */
+/************************************************************************/
+// Hooks used by job.cpp
+#if JOB_METRICS_ENABLED
+   #define JOB_METRICS_RUN_BEGIN()           uint64_t const __metrics_begin_op = TimeGetOpCount()
+   #define JOB_METRICS_RUN_END()             JobMetricsRecordRun( TimeGetOpCount() - __metrics_begin_op )
+   #define JOB_METRICS_QUEUE_WAIT( op )      JobMetricsRecordQueueWait( op )
+   #define JOB_METRICS_STEAL( found )        JobMetricsRecordSteal( found )
+   #define JOB_METRICS_IDLE_BEGIN()          uint64_t const __metrics_idle_op = TimeGetOpCount()
+   #define JOB_METRICS_IDLE_END()            JobMetricsRecordIdle( TimeGetOpCount() - __metrics_idle_op )
+#else
+   #define JOB_METRICS_RUN_BEGIN()
+   #define JOB_METRICS_RUN_END()
+   #define JOB_METRICS_QUEUE_WAIT( op )
+   #define JOB_METRICS_STEAL( found )
+   #define JOB_METRICS_IDLE_BEGIN()
+   #define JOB_METRICS_IDLE_END()
+#endif
+
+/************************************************************************/
+/*                                                                      */
+/* STRUCTS                                                              */
+/*                                                                      */
+/************************************************************************/
+struct job_metrics_counters_t
+{
+   uint64_t jobs_run;
+   uint64_t busy_op;          // running jobs [nested ones count toward their outer job too]
+   uint64_t idle_op;          // workers parked with nothing to do
+   uint64_t steal_attempts;   // went looking through other workers' deques
+   uint64_t steals;           // ...and came back with something
+
+   uint64_t run_histogram[JOB_METRICS_BUCKET_COUNT];     // how long each job ran
+   uint64_t wait_histogram[JOB_METRICS_BUCKET_COUNT];    // how long jobs sat in a category queue first [not the worker deques]
+};
+
+//------------------------------------------------------------------------
+struct job_metrics_thread_t
+{
+   char name[32];
+   int worker_index;          // -1 if it isn't a generic worker
+   job_metrics_counters_t counters;
+   uint64_t max_job_op;       // longest single job
+};
+
+//------------------------------------------------------------------------
+// Everything since the previous snapshot [or reset]
+struct job_metrics_snapshot_t
+{
+   uint64_t elapsed_op;
+   double jobs_per_second;
+
+   job_metrics_counters_t total;
+   uint64_t max_job_op;
+
+   std::vector<job_metrics_thread_t> threads;
+
+   // at the moment the snapshot was taken
+   std::vector<uint> queue_depths;     // per category
+   std::vector<uint> deque_depths;     // per generic worker
+};
+
+/************************************************************************/
+/*                                                                      */
+/* FUNCTION PROTOTYPES                                                  */
+/*                                                                      */
+/************************************************************************/
+// Meant to be taken once a frame from one place - two takers would split the counts between them
+void JobMetricsSnapshot( job_metrics_snapshot_t *out );
+
+// The next snapshot starts from now
+void JobMetricsReset();
+
+void JobMetricsDumpText( job_metrics_snapshot_t const *snapshot, FILE *fh );
+void JobMetricsDumpJSON( job_metrics_snapshot_t const *snapshot, FILE *fh );
+
+// used by the hooks above
+void JobMetricsRecordRun( uint64_t op );
+void JobMetricsRecordQueueWait( uint64_t op );
+void JobMetricsRecordSteal( bool found );
+void JobMetricsRecordIdle( uint64_t op );
+
+// A few frames with one long job in the middle - snapshots each, and writes job_metrics.json
+void JobMetricsTest();
+
+#endif
@@ -0,0 +1,434 @@
+/************************************************************************/
+/*                                                                      */
+/* INCLUDE                                                              */
+/*                                                                      */
+/************************************************************************/
+#include "job_parallel.h"
+
+#include "atomic.h"
+#include "thread.h"
+#include "time.h"
+#include "profile.h"
+
+/************************************************************************/
+/*                                                                      */
+/* DEFINES AND CONSTANTS                                                */
+/*                                                                      */
+/************************************************************************/
+
+/************************************************************************/
+/*                                                                      */
+/* MACROS                                                               */
+/*                                                                      */
+/************************************************************************/
+
+/************************************************************************/
+/*                                                                      */
+/* TYPES                                                                */
+/*                                                                      */
+/************************************************************************/
+
+/************************************************************************/
+/*                                                                      */
+/* STRUCTS                                                              */
+/*                                                                      */
+/************************************************************************/
+struct parallel_for_t;
+
+//------------------------------------------------------------------------
+// user data for a single split off piece of the range
+struct range_node_t
+{
+   parallel_for_t *pfor;
+   uint begin;
+   uint end;
+};
+
+//------------------------------------------------------------------------
+// Shared by every piece of a single JobParallelForRange call - lives on the
+// caller's stack, which is fine as the caller doesn't return until pending hits 0.
+struct parallel_for_t
+{
+   job_range_cb cb;
+   void *user_data;
+   uint grain;
+
+   // pieces handed to the job system that haven't finished yet
+   uint volatile pending;
+
+   // Allocated up front so splitting never allocates.  Every piece is bigger than
+   // grain / 2, so there can't be more than 2 * count / grain of them.
+   range_node_t *nodes;
+   uint node_count;
+   uint next_node;
+};
+
+/************************************************************************/
+/*                                                                      */
+/* LOCAL VARIABLES                                                      */
+/*                                                                      */
+/************************************************************************/
+static uint gLastGrain = 0;
+
+/************************************************************************/
+/*                                                                      */
+/* LOCAL FUNCTIONS                                                      */
+/*                                                                      */
+/************************************************************************/
+static void ParallelRangeJob( void *ptr );
+
+//------------------------------------------------------------------------
+// Keep handing off the top half until what's left is small enough, then do it.
+static void RunRange( parallel_for_t *pfor, uint begin, uint end )
+{
+   while ((end - begin) > pfor->grain) {
+      uint mid = begin + (end - begin) / 2;
+
+      uint idx = AtomicIncrement( &pfor->next_node ) - 1;
+      range_node_t *node = &pfor->nodes[idx];
+      node->pfor = pfor;
+      node->begin = mid;
+      node->end = end;
+
+      AtomicIncrement( (uint*)&pfor->pending );
+      Job *job = JobCreate( JOB_GENERIC, ParallelRangeJob, node );
+      JobDispatchAndRelease( job );
+
+      end = mid;
+   }
+
+   pfor->cb( begin, end, pfor->user_data );
+}
+
+//------------------------------------------------------------------------
+static void ParallelRangeJob( void *ptr )
+{
+   range_node_t *node = (range_node_t*)ptr;
+   parallel_for_t *pfor = node->pfor;
+
+   RunRange( pfor, node->begin, node->end );
+   AtomicDecrement( (uint*)&pfor->pending );
+}
+
+//------------------------------------------------------------------------
+// Runs the front of the range on this thread in doubling batches until we have
+// enough time to trust the measurement.  Returns how many items were done
+// and the op count per item through out_ops_per_item.
+static uint SampleRange( uint begin, uint end, job_range_cb cb, void *user_data, double *out_ops_per_item )
+{
+   uint64_t const sample_ops = TimeOpCountFrom_ms( (double)PARALLEL_FOR_SAMPLE_US / 1000.0 );
+
+   // never sample more than a small part of the work - it's all on one thread.
+   uint max_sample = (end - begin) / 16;
+   max_sample = (max_sample > 0) ? max_sample : 1;
+
+   uint sampled = 0;
+   uint batch = 1;
+   uint64_t elapsed = 0;
+   while ((sampled < max_sample) && (elapsed < sample_ops)) {
+      batch = ((sampled + batch) > max_sample) ? (max_sample - sampled) : batch;
+
+      uint64_t start_op = TimeGetOpCount();
+      cb( begin + sampled, begin + sampled + batch, user_data );
+      elapsed += TimeGetOpCount() - start_op;
+
+      sampled += batch;
+      batch *= 2;
+   }
+
+   *out_ops_per_item = (double)elapsed / (double)sampled;
+   return sampled;
+}
+
+/************************************************************************/
+/*                                                                      */
+/* GLOBAL FUNCTIONS                                                     */
+/*                                                                      */
+/************************************************************************/
+
+//------------------------------------------------------------------------
+void JobParallelForRange( uint begin, uint end, job_range_cb cb, void *user_data, uint grain /*= 0*/ )
+{
+   if (end <= begin) {
+      return;
+   }
+
+   uint worker_count = JobSystemGetWorkerCount();
+   if (0 == worker_count) {
+      cb( begin, end, user_data );
+      return;
+   }
+
+   if (0 == grain) {
+      double ops_per_item;
+      begin += SampleRange( begin, end, cb, user_data, &ops_per_item );
+      if (begin == end) {
+         return;
+      }
+
+      uint const count = end - begin;
+      double const target_ops = (double)TimeOpCountFrom_ms( (double)PARALLEL_FOR_TARGET_CHUNK_US / 1000.0 );
+      double chunk = (ops_per_item > 0.0) ? (target_ops / ops_per_item) : (double)count;
+
+      // everyone [workers + us] should get at least a piece - unless the whole
+      // thing is less than a chunk, in which case it isn't worth splitting at all.
+      uint const per_thread = (count + worker_count) / (worker_count + 1);
+      if (chunk >= (double)count) {
+         grain = count;
+      } else {
+         grain = (chunk >= (double)per_thread) ? per_thread : (uint)chunk;
+         grain = (grain > 0) ? grain : 1;
+      }
+
+      gLastGrain = grain;
+   }
+
+   uint const count = end - begin;
+   if (count <= grain) {
+      cb( begin, end, user_data );
+      return;
+   }
+
+   parallel_for_t pfor;
+   pfor.cb = cb;
+   pfor.user_data = user_data;
+   pfor.grain = grain;
+   pfor.pending = 0;
+   pfor.node_count = 2 * (count / grain) + 2;
+   pfor.nodes = (range_node_t*) ::malloc( sizeof(range_node_t) * pfor.node_count );
+   pfor.next_node = 0;
+
+   RunRange( &pfor, begin, end );
+
+   // Help out until all the pieces are back.  Anything we pick up might not be
+   // ours, but it's work that needs doing either way.
+   JobConsumer consumer;
+   consumer.add_category( JOB_GENERIC );
+   while (pfor.pending > 0) {
+      if (!consumer.consume_job()) {
+         ThreadYield();
+      }
+   }
+
+   ::free( pfor.nodes );
+}
+
+//------------------------------------------------------------------------
+uint JobParallelForGetLastGrain()
+{
+   return gLastGrain;
+}
+
+//------------------------------------------------------------------------
+uint JobParallelGetBlockCount( uint count, uint grain )
+{
+   if (0 == grain) {
+      uint const thread_count = JobSystemGetWorkerCount() + 1;
+      grain = count / (thread_count * PARALLEL_REDUCE_BLOCKS_PER_THREAD);
+      grain = (grain > PARALLEL_REDUCE_MIN_GRAIN) ? grain : PARALLEL_REDUCE_MIN_GRAIN;
+   }
+
+   uint const block_count = (uint)(((uint64_t)count + grain - 1) / grain);
+   return (block_count > 0) ? block_count : 1;
+}
+
+
+//--------------------------------------------------------------------
+// Some test code
+//--------------------------------------------------------------------
+
+//--------------------------------------------------------------------
+static void CountRange( uint begin, uint end, void *ptr )
+{
+   uint *counts = (uint*)ptr;
+   for (uint i = begin; i < end; ++i) {
+      AtomicIncrement( &counts[i] );
+   }
+}
+
+//--------------------------------------------------------------------
+void JobParallelForTest()
+{
+   uint const MAX_COUNT = 100000;
+   uint const SIZES[] = { 1, 7, 1000, MAX_COUNT };
+   uint const GRAINS[] = { 0, 1, 64, MAX_COUNT };
+
+   JobSystemStartup( JOB_TYPE_COUNT );
+
+   // every item is touched exactly once, however we split it.
+   uint *counts = new uint[MAX_COUNT];
+   for (uint si = 0; si < (sizeof(SIZES) / sizeof(SIZES[0])); ++si) {
+      for (uint gi = 0; gi < (sizeof(GRAINS) / sizeof(GRAINS[0])); ++gi) {
+         memset( counts, 0, sizeof(uint) * MAX_COUNT );
+         JobParallelForRange( 0, SIZES[si], CountRange, counts, GRAINS[gi] );
+
+         for (uint i = 0; i < SIZES[si]; ++i) {
+            if (counts[i] != 1) {
+               __debugbreak();
+            }
+         }
+      }
+   }
+
+   // and the lambda version
+   memset( counts, 0, sizeof(uint) * MAX_COUNT );
+   JobParallelFor( 10, MAX_COUNT, [=]( uint idx ) { counts[idx] += idx; } );
+   for (uint i = 0; i < MAX_COUNT; ++i) {
+      if (counts[i] != ((i >= 10) ? i : 0)) {
+         __debugbreak();
+      }
+   }
+
+   delete[] counts;
+   JobSystemShutdown();
+}
+
+//--------------------------------------------------------------------
+struct reduce_test_bounds_t
+{
+   uint min_value;
+   uint max_value;
+};
+
+//--------------------------------------------------------------------
+void JobParallelReduceTest()
+{
+   uint const MAX_COUNT = 10000000;
+   uint const SIZES[] = { 0, 1, 7, 5000, 100003 };
+   uint const GRAINS[] = { 0, 1, 64 };
+   uint const PASS_COUNT = 4;
+
+   JobSystemStartup( JOB_TYPE_COUNT );
+
+   uint *values = new uint[MAX_COUNT];
+   for (uint i = 0; i < MAX_COUNT; ++i) {
+      values[i] = (i * 2654435761U) >> 20;
+   }
+
+   // Against a serial loop, however it gets split up.  The scan compacts the odd values 
+   // out - a 1 per keeper, scanned, is where each one goes.
+   uint *flags = new uint[MAX_COUNT];
+   uint *offsets = new uint[MAX_COUNT];
+   uint *compacted = new uint[MAX_COUNT];
+   for (uint si = 0; si < (sizeof(SIZES) / sizeof(SIZES[0])); ++si) {
+      uint const count = SIZES[si];
+
+      uint64_t expected_sum = 0;
+      reduce_test_bounds_t expected_bounds = { 0xffffffff, 0 };
+      uint expected_kept = 0;
+      for (uint i = 0; i < count; ++i) {
+         expected_sum += values[i];
+         expected_bounds.min_value = (values[i] < expected_bounds.min_value) ? values[i] : expected_bounds.min_value;
+         expected_bounds.max_value = (values[i] > expected_bounds.max_value) ? values[i] : expected_bounds.max_value;
+         expected_kept += values[i] & 1;
+      }
+
+      for (uint gi = 0; gi < (sizeof(GRAINS) / sizeof(GRAINS[0])); ++gi) {
+         uint64_t sum = JobParallelReduce( 0, count, (uint64_t)0, 
+            [=]( uint begin, uint end ) {
+               uint64_t s = 0;
+               for (uint i = begin; i < end; ++i) {
+                  s += values[i];
+               }
+               return s;
+            },
+            []( uint64_t a, uint64_t b ) { return a + b; }, GRAINS[gi] );
+
+         reduce_test_bounds_t const empty_bounds = { 0xffffffff, 0 };
+         reduce_test_bounds_t bounds = JobParallelReduce( 0, count, empty_bounds, 
+            [=]( uint begin, uint end ) {
+               reduce_test_bounds_t b = empty_bounds;
+               for (uint i = begin; i < end; ++i) {
+                  b.min_value = (values[i] < b.min_value) ? values[i] : b.min_value;
+                  b.max_value = (values[i] > b.max_value) ? values[i] : b.max_value;
+               }
+               return b;
+            },
+            []( reduce_test_bounds_t const &a, reduce_test_bounds_t const &b ) {
+               reduce_test_bounds_t r;
+               r.min_value = (a.min_value < b.min_value) ? a.min_value : b.min_value;
+               r.max_value = (a.max_value > b.max_value) ? a.max_value : b.max_value;
+               return r;
+            }, GRAINS[gi] );
+
+         if ((sum != expected_sum) 
+            || (bounds.min_value != expected_bounds.min_value) 
+            || (bounds.max_value != expected_bounds.max_value)) {
+            __debugbreak();
+         }
+
+         for (uint i = 0; i < count; ++i) {
+            flags[i] = values[i] & 1;
+         }
+         uint kept = JobParallelScan( flags, offsets, count, 0U, []( uint a, uint b ) { return a + b; }, GRAINS[gi] );
+         if (kept != expected_kept) {
+            __debugbreak();
+         }
+
+         JobParallelFor( 0, count, [=]( uint i ) {
+            if (0 != flags[i]) {
+               compacted[offsets[i]] = values[i];
+            }
+         });
+
+         uint next = 0;
+         for (uint i = 0; i < count; ++i) {
+            if ((values[i] & 1) && (compacted[next++] != values[i])) {
+               __debugbreak();
+            }
+         }
+      }
+   }
+
+   // and how long summing all of them takes
+   for (uint pass = 0; pass < PASS_COUNT; ++pass) {
+      uint64_t start_op = TimeGetOpCount();
+      uint64_t serial_sum = 0;
+      for (uint i = 0; i < MAX_COUNT; ++i) {
+         serial_sum += values[i];
+      }
+      uint64_t serial_op = TimeGetOpCount() - start_op;
+
+      start_op = TimeGetOpCount();
+      uint64_t reduce_sum = JobParallelReduce( 0, MAX_COUNT, (uint64_t)0, 
+         [=]( uint begin, uint end ) {
+            uint64_t s = 0;
+            for (uint i = begin; i < end; ++i) {
+               s += values[i];
+            }
+            return s;
+         },
+         []( uint64_t a, uint64_t b ) { return a + b; } );
+      uint64_t reduce_op = TimeGetOpCount() - start_op;
+
+      // what people write without it - everyone adding into the same line
+      start_op = TimeGetOpCount();
+      uint64_t shared_sum = 0;
+      uint64_t *shared_ptr = &shared_sum;
+      JobParallelFor( 0, MAX_COUNT, [=]( uint i ) {
+         AtomicAdd64( shared_ptr, values[i] );
+      });
+      uint64_t shared_op = TimeGetOpCount() - start_op;
+
+      start_op = TimeGetOpCount();
+      JobParallelScan( values, offsets, MAX_COUNT, 0U, []( uint a, uint b ) { return a + b; } );
+      uint64_t scan_op = TimeGetOpCount() - start_op;
+
+      if ((reduce_sum != serial_sum) || (shared_sum != serial_sum)) {
+         __debugbreak();
+      }
+
+      printf( "JobParallelReduceTest [%u items]: serial %.3f ms, reduce %.3f ms, shared AtomicAdd %.3f ms, scan %.3f ms\n",
+         MAX_COUNT,
+         TimeOpCountTo_ms( serial_op ),
+         TimeOpCountTo_ms( reduce_op ),
+         TimeOpCountTo_ms( shared_op ),
+         TimeOpCountTo_ms( scan_op ) );
+   }
+
+   delete[] compacted;
+   delete[] offsets;
+   delete[] flags;
+   delete[] values;
+   JobSystemShutdown();
+}
@@ -0,0 +1,213 @@
+#pragma once
+#if !defined( __JOB_PARALLEL__ )
+#define __JOB_PARALLEL__
+
+// Parallel loops on top of the job system.
+// The range is split in half recursively - each split hands the upper half to
+// the job system and keeps going on the lower half - until pieces are "grain"
+// items big.  The calling thread works on the range too, and helps out with
+// other jobs until the whole thing is done.
+//
+// Reduce and scan cut the range into a fixed set of blocks instead, a few per
+// thread, each with its own partial result on its own cache line.  The partials
+// are combined afterwards in the same order every time - so a float sum comes
+// out the same from run to run on the same machine.
+//
+//    float energy = JobParallelReduce( 0, count, 0.0f, 
+//       [=]( uint begin, uint end ) { float sum = 0.0f; for (...) { sum += ...; } return sum; },
+//       []( float a, float b ) { return a + b; } );
+
+/************************************************************************/
+/*                                                                      */
+/* INCLUDE                                                              */
+/*                                                                      */
+/************************************************************************/
+#include "common.h"
+#include "job.h"
+
+#include <vector>
+
+/************************************************************************/
+/*                                                                      */
+/* DEFINES AND CONSTANTS                                                */
+/*                                                                      */
+/************************************************************************/
+// How long we'd like a single chunk of work to take when picking the grain
+// ourselves.  Long enough that the cost of the job is noise, short enough
+// that there are plenty of pieces to steal.
+#define PARALLEL_FOR_TARGET_CHUNK_US  (50)
+
+// Most time spent up front measuring the cost of a single item
+#define PARALLEL_FOR_SAMPLE_US        (10)
+
+// Reduce/scan blocks per thread [workers + the caller] when picking the grain ourselves - 
+// more than one so a thread that got in late still has some to take.
+#define PARALLEL_REDUCE_BLOCKS_PER_THREAD (4)
+
+// ...but no block smaller than this many items
+#define PARALLEL_REDUCE_MIN_GRAIN     (4096)
+
+/************************************************************************/
+/*                                                                      */
+/* TYPES                                                                */
+/*                                                                      */
+/************************************************************************/
+// does the work for items [begin, end)
+typedef void (*job_range_cb)( uint begin, uint end, void *user_data );
+
+/************************************************************************/
+/*                                                                      */
+/* FUNCTION PROTOTYPES                                                  */
+/*                                                                      */
+/************************************************************************/
+// Runs cb over [begin, end) split up across the job system, and returns once all of it is done.
+// grain is the smallest piece we'll bother splitting - 0 will measure the cost
+// of a few items and pick one.  Runs on the calling thread if the job system isn't up.
+void JobParallelForRange( uint begin, uint end, job_range_cb cb, void *user_data, uint grain = 0 );
+
+// Grain picked for the last call that measured one (0 if none have yet)
+uint JobParallelForGetLastGrain();
+
+// How many blocks reduce/scan cut count items into - grain 0 picks from the worker count
+uint JobParallelGetBlockCount( uint count, uint grain );
+
+void JobParallelForTest();
+
+// Reduce and scan against a serial loop, and a reduce against everyone AtomicAdd'ing one counter
+void JobParallelReduceTest();
+
+/************************************************************************/
+/*                                                                      */
+/* STRUCTS                                                              */
+/*                                                                      */
+/************************************************************************/
+// A block's partial result - padded so blocks finishing together aren't writing the same line
+template <typename T>
+struct job_parallel_partial_t
+{
+   T value;
+   byte_t pad[CACHE_LINE_SIZE];
+};
+
+/************************************************************************/
+/*                                                                      */
+/* TEMPLATES                                                            */
+/*                                                                      */
+/************************************************************************/
+
+//------------------------------------------------------------------------
+// body( uint begin, uint end )
+template <typename CB>
+void JobParallelForRange( uint begin, uint end, CB const &body, uint grain = 0 )
+{
+   JobParallelForRange( begin, end,
+      []( uint b, uint e, void *ptr ) { (*(CB const*)ptr)( b, e ); },
+      (void*)&body, grain );
+}
+
+//------------------------------------------------------------------------
+// body( uint idx )
+template <typename CB>
+void JobParallelFor( uint begin, uint end, CB const &body, uint grain = 0 )
+{
+   JobParallelForRange( begin, end,
+      []( uint b, uint e, void *ptr ) {
+         CB const &cb = *(CB const*)ptr;
+         for (uint i = b; i < e; ++i) {
+            cb(i);
+         }
+      },
+      (void*)&body, grain );
+}
+
+//------------------------------------------------------------------------
+// first item of block in [0, count) cut into block_count blocks
+inline uint JobParallelGetBlockStart( uint count, uint block_count, uint block )
+{
+   return (uint)(((uint64_t)count * block) / block_count);
+}
+
+//------------------------------------------------------------------------
+// Pairs up neighbours each round, so partials combine in a fixed order.  There are 
+// only a few per thread, so this is done by the caller.
+template <typename T, typename COMBINE_CB>
+T JobParallelCombineTree( std::vector<job_parallel_partial_t<T>> &partials, COMBINE_CB const &combine )
+{
+   uint const count = (uint)partials.size();
+   for (uint stride = 1; stride < count; stride *= 2) {
+      for (uint i = 0; (i + stride) < count; i += 2 * stride) {
+         partials[i].value = combine( partials[i].value, partials[i + stride].value );
+      }
+   }
+   return partials[0].value;
+}
+
+//------------------------------------------------------------------------
+// body( uint begin, uint end ) returns the result for [begin, end), and combine( T a, T b ) 
+// merges two results - it has to be associative, and identity merged with anything 
+// has to give that thing back.
+template <typename T, typename RANGE_CB, typename COMBINE_CB>
+T JobParallelReduce( uint begin, uint end, T const &identity, RANGE_CB const &body, COMBINE_CB const &combine, uint grain = 0 )
+{
+   if (end <= begin) {
+      return identity;
+   }
+
+   uint const count = end - begin;
+   uint const block_count = JobParallelGetBlockCount( count, grain );
+
+   std::vector<job_parallel_partial_t<T>> partials( block_count, job_parallel_partial_t<T>{ identity } );
+   JobParallelFor( 0, block_count, [&]( uint block ) {
+      uint const first = begin + JobParallelGetBlockStart( count, block_count, block );
+      uint const last = begin + JobParallelGetBlockStart( count, block_count, block + 1 );
+      partials[block].value = body( first, last );
+   }, 1 );
+
+   return JobParallelCombineTree( partials, combine );
+}
+
+//------------------------------------------------------------------------
+// Exclusive scan - output[i] is identity combined with input[0] through input[i - 1].
+// Returns everything combined.  output can be input.  Takes a pass to total each 
+// block, a walk over the totals to find where each starts, then a pass writing
+// each block from its start.
+template <typename T, typename COMBINE_CB>
+T JobParallelScan( T const *input, T *output, uint count, T const &identity, COMBINE_CB const &combine, uint grain = 0 )
+{
+   if (0 == count) {
+      return identity;
+   }
+
+   uint const block_count = JobParallelGetBlockCount( count, grain );
+   std::vector<job_parallel_partial_t<T>> partials( block_count, job_parallel_partial_t<T>{ identity } );
+
+   JobParallelFor( 0, block_count, [&]( uint block ) {
+      uint const last = JobParallelGetBlockStart( count, block_count, block + 1 );
+      T sum = identity;
+      for (uint i = JobParallelGetBlockStart( count, block_count, block ); i < last; ++i) {
+         sum = combine( sum, input[i] );
+      }
+      partials[block].value = sum;
+   }, 1 );
+
+   T total = identity;
+   for (uint block = 0; block < block_count; ++block) {
+      T const block_total = partials[block].value;
+      partials[block].value = total;
+      total = combine( total, block_total );
+   }
+
+   JobParallelFor( 0, block_count, [&]( uint block ) {
+      uint const last = JobParallelGetBlockStart( count, block_count, block + 1 );
+      T sum = partials[block].value;
+      for (uint i = JobParallelGetBlockStart( count, block_count, block ); i < last; ++i) {
+         T const value = input[i];
+         output[i] = sum;
+         sum = combine( sum, value );
+      }
+   }, 1 );
+
+   return total;
+}
+
+#endif
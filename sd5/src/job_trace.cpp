@@ -0,0 +1,368 @@
+/************************************************************************/
+/*                                                                      */
+/* INCLUDE                                                              */
+/*                                                                      */
+/************************************************************************/
+#include "job_trace.h"
+
+#include "job.h"
+#include "atomic.h"
+#include "criticalsection.h"
+#include "time.h"
+
+#include <vector>
+#include <unordered_map>
+
+/************************************************************************/
+/*                                                                      */
+/* STRUCTS                                                              */
+/*                                                                      */
+/************************************************************************/
+
+//------------------------------------------------------------------------
+// Only the owning thread ever writes to a ring.
+struct job_trace_ring_t
+{
+   job_trace_event_t *events;
+   uint64_t write_count;   // total ever written - index is this masked by the size
+   uint64_t next_id;
+
+   uint index;
+   char name[32];
+};
+
+//------------------------------------------------------------------------
+// where a job ran - used to line up dependency edges on export
+struct job_trace_run_t
+{
+   uint tid;
+   uint64_t begin_op;
+   uint64_t end_op;
+};
+
+/************************************************************************/
+/*                                                                      */
+/* LOCAL VARIABLES                                                      */
+/*                                                                      */
+/************************************************************************/
+// Rings are never freed - a thread that goes away may still have events we want to export.
+static CriticalSection gRingLock;
+static std::vector<job_trace_ring_t*> gRings;
+static thread_local job_trace_ring_t *tRing = nullptr;
+
+static uint64_t gTraceStartOp = 0;
+
+/************************************************************************/
+/*                                                                      */
+/* GLOBAL VARIABLES                                                     */
+/*                                                                      */
+/************************************************************************/
+bool volatile gJobTraceRecording = false;
+
+/************************************************************************/
+/*                                                                      */
+/* LOCAL FUNCTIONS                                                      */
+/*                                                                      */
+/************************************************************************/
+
+//------------------------------------------------------------------------
+static job_trace_ring_t* GetRing()
+{
+   if (nullptr != tRing) {
+      return tRing;
+   }
+
+   job_trace_ring_t *ring = new job_trace_ring_t();
+   ring->events = new job_trace_event_t[JOB_TRACE_RING_SIZE];
+   ring->write_count = 0;
+   ring->next_id = 0;
+
+   int worker = JobSystemGetCurrentWorkerIndex();
+
+   {
+      SCOPE_LOCK(gRingLock);
+      ring->index = (uint)gRings.size();
+      gRings.push_back( ring );
+   }
+
+   if (worker >= 0) {
+      sprintf_s( ring->name, sizeof(ring->name), "worker %i", worker );
+   } else {
+      sprintf_s( ring->name, sizeof(ring->name), "thread %u", ring->index );
+   }
+
+   tRing = ring;
+   return ring;
+}
+
+//------------------------------------------------------------------------
+static inline job_trace_event_t* NextEvent( job_trace_ring_t *ring )
+{
+   job_trace_event_t *ev = &ring->events[ring->write_count & (JOB_TRACE_RING_SIZE - 1)];
+   ++ring->write_count;
+   return ev;
+}
+
+//------------------------------------------------------------------------
+static double OpToTraceUS( uint64_t op )
+{
+   if (op < gTraceStartOp) {
+      return 0.0;
+   }
+   return TimeOpCountTo_ms( op - gTraceStartOp ) * 1000.0;
+}
+
+//------------------------------------------------------------------------
+static char const* GetCategoryName( uint type, char *buffer, size_t buffer_size )
+{
+   switch (type) {
+      case JOB_GENERIC:    return "generic";
+      case JOB_MAIN:       return "main";
+      case JOB_IO:         return "io";
+      case JOB_RENDER:     return "render";
+      default:
+         sprintf_s( buffer, buffer_size, "category %u", type );
+         return buffer;
+   }
+}
+
+/************************************************************************/
+/*                                                                      */
+/* GLOBAL FUNCTIONS                                                     */
+/*                                                                      */
+/************************************************************************/
+
+//------------------------------------------------------------------------
+void JobTraceStart()
+{
+   {
+      SCOPE_LOCK(gRingLock);
+      for (uint i = 0; i < gRings.size(); ++i) {
+         gRings[i]->write_count = 0;
+      }
+   }
+
+   gTraceStartOp = TimeGetOpCount();
+   gJobTraceRecording = true;
+}
+
+//------------------------------------------------------------------------
+void JobTraceStop()
+{
+   gJobTraceRecording = false;
+}
+
+//------------------------------------------------------------------------
+uint64_t JobTraceGetEventCount()
+{
+   SCOPE_LOCK(gRingLock);
+
+   uint64_t count = 0;
+   for (uint i = 0; i < gRings.size(); ++i) {
+      count += gRings[i]->write_count;
+   }
+   return count;
+}
+
+//------------------------------------------------------------------------
+uint64_t JobTraceNextID()
+{
+   job_trace_ring_t *ring = GetRing();
+   return ((uint64_t)(ring->index + 1) << 40) | ++ring->next_id;
+}
+
+#if JOB_TRACE_ENABLED
+//------------------------------------------------------------------------
+void JobTraceRecordRun( Job *job, uint64_t begin_op )
+{
+   job_trace_ring_t *ring = GetRing();
+   job_trace_event_t *ev = NextEvent( ring );
+
+   ev->kind = JOB_TRACE_EVENT_RUN;
+   ev->type = job->type;
+   ev->job_id = job->trace_id;
+   ev->other_id = 0;
+   ev->enqueue_op = job->enqueue_op;
+   ev->begin_op = begin_op;
+   ev->end_op = TimeGetOpCount();
+   ev->work_cb = (void*)job->work_cb;
+}
+
+//------------------------------------------------------------------------
+void JobTraceRecordEdge( Job *parent, Job *child )
+{
+   if ((0 == parent->trace_id) || (0 == child->trace_id)) {
+      return;
+   }
+
+   job_trace_ring_t *ring = GetRing();
+   job_trace_event_t *ev = NextEvent( ring );
+
+   ev->kind = JOB_TRACE_EVENT_EDGE;
+   ev->type = child->type;
+   ev->job_id = parent->trace_id;
+   ev->other_id = child->trace_id;
+   ev->enqueue_op = 0;
+   ev->begin_op = TimeGetOpCount();
+   ev->end_op = ev->begin_op;
+   ev->work_cb = nullptr;
+}
+#endif
+
+//------------------------------------------------------------------------
+bool JobTraceExportChromeJSON( char const *filename )
+{
+   FILE *fh = nullptr;
+   errno_t err = fopen_s( &fh, filename, "w+" );
+   if ((err != 0) || (fh == nullptr)) {
+      return false;
+   }
+
+   SCOPE_LOCK(gRingLock);
+
+   char const *sep = "";
+   fprintf( fh, "{\"traceEvents\":[\n" );
+
+   // name each thread's track
+   for (uint i = 0; i < gRings.size(); ++i) {
+      fprintf( fh, "%s{\"name\":\"thread_name\",\"ph\":\"M\",\"pid\":1,\"tid\":%u,\"args\":{\"name\":\"%s\"}}",
+         sep, i, gRings[i]->name );
+      sep = ",\n";
+   }
+
+   // every run, remembering where it happened so edges can point at it
+   std::unordered_map<uint64_t, job_trace_run_t> runs;
+   char name_buffer[32];
+   for (uint ri = 0; ri < gRings.size(); ++ri) {
+      job_trace_ring_t *ring = gRings[ri];
+      uint64_t count = (ring->write_count < JOB_TRACE_RING_SIZE) ? ring->write_count : JOB_TRACE_RING_SIZE;
+      uint64_t first = ring->write_count - count;
+
+      for (uint64_t i = first; i < ring->write_count; ++i) {
+         job_trace_event_t const &ev = ring->events[i & (JOB_TRACE_RING_SIZE - 1)];
+         if (JOB_TRACE_EVENT_RUN != ev.kind) {
+            continue;
+         }
+
+         // enqueue time is only good if it was stamped while we were recording
+         bool has_wait = (ev.enqueue_op >= gTraceStartOp) && (ev.enqueue_op <= ev.begin_op);
+         double wait_us = has_wait ? (TimeOpCountTo_ms( ev.begin_op - ev.enqueue_op ) * 1000.0) : 0.0;
+
+         fprintf( fh, "%s{\"name\":\"%s\",\"cat\":\"job\",\"ph\":\"X\",\"ts\":%.3f,\"dur\":%.3f,\"pid\":1,\"tid\":%u,"
+            "\"args\":{\"id\":%llu,\"wait_us\":%.3f,\"work_cb\":\"%p\"}}",
+            sep,
+            GetCategoryName( ev.type, name_buffer, sizeof(name_buffer) ),
+            OpToTraceUS( ev.begin_op ),
+            OpToTraceUS( ev.end_op ) - OpToTraceUS( ev.begin_op ),
+            ri,
+            ev.job_id,
+            wait_us,
+            ev.work_cb );
+
+         if (0 != ev.job_id) {
+            job_trace_run_t run = { ri, ev.begin_op, ev.end_op };
+            runs[ev.job_id] = run;
+         }
+      }
+   }
+
+   // dependencies as flow arrows - from the end of the parent to the start of the child
+   uint flow_id = 0;
+   for (uint ri = 0; ri < gRings.size(); ++ri) {
+      job_trace_ring_t *ring = gRings[ri];
+      uint64_t count = (ring->write_count < JOB_TRACE_RING_SIZE) ? ring->write_count : JOB_TRACE_RING_SIZE;
+      uint64_t first = ring->write_count - count;
+
+      for (uint64_t i = first; i < ring->write_count; ++i) {
+         job_trace_event_t const &ev = ring->events[i & (JOB_TRACE_RING_SIZE - 1)];
+         if (JOB_TRACE_EVENT_EDGE != ev.kind) {
+            continue;
+         }
+
+         auto parent = runs.find( ev.job_id );
+         auto child = runs.find( ev.other_id );
+         if ((parent == runs.end()) || (child == runs.end())) {
+            continue; // one of them didn't run while we were recording [or fell out of the ring]
+         }
+
+         // flow start has to land inside the parent's slice to attach to it
+         fprintf( fh, "%s{\"name\":\"dependency\",\"cat\":\"job\",\"ph\":\"s\",\"id\":%u,\"ts\":%.3f,\"pid\":1,\"tid\":%u}",
+            sep, flow_id, OpToTraceUS( parent->second.end_op ) - 0.001, parent->second.tid );
+         fprintf( fh, "%s{\"name\":\"dependency\",\"cat\":\"job\",\"ph\":\"f\",\"bp\":\"e\",\"id\":%u,\"ts\":%.3f,\"pid\":1,\"tid\":%u}",
+            sep, flow_id, OpToTraceUS( child->second.begin_op ), child->second.tid );
+         ++flow_id;
+      }
+   }
+
+   fprintf( fh, "\n]}\n" );
+   fclose( fh );
+   return true;
+}
+
+
+//--------------------------------------------------------------------
+// Some test code
+//--------------------------------------------------------------------
+
+//--------------------------------------------------------------------
+static void TraceTestJob( void *ptr )
+{
+   AtomicIncrement( (uint*)ptr );
+}
+
+//--------------------------------------------------------------------
+static uint64_t RunTraceTestWorkload( uint iterations )
+{
+   uint64_t start_op = TimeGetOpCount();
+   for (uint iter = 0; iter < iterations; ++iter) {
+      uint count = 0;
+      Job *final_job = JobCreate( JOB_GENERIC, TraceTestJob, &count );
+      for (uint i = 0; i < 1000; ++i) {
+         Job *job = JobCreate( JOB_GENERIC, TraceTestJob, &count );
+         final_job->dependent_on( job );
+         JobDispatchAndRelease( job );
+      }
+
+      JobDispatch( final_job );
+      JobWaitAndRelease( final_job );
+   }
+   return TimeGetOpCount() - start_op;
+}
+
+//--------------------------------------------------------------------
+void JobTraceTest()
+{
+#if !JOB_TRACE_ENABLED
+   printf( "JobTraceTest: compiled out [JOB_TRACE_ENABLED is 0]\n" );
+#else
+   uint const ITERATIONS = 100;
+
+   JobSystemStartup( JOB_TYPE_COUNT );
+
+   // warm up
+   RunTraceTestWorkload( ITERATIONS );
+
+   uint64_t off_op = RunTraceTestWorkload( ITERATIONS );
+
+   JobTraceStart();
+   uint64_t on_op = RunTraceTestWorkload( ITERATIONS );
+   JobTraceStop();
+
+   uint64_t event_count = JobTraceGetEventCount();
+   double overhead_ns = (on_op > off_op) ? (TimeOpCountTo_ms( on_op - off_op ) * 1000000.0) : 0.0;
+   if (event_count > 0) {
+      printf( "JobTraceTest: %llu events, ~%.1f ns/event\n", event_count, overhead_ns / (double)event_count );
+   }
+
+   // something small enough to actually look at
+   JobTraceStart();
+   RunTraceTestWorkload( 2 );
+   JobTraceStop();
+
+   JobSystemShutdown();
+
+   if (JobTraceExportChromeJSON( "job_trace.json" )) {
+      printf( "JobTraceTest: wrote job_trace.json\n" );
+   }
+#endif
+}
@@ -0,0 +1,117 @@
+#pragma once
+#if !defined( __JOB_TRACE__ )
+#define __JOB_TRACE__
+
+// Records what every job did - when it was queued, when it ran and on what thread,
+// and who it was waiting on - into a ring buffer per thread.  Nothing is shared
+// between threads while recording, so it costs a couple of timer reads and a
+// few stores per job.
+//
+// Export writes Chrome's trace event JSON, which both chrome://tracing and
+// ui.perfetto.dev open.
+//
+// Define JOB_TRACE_ENABLED to 0 to compile all of it out of the job system.
+
+/************************************************************************/
+/*                                                                      */
+/* INCLUDE                                                              */
+/*                                                                      */
+/************************************************************************/
+#include "common.h"
+
+/************************************************************************/
+/*                                                                      */
+/* DEFINES AND CONSTANTS                                                */
+/*                                                                      */
+/************************************************************************/
+#if !defined(JOB_TRACE_ENABLED)
+   #define JOB_TRACE_ENABLED (1)
+#endif
+
+// events kept per thread [power of two] - oldest are overwritten
+#define JOB_TRACE_RING_SIZE (64 * 1024)
+
+/************************************************************************/
+/*                                                                      */
+/* MACROS                                                               */
+/*                                                                      */
+/************************************************************************/
+// Hooks used by job.cpp - RUN_BEGIN declares what RUN_END reads, so both go in the same scope
+#if JOB_TRACE_ENABLED
+   #define JOB_TRACE_ASSIGN_ID( job )           do { (job)->trace_id = JobTraceIsRecording() ? JobTraceNextID() : 0; } while (0)
+   #define JOB_TRACE_ENQUEUE( job )             do { if (JobTraceIsRecording()) { (job)->enqueue_op = TimeGetOpCount(); } } while (0)
+   #define JOB_TRACE_RUN_BEGIN()                uint64_t const __trace_begin_op = JobTraceIsRecording() ? TimeGetOpCount() : 0
+   #define JOB_TRACE_RUN_END( job )             do { if (0 != __trace_begin_op) { JobTraceRecordRun( (job), __trace_begin_op ); } } while (0)
+   #define JOB_TRACE_EDGE( parent, child )      do { if (JobTraceIsRecording()) { JobTraceRecordEdge( (parent), (child) ); } } while (0)
+#else
+   #define JOB_TRACE_ASSIGN_ID( job )           do {} while (0)
+   #define JOB_TRACE_ENQUEUE( job )             do {} while (0)
+   #define JOB_TRACE_RUN_BEGIN()
+   #define JOB_TRACE_RUN_END( job )             do {} while (0)
+   #define JOB_TRACE_EDGE( parent, child )      do {} while (0)
+#endif
+
+/************************************************************************/
+/*                                                                      */
+/* TYPES                                                                */
+/*                                                                      */
+/************************************************************************/
+class Job;
+
+enum eJobTraceEvent : uint
+{
+   JOB_TRACE_EVENT_RUN,    // job ran [begin_op to end_op]
+   JOB_TRACE_EVENT_EDGE,   // job_id has to finish before other_id can run
+};
+
+/************************************************************************/
+/*                                                                      */
+/* STRUCTS                                                              */
+/*                                                                      */
+/************************************************************************/
+struct job_trace_event_t
+{
+   eJobTraceEvent kind;
+   uint type;              // eJobType
+   uint64_t job_id;
+   uint64_t other_id;      // EDGE only
+
+   uint64_t enqueue_op;    // RUN only - 0 if it went in a queue before recording started
+   uint64_t begin_op;      // for an EDGE - when it was added
+   uint64_t end_op;
+
+   void *work_cb;
+};
+
+/************************************************************************/
+/*                                                                      */
+/* GLOBAL VARIABLES                                                     */
+/*                                                                      */
+/************************************************************************/
+extern bool volatile gJobTraceRecording;
+
+/************************************************************************/
+/*                                                                      */
+/* FUNCTION PROTOTYPES                                                  */
+/*                                                                      */
+/************************************************************************/
+// Start clears anything recorded before.
+void JobTraceStart();
+void JobTraceStop();
+inline bool JobTraceIsRecording()   { return gJobTraceRecording; }
+
+// Only once nothing is running jobs [rings are read without any locking].  Returns false if the file couldn't be opened.
+bool JobTraceExportChromeJSON( char const *filename );
+
+// events recorded since the last start [the rings may only still hold the newest of them]
+uint64_t JobTraceGetEventCount();
+
+// used by the hooks above [the recorders only exist with JOB_TRACE_ENABLED]
+uint64_t JobTraceNextID();
+void JobTraceRecordRun( Job *job, uint64_t begin_op );
+void JobTraceRecordEdge( Job *parent, Job *child );
+
+// Cost per event, and writes job_trace.json
+void JobTraceTest();
+
+#endif
@@ -0,0 +1,364 @@
+/************************************************************************/
+/*                                                                      */
+/* INCLUDE                                                              */
+/*                                                                      */
+/************************************************************************/
+#include "linearallocator.h"
+
+#include "random.h"
+#include "time.h"
+
+#include <vector>
+
+/************************************************************************/
+/*                                                                      */
+/* DEFINES AND CONSTANTS                                                */
+/*                                                                      */
+/************************************************************************/
+// bursty benchmark - a frame is a burst of small allocations that all die together
+#define BURST_FRAME_COUNT     (2000)
+#define BURST_MIN_COUNT       (64)
+#define BURST_MAX_COUNT       (1024)
+#define BURST_MIN_SIZE        (16)
+#define BURST_MAX_SIZE        (256)
+
+// enough for the biggest burst with debug headers and guards
+#define BURST_CAPACITY        (1024 * 1024)
+
+/************************************************************************/
+/*                                                                      */
+/* LOCAL VARIABLES                                                      */
+/*                                                                      */
+/************************************************************************/
+static std::vector<uint> gBurstSizes;
+static std::vector<uint> gBurstEnds;     // one past each frame's last size
+
+/************************************************************************/
+/*                                                                      */
+/* LOCAL FUNCTIONS                                                      */
+/*                                                                      */
+/************************************************************************/
+//--------------------------------------------------------------------
+static void BuildBursts()
+{
+   srand( 1234 );
+   gBurstSizes.clear();
+   gBurstEnds.clear();
+   for (uint f = 0; f < BURST_FRAME_COUNT; ++f) {
+      uint const count = Random( BURST_MIN_COUNT, BURST_MAX_COUNT );
+      for (uint i = 0; i < count; ++i) {
+         gBurstSizes.push_back( Random( BURST_MIN_SIZE, BURST_MAX_SIZE ) );
+      }
+      gBurstEnds.push_back( (uint)gBurstSizes.size() );
+   }
+}
+
+//--------------------------------------------------------------------
+// Every allocation of a frame is touched, then they all go at the end of it
+static double TimeSystemBursts()
+{
+   SystemAllocator allocator;
+   std::vector<void*> ptrs( BURST_MAX_COUNT );
+
+   uint64_t const start_op = TimeGetOpCount();
+   uint idx = 0;
+   for (uint f = 0; f < BURST_FRAME_COUNT; ++f) {
+      uint count = 0;
+      for (; idx < gBurstEnds[f]; ++idx) {
+         void *ptr = allocator.alloc( gBurstSizes[idx] );
+         *(uint*)ptr = idx;
+         ptrs[count++] = ptr;
+      }
+
+      for (uint i = 0; i < count; ++i) {
+         allocator.free( ptrs[i] );
+      }
+   }
+   return TimeOpCountTo_ms( TimeGetOpCount() - start_op );
+}
+
+//--------------------------------------------------------------------
+static double TimeLinearBursts( LinearAllocator *allocator )
+{
+   uint64_t const start_op = TimeGetOpCount();
+   uint idx = 0;
+   for (uint f = 0; f < BURST_FRAME_COUNT; ++f) {
+      for (; idx < gBurstEnds[f]; ++idx) {
+         void *ptr = allocator->alloc( gBurstSizes[idx] );
+         *(uint*)ptr = idx;
+      }
+      allocator->reset();
+   }
+   return TimeOpCountTo_ms( TimeGetOpCount() - start_op );
+}
+
+//--------------------------------------------------------------------
+static double TimeStackBursts( StackAllocator *allocator )
+{
+   uint64_t const start_op = TimeGetOpCount();
+   uint idx = 0;
+   for (uint f = 0; f < BURST_FRAME_COUNT; ++f) {
+      STACK_ALLOCATOR_SCOPE( *allocator );
+      for (; idx < gBurstEnds[f]; ++idx) {
+         void *ptr = allocator->alloc( gBurstSizes[idx] );
+         *(uint*)ptr = idx;
+      }
+   }
+   return TimeOpCountTo_ms( TimeGetOpCount() - start_op );
+}
+
+//--------------------------------------------------------------------
+static double TimeFrameBursts( FrameAllocator *allocator )
+{
+   uint64_t const start_op = TimeGetOpCount();
+   uint idx = 0;
+   for (uint f = 0; f < BURST_FRAME_COUNT; ++f) {
+      for (; idx < gBurstEnds[f]; ++idx) {
+         void *ptr = allocator->alloc( gBurstSizes[idx] );
+         *(uint*)ptr = idx;
+      }
+      allocator->swap();
+   }
+   return TimeOpCountTo_ms( TimeGetOpCount() - start_op );
+}
+
+/************************************************************************/
+/*                                                                      */
+/* EXTERNAL FUNCTIONS                                                   */
+/*                                                                      */
+/************************************************************************/
+//--------------------------------------------------------------------
+bool LinearAllocatorCheckGuards( byte_t const *buffer, size_t from, size_t to )
+{
+#if LINEAR_ALLOCATOR_DEBUG
+   size_t pos = from;
+   while (pos < to) {
+      size_t const start = LinearAllocatorAlign( pos ) + sizeof(linear_header_t);
+      linear_header_t const *header = (linear_header_t const*)(buffer + start) - 1;
+      if ((header->prev_top != pos) || (start + header->size + LINEAR_ALLOCATOR_GUARD_SIZE > to)) {
+         // the header itself got stomped
+         return false;
+      }
+
+      byte_t const *guard = buffer + start + header->size;
+      for (uint i = 0; i < LINEAR_ALLOCATOR_GUARD_SIZE; ++i) {
+         if (LINEAR_ALLOCATOR_GUARD_BYTE != guard[i]) {
+            return false;
+         }
+      }
+
+      pos = start + header->size + LINEAR_ALLOCATOR_GUARD_SIZE;
+   }
+#endif
+
+   return true;
+}
+
+//--------------------------------------------------------------------
+// [from, to) is coming back - make sure nobody wrote past their allocation, then
+// fill it so anyone still holding on notices
+void LinearAllocatorRelease( byte_t *buffer, size_t from, size_t to )
+{
+#if LINEAR_ALLOCATOR_DEBUG
+   if ((from > to) || !LinearAllocatorCheckGuards( buffer, from, to )) {
+      __debugbreak();
+   }
+   memset( buffer + from, LINEAR_ALLOCATOR_DEAD_BYTE, to - from );
+#endif
+}
+
+//--------------------------------------------------------------------
+LinearAllocator::LinearAllocator( size_t cap )
+{
+   buffer = (byte_t*) BlockSlabReserve( cap, 0, &base );
+   capacity = (nullptr == buffer) ? 0 : cap;
+   top = 0;
+   high_water = 0;
+}
+
+//--------------------------------------------------------------------
+LinearAllocator::~LinearAllocator()
+{
+   if (nullptr != base) {
+      BlockSlabRelease( base );
+   }
+}
+
+//--------------------------------------------------------------------
+void LinearAllocator::rewind( size_t marker )
+{
+   LinearAllocatorRelease( buffer, marker, top );
+   top = marker;
+}
+
+//--------------------------------------------------------------------
+StackAllocator::StackAllocator( size_t cap )
+{
+   buffer = (byte_t*) BlockSlabReserve( cap, 0, &base );
+   capacity = (nullptr == buffer) ? 0 : cap;
+   top = 0;
+   high_water = 0;
+}
+
+//--------------------------------------------------------------------
+StackAllocator::~StackAllocator()
+{
+   if (nullptr != base) {
+      BlockSlabRelease( base );
+   }
+}
+
+//--------------------------------------------------------------------
+void StackAllocator::free( void *ptr )
+{
+   if (nullptr == ptr) {
+      return;
+   }
+
+   linear_header_t const *header = (linear_header_t const*)ptr - 1;
+#if LINEAR_ALLOCATOR_DEBUG
+   // out of order - something allocated after this is still around
+   size_t const start = (byte_t*)ptr - buffer;
+   if (start + header->size + LINEAR_ALLOCATOR_GUARD_SIZE != top) {
+      __debugbreak();
+   }
+#endif
+
+   restore( header->prev_top );
+}
+
+//--------------------------------------------------------------------
+void StackAllocator::restore( size_t marker )
+{
+   LinearAllocatorRelease( buffer, marker, top );
+   top = marker;
+}
+
+/************************************************************************/
+/*                                                                      */
+/* UNIT TESTS                                                           */
+/*                                                                      */
+/************************************************************************/
+//--------------------------------------------------------------------
+void LinearAllocatorTest()
+{
+   // Linear - rewinding to a marker hands the same memory back out
+   {
+      LinearAllocator linear( 4096 );
+
+      void *a = linear.alloc( 1 );
+      size_t const marker = linear.get_marker();
+      void *b = linear.alloc( 100 );
+      void *c = linear.alloc( 33 );
+      if ((nullptr == a) || (nullptr == b) || (nullptr == c)
+         || (0 != ((uintptr_t)b & (LINEAR_ALLOCATOR_ALIGNMENT - 1)))
+         || (0 != ((uintptr_t)c & (LINEAR_ALLOCATOR_ALIGNMENT - 1)))
+         || ((byte_t*)c < (byte_t*)b + 100)) {
+         __debugbreak();
+      }
+
+      linear.rewind( marker );
+      if (linear.alloc( 100 ) != b) {
+         __debugbreak();
+      }
+
+      // doesn't fit, and failing doesn't cost anything
+      size_t const before = linear.get_marker();
+      if ((nullptr != linear.alloc( 8192 )) || (linear.get_marker() != before)) {
+         __debugbreak();
+      }
+
+#if LINEAR_ALLOCATOR_DEBUG
+      // one byte past the end is caught
+      byte_t *bytes = (byte_t*) linear.alloc( 10 );
+      bytes[10] = 0;
+      if (linear.check()) {
+         __debugbreak();
+      }
+      bytes[10] = LINEAR_ALLOCATOR_GUARD_BYTE;
+      if (!linear.check()) {
+         __debugbreak();
+      }
+#endif
+
+      linear.reset();
+      if ((0 != linear.get_marker()) || (linear.alloc( 1 ) != a)) {
+         __debugbreak();
+      }
+   }
+
+   // Stack - frees in reverse order, and scopes put it all back
+   {
+      StackAllocator stack( 4096 );
+
+      void *a = stack.alloc( 24 );
+      void *b = stack.alloc( 24 );
+      stack.free( b );
+      if (stack.alloc( 24 ) != b) {
+         __debugbreak();
+      }
+
+      size_t const marker = stack.get_marker();
+      {
+         STACK_ALLOCATOR_SCOPE( stack );
+         stack.alloc( 100 );
+         {
+            STACK_ALLOCATOR_SCOPE( stack );
+            stack.alloc( 200 );
+         }
+         stack.alloc( 300 );
+      }
+      if (stack.get_marker() != marker) {
+         __debugbreak();
+      }
+
+      stack.free( stack.alloc( 50 ) );
+      stack.free( b );
+      stack.free( a );
+      if (0 != stack.get_marker()) {
+         __debugbreak();
+      }
+   }
+
+   // Frame - last frame's allocations survive one swap, then the space comes back
+   {
+      FrameAllocator frames( 4096 );
+
+      uint *first = (uint*) frames.alloc( sizeof(uint) );
+      *first = 1234;
+      frames.swap();
+
+      uint *second = (uint*) frames.alloc( sizeof(uint) );
+      *second = 5678;
+      if ((first == second) || (1234 != *first) || !frames.check()) {
+         __debugbreak();
+      }
+
+      frames.swap();
+      if ((frames.alloc( sizeof(uint) ) != first) || (5678 != *second)) {
+         __debugbreak();
+      }
+   }
+
+   // Bursty small allocations, same sizes through each
+   BuildBursts();
+   printf( "LinearAllocatorTest [%u frames, %u allocs]...\n", BURST_FRAME_COUNT, (uint)gBurstSizes.size() );
+
+   LinearAllocator linear( BURST_CAPACITY );
+   StackAllocator stack( BURST_CAPACITY );
+   FrameAllocator frames( BURST_CAPACITY );
+   for (uint i = 0; i < 2; ++i) {
+      double const system_ms = TimeSystemBursts();
+      double const linear_ms = TimeLinearBursts( &linear );
+      double const stack_ms = TimeStackBursts( &stack );
+      double const frame_ms = TimeFrameBursts( &frames );
+      printf( "  system %8.3f ms   linear %8.3f ms   stack %8.3f ms   frame %8.3f ms\n",
+         system_ms, linear_ms, stack_ms, frame_ms );
+   }
+   printf( "  high water: linear %u KB, stack %u KB\n", (uint)(linear.high_water / 1024), (uint)(stack.high_water / 1024) );
+
+   gBurstSizes.clear();
+   gBurstSizes.shrink_to_fit();
+   gBurstEnds.clear();
+   gBurstEnds.shrink_to_fit();
+}
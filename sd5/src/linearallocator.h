@@ -0,0 +1,252 @@
+#pragma once
+#if !defined( __LINEAR_ALLOCATOR__ )
+#define __LINEAR_ALLOCATOR__
+
+// Allocators for memory that dies in bulk.
+//
+// LinearAllocator bumps a pointer through one buffer.  free does nothing - take a
+// marker and rewind to it [or reset] to get everything after it back at once.
+//
+// StackAllocator is the same, except every allocation remembers where the top was
+// so they can also be freed one at a time, as long as it's in reverse order.  A
+// scope puts the top back wherever it was when the scope started:
+//
+//    {
+//       STACK_ALLOCATOR_SCOPE( gTempStack );
+//       vec3 *points = (vec3*) gTempStack.alloc( count * sizeof(vec3) );
+//       ...
+//    }  // and they're gone
+//
+// FrameAllocator is two linear allocators taking turns - call swap once a frame.
+// Anything allocated stays good through the next frame, then its space is reused.
+//
+// None of these are thread safe [job_arena.h has per-thread and shared versions
+// for jobs].  With LINEAR_ALLOCATOR_DEBUG on, every allocation is followed by guard
+// bytes that are checked when the memory comes back, and memory that comes back is
+// filled with LINEAR_ALLOCATOR_DEAD_BYTE.
+
+/************************************************************************/
+/*                                                                      */
+/* INCLUDE                                                              */
+/*                                                                      */
+/************************************************************************/
+#include "common.h"
+#include "blockallocator.h"
+
+/************************************************************************/
+/*                                                                      */
+/* DEFINES AND CONSTANTS                                                */
+/*                                                                      */
+/************************************************************************/
+#if !defined(LINEAR_ALLOCATOR_DEBUG)
+   #if defined(_DEBUG)
+      #define LINEAR_ALLOCATOR_DEBUG (1)
+   #else
+      #define LINEAR_ALLOCATOR_DEBUG (0)
+   #endif
+#endif
+
+// every allocation starts on this
+#define LINEAR_ALLOCATOR_ALIGNMENT     (16)
+
+#define LINEAR_ALLOCATOR_GUARD_BYTE    (0xfd)
+#define LINEAR_ALLOCATOR_DEAD_BYTE     (0xdd)
+
+// what each allocation costs on top of its size [beyond alignment]
+#if LINEAR_ALLOCATOR_DEBUG
+   #define LINEAR_ALLOCATOR_GUARD_SIZE    (16)
+   #define LINEAR_ALLOCATOR_HEADER_SIZE   (sizeof(linear_header_t))
+#else
+   #define LINEAR_ALLOCATOR_GUARD_SIZE    (0)
+   #define LINEAR_ALLOCATOR_HEADER_SIZE   (0)
+#endif
+
+/************************************************************************/
+/*                                                                      */
+/* MACROS                                                               */
+/*                                                                      */
+/************************************************************************/
+#define STACK_ALLOCATOR_SCOPE( stack ) StackAllocatorScope COMBINE(___stack_scope_,__LINE__)(&stack)
+
+/************************************************************************/
+/*                                                                      */
+/* STRUCTS                                                              */
+/*                                                                      */
+/************************************************************************/
+// Right before an allocation - stack allocations always have one, linear
+// ones only with LINEAR_ALLOCATOR_DEBUG
+struct linear_header_t
+{
+   size_t size;
+   size_t prev_top;
+};
+
+/************************************************************************/
+/*                                                                      */
+/* FUNCTION PROTOTYPES                                                  */
+/*                                                                      */
+/************************************************************************/
+//--------------------------------------------------------------------
+inline size_t LinearAllocatorAlign( size_t offset )
+{
+   return (offset + LINEAR_ALLOCATOR_ALIGNMENT - 1) & ~((size_t)LINEAR_ALLOCATOR_ALIGNMENT - 1);
+}
+
+// Debug helpers - walk the allocations in [from, to) checking their guards
+bool LinearAllocatorCheckGuards( byte_t const *buffer, size_t from, size_t to );
+void LinearAllocatorRelease( byte_t *buffer, size_t from, size_t to );
+
+// Markers, a stack under scopes, a frame allocator through a few swaps, then a
+// bursty small allocation benchmark against SystemAllocator
+void LinearAllocatorTest();
+
+/************************************************************************/
+/*                                                                      */
+/* CLASSES                                                              */
+/*                                                                      */
+/************************************************************************/
+//--------------------------------------------------------------------
+//--------------------------------------------------------------------
+class LinearAllocator : public IAllocator
+{
+   public:
+      LinearAllocator( size_t capacity );
+      ~LinearAllocator();
+
+      // nullptr once it's out of room
+      void* alloc( size_t size )
+      {
+         size_t const start = LinearAllocatorAlign( top ) + LINEAR_ALLOCATOR_HEADER_SIZE;
+         size_t const end = start + size + LINEAR_ALLOCATOR_GUARD_SIZE;
+         if (end > capacity) {
+            return nullptr;
+         }
+
+#if LINEAR_ALLOCATOR_DEBUG
+         linear_header_t *header = (linear_header_t*)(buffer + start) - 1;
+         header->size = size;
+         header->prev_top = top;
+         memset( buffer + start + size, LINEAR_ALLOCATOR_GUARD_BYTE, LINEAR_ALLOCATOR_GUARD_SIZE );
+#endif
+
+         top = end;
+         high_water = (top > high_water) ? top : high_water;
+         return buffer + start;
+      }
+
+      // Nothing - it all comes back with rewind or reset
+      void free( void* ) {}
+
+      size_t get_marker() const { return top; }
+
+      // everything allocated since marker is gone
+      void rewind( size_t marker );
+      void reset() { rewind(0); }
+
+      // false if anything still allocated was written past [always true without LINEAR_ALLOCATOR_DEBUG]
+      bool check() const { return LinearAllocatorCheckGuards( buffer, 0, top ); }
+
+   public:
+      byte_t *buffer;
+      void *base;
+      size_t capacity;
+      size_t top;
+      size_t high_water;
+};
+
+//--------------------------------------------------------------------
+//--------------------------------------------------------------------
+class StackAllocator : public IAllocator
+{
+   public:
+      StackAllocator( size_t capacity );
+      ~StackAllocator();
+
+      // nullptr once it's out of room
+      void* alloc( size_t size )
+      {
+         size_t const start = LinearAllocatorAlign( top ) + sizeof(linear_header_t);
+         size_t const end = start + size + LINEAR_ALLOCATOR_GUARD_SIZE;
+         if (end > capacity) {
+            return nullptr;
+         }
+
+         linear_header_t *header = (linear_header_t*)(buffer + start) - 1;
+         header->size = size;
+         header->prev_top = top;
+#if LINEAR_ALLOCATOR_DEBUG
+         memset( buffer + start + size, LINEAR_ALLOCATOR_GUARD_BYTE, LINEAR_ALLOCATOR_GUARD_SIZE );
+#endif
+
+         top = end;
+         high_water = (top > high_water) ? top : high_water;
+         return buffer + start;
+      }
+
+      // Has to be the most recent allocation still around [debug builds break if it isn't]
+      void free( void *ptr );
+
+      size_t get_marker() const { return top; }
+      void restore( size_t marker );
+
+      bool check() const { return LinearAllocatorCheckGuards( buffer, 0, top ); }
+
+   public:
+      byte_t *buffer;
+      void *base;
+      size_t capacity;
+      size_t top;
+      size_t high_water;
+};
+
+//--------------------------------------------------------------------
+//--------------------------------------------------------------------
+class StackAllocatorScope
+{
+   public:
+      StackAllocatorScope( StackAllocator *s )
+         : stack(s)
+         , marker(s->get_marker())
+      {}
+
+      ~StackAllocatorScope()
+      {
+         stack->restore( marker );
+      }
+
+   public:
+      StackAllocator *stack;
+      size_t marker;
+};
+
+//--------------------------------------------------------------------
+//--------------------------------------------------------------------
+class FrameAllocator : public IAllocator
+{
+   public:
+      FrameAllocator( size_t capacity_per_frame )
+         : frame_a( capacity_per_frame )
+         , frame_b( capacity_per_frame )
+         , current( &frame_a )
+      {}
+
+      void* alloc( size_t size ) { return current->alloc( size ); }
+      void free( void* ) {}
+
+      // Once a frame - the frame before last is gone, and this one's allocations
+      // are good until the next swap after this
+      void swap()
+      {
+         current = (current == &frame_a) ? &frame_b : &frame_a;
+         current->reset();
+      }
+
+      bool check() const { return frame_a.check() && frame_b.check(); }
+
+   public:
+      LinearAllocator frame_a;
+      LinearAllocator frame_b;
+      LinearAllocator *current;
+};
+
+#endif
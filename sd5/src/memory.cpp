@@ -4,14 +4,27 @@
 /*                                                                      */
 /************************************************************************/
 #include "memory.h"
+#include "atomic.h"
+#include "callstack.h"
+#include "sizeclassallocator.h"
+#include "time.h"
 
+#define WIN32_LEAN_AND_MEAN
+#include <Windows.h>
+
+#include <algorithm>
 #include <malloc.h>
+#include <new>
 
 /************************************************************************/
 /*                                                                      */
 /* DEFINES AND CONSTANTS                                                */
 /*                                                                      */
 /************************************************************************/
+// particle churn benchmark - spawned and despawned in bursts, like an emitter would
+#define CHURN_FRAME_COUNT     (200)
+#define CHURN_PARTICLE_COUNT  (2000)
+#define CHURN_PARTICLE_SIZE   (48)
 
 /************************************************************************/
 /*                                                                      */
@@ -30,6 +43,48 @@
 /* STRUCTS                                                              */
 /*                                                                      */
 /************************************************************************/
+// In front of every tracked allocation - keeps what comes after it 16B aligned
+struct allocation_t 
+{
+   size_t byte_size;
+   uint tag;
+   uint callsite;       // 0 if it wasn't sampled
+};
+
+// One interned callstack, and what's still live from it
+struct memory_callsite_t
+{
+   uint32_t hash;
+   uint frame_count;
+   void *frames[MEMORY_TRACKING_MAX_FRAMES];
+
+   uint live_count;
+   uint64_t live_bytes;
+   uint total_count;
+};
+
+// Counts from threads that have exited [and anything they did after], plus the name
+struct memory_tag_stats_t
+{
+   uint alloc_count;
+   uint free_count;
+   uint64_t live_bytes;
+   char const *name;
+};
+
+// Each thread counts its own, so the hot path has no atomics.  They're only ever
+// added up, so freeing something another thread allocated just wraps around.
+struct memory_thread_stats_t
+{
+   memory_thread_stats_t();
+   ~memory_thread_stats_t();
+
+   memory_thread_stats_t *next;
+   uint alloc_count[MEMORY_TAG_COUNT];
+   uint free_count[MEMORY_TAG_COUNT];
+   uint64_t live_bytes[MEMORY_TAG_COUNT];
+   bool exited;
+};
 
 /************************************************************************/
 /*                                                                      */
@@ -42,6 +97,25 @@
 /* LOCAL VARIABLES                                                      */
 /*                                                                      */
 /************************************************************************/
+// All zero-initialized [nothing to construct] so new works before main
+static memory_tag_stats_t gTagStats[MEMORY_TAG_COUNT];
+static memory_callsite_t gCallsites[MEMORY_TRACKING_MAX_CALLSITES];    // [0] is never used
+static uint gCallsiteCount = 0;
+static uint gCallsiteLock = 0;
+static memory_thread_stats_t *gThreadStats = nullptr;
+static uint gThreadStatsLock = 0;
+static uint gDroppedCallstacks = 0;    // sampled, but the table was full
+static uint gSampleRate = MEMORY_TRACKING_SAMPLE_RATE;
+
+static uint gFrameAllocs = 0;
+static uint gFrameFrees = 0;
+static uint gLastAllocCount = 0;
+static uint gLastFreeCount = 0;
+
+static thread_local memory_thread_stats_t tThreadStats;
+static thread_local uint tMemoryTag = MEMORY_TAG_DEFAULT;
+static thread_local uint tSampleCountdown = 0;
+static thread_local uint tSampleRandom = 0x9e3779b9;
 
 /************************************************************************/
 /*                                                                      */
@@ -54,47 +128,383 @@
 /* LOCAL FUNCTIONS                                                      */
 /*                                                                      */
 /************************************************************************/
+//--------------------------------------------------------------------
+// Whatever new would be using without tracking
+static inline void* MemoryRawAlloc( size_t size )
+{
+#if MEMORY_SIZE_CLASS_NEW
+   return SizeClassAlloc( size );
+#else
+   return ::malloc( size );
+#endif
+}
+
+//--------------------------------------------------------------------
+static inline void MemoryRawFree( void *ptr )
+{
+#if MEMORY_SIZE_CLASS_NEW
+   SizeClassFree( ptr );
+#else
+   ::free( ptr );
+#endif
+}
+
+//--------------------------------------------------------------------
+// Jittered so a pattern that allocates every N doesn't line up with the sampling -
+// averages out to one in gSampleRate
+static bool ShouldSample()
+{
+   uint const rate = gSampleRate;
+   if (0 == rate) {
+      return false;
+   }
+
+   if (tSampleCountdown > 0) {
+      --tSampleCountdown;
+      return false;
+   }
+
+   if (rate > 1) {
+      uint x = tSampleRandom;
+      x ^= x << 13;
+      x ^= x >> 17;
+      x ^= x << 5;
+      tSampleRandom = x;
+      tSampleCountdown = x % (2 * rate - 1);
+   }
+   return true;
+}
+
+//--------------------------------------------------------------------
+// Just spins - nothing holds these for long, and a CriticalSection would need
+// constructing before the first new
+static void SpinLock( uint *lock )
+{
+   while (0 != CompareAndSet( lock, 0, 1 )) {
+      ::YieldProcessor();
+   }
+}
+
+//--------------------------------------------------------------------
+static void SpinUnlock( uint *lock )
+{
+   CompareAndSet( lock, 1, 0 );
+}
+
+//--------------------------------------------------------------------
+// Finds [or adds] this callstack in the table - 0 if it's full
+static uint InternCallsite( void* const *frames, uint frame_count, uint32_t hash )
+{
+   if (0 == frame_count) {
+      return 0;
+   }
+
+   uint const slot_count = MEMORY_TRACKING_MAX_CALLSITES - 1;
+   uint slot = hash % slot_count;
+
+   SpinLock( &gCallsiteLock );
+   for (uint probe = 0; probe < slot_count; ++probe) {
+      uint const idx = 1 + slot;
+      memory_callsite_t *site = &gCallsites[idx];
+      if (0 == site->frame_count) {
+         // only add while there's a bit of room left, so probes stay short
+         if (gCallsiteCount >= (slot_count * 3) / 4) {
+            break;
+         }
+
+         // frame_count last - PrintLiveAllocations doesn't take the lock
+         site->hash = hash;
+         memcpy( site->frames, frames, sizeof(void*) * frame_count );
+         site->frame_count = frame_count;
+         ++gCallsiteCount;
+         SpinUnlock( &gCallsiteLock );
+         return idx;
+      }
+
+      if ((site->hash == hash) 
+         && (site->frame_count == frame_count)
+         && (0 == memcmp( site->frames, frames, sizeof(void*) * frame_count ))) {
+         SpinUnlock( &gCallsiteLock );
+         return idx;
+      }
+
+      slot = (slot + 1) % slot_count;
+   }
+   SpinUnlock( &gCallsiteLock );
+
+   AtomicIncrement( &gDroppedCallstacks );
+   return 0;
+}
+
+//--------------------------------------------------------------------
+static void CountAlloc( uint tag, size_t size )
+{
+   memory_thread_stats_t *stats = &tThreadStats;
+   if (stats->exited) {
+      AtomicIncrement( &gTagStats[tag].alloc_count );
+      AtomicAdd64( &gTagStats[tag].live_bytes, size );
+   } else {
+      ++stats->alloc_count[tag];
+      stats->live_bytes[tag] += size;
+   }
+}
+
+//--------------------------------------------------------------------
+static void CountFree( uint tag, size_t size )
+{
+   memory_thread_stats_t *stats = &tThreadStats;
+   if (stats->exited) {
+      AtomicIncrement( &gTagStats[tag].free_count );
+      AtomicAdd64( &gTagStats[tag].live_bytes, (uint64_t)0 - size );
+   } else {
+      ++stats->free_count[tag];
+      stats->live_bytes[tag] -= size;
+   }
+}
+
+//--------------------------------------------------------------------
+// Adds up every thread's - other threads keep counting while this reads, so it's
+// only exact when they're quiet
+static memory_tag_stats_t GetTagStats( uint tag )
+{
+   memory_tag_stats_t total = gTagStats[tag];
+
+   SpinLock( &gThreadStatsLock );
+   for (memory_thread_stats_t *stats = gThreadStats; nullptr != stats; stats = stats->next) {
+      total.alloc_count += stats->alloc_count[tag];
+      total.free_count += stats->free_count[tag];
+      total.live_bytes += stats->live_bytes[tag];
+   }
+   SpinUnlock( &gThreadStatsLock );
+
+   return total;
+}
+
+//--------------------------------------------------------------------
+static uint GetTotalAllocs()
+{
+   uint count = 0;
+   for (uint i = 0; i < MEMORY_TAG_COUNT; ++i) {
+      count += GetTagStats( i ).alloc_count;
+   }
+   return count;
+}
+
+//--------------------------------------------------------------------
+static uint GetTotalFrees()
+{
+   uint count = 0;
+   for (uint i = 0; i < MEMORY_TAG_COUNT; ++i) {
+      count += GetTagStats( i ).free_count;
+   }
+   return count;
+}
+
+//--------------------------------------------------------------------
+// A burst of particles spawned, then all despawned at the end of the frame
+typedef void* (*churn_alloc_cb)( size_t size );
+typedef void (*churn_free_cb)( void *ptr );
+
+static double TimeParticleChurn( churn_alloc_cb alloc_cb, churn_free_cb free_cb )
+{
+   void **live = (void**) ::malloc( CHURN_PARTICLE_COUNT * sizeof(void*) );
+
+   uint64_t const start_op = TimeGetOpCount();
+   for (uint frame = 0; frame < CHURN_FRAME_COUNT; ++frame) {
+      for (uint i = 0; i < CHURN_PARTICLE_COUNT; ++i) {
+         live[i] = alloc_cb( CHURN_PARTICLE_SIZE );
+         *(uint*)live[i] = i;
+      }
+
+      for (uint i = 0; i < CHURN_PARTICLE_COUNT; ++i) {
+         free_cb( live[i] );
+      }
+   }
+   double const ms = TimeOpCountTo_ms( TimeGetOpCount() - start_op );
+
+   ::free( live );
+   return ms;
+}
+
+//--------------------------------------------------------------------
+// Two distinct call sites for the grouping test
+static __declspec(noinline) void* AllocFromSiteA( size_t size ) { return TrackedAlloc( size ); }
+static __declspec(noinline) void* AllocFromSiteB( size_t size ) { return TrackedAlloc( size ); }
 
 /************************************************************************/
 /*                                                                      */
 /* EXTERNAL FUNCTIONS                                                   */
 /*                                                                      */
 /************************************************************************/
-static uint gAllocCount = 0;
-static uint gFrameAllocs = 0;
-static uint gFrameFrees = 0;
-static size_t gAllocatedByteCount = 0;
+//--------------------------------------------------------------------
+// noinline so the callstack skip is always the same
+__declspec(noinline) void* TrackedAlloc( size_t const size )
+{
+   allocation_t *header = (allocation_t*) MemoryRawAlloc( sizeof(allocation_t) + size );
+   if (nullptr == header) {
+      return nullptr;
+   }
 
-struct allocation_t 
+   uint const tag = tMemoryTag;
+   header->byte_size = size;
+   header->tag = tag;
+   header->callsite = 0;
+
+   CountAlloc( tag, size );
+
+   if (ShouldSample()) {
+      void *frames[MEMORY_TRACKING_MAX_FRAMES];
+      uint32_t hash;
+      uint const frame_count = CallstackCapture( frames, MEMORY_TRACKING_MAX_FRAMES, 1, &hash );
+      uint const idx = InternCallsite( frames, frame_count, hash );
+      if (0 != idx) {
+         memory_callsite_t *site = &gCallsites[idx];
+         AtomicIncrement( &site->live_count );
+         AtomicIncrement( &site->total_count );
+         AtomicAdd64( &site->live_bytes, size );
+         header->callsite = idx;
+      }
+   }
+
+   return header + 1;
+}
+
+//--------------------------------------------------------------------
+void TrackedFree( void *ptr )
 {
-   size_t byte_size;
-};
+   if (nullptr == ptr) {
+      return;
+   }
 
-/*
-void* operator new( size_t const size ) 
+   allocation_t *header = (allocation_t*)ptr - 1;
+   CountFree( header->tag, header->byte_size );
+
+   if (0 != header->callsite) {
+      memory_callsite_t *site = &gCallsites[header->callsite];
+      AtomicDecrement( &site->live_count );
+      AtomicAdd64( &site->live_bytes, (uint64_t)0 - header->byte_size );
+   }
+
+   MemoryRawFree( header );
+}
+
+//--------------------------------------------------------------------
+size_t TrackedGetSize( void const *ptr )
+{
+   return ((allocation_t const*)ptr - 1)->byte_size;
+}
+
+//--------------------------------------------------------------------
+// Made on this thread's first tracked allocation
+memory_thread_stats_t::memory_thread_stats_t()
+{
+   memset( alloc_count, 0, sizeof(alloc_count) );
+   memset( free_count, 0, sizeof(free_count) );
+   memset( live_bytes, 0, sizeof(live_bytes) );
+   exited = false;
+
+   SpinLock( &gThreadStatsLock );
+   next = gThreadStats;
+   gThreadStats = this;
+   SpinUnlock( &gThreadStatsLock );
+}
+
+//--------------------------------------------------------------------
+memory_thread_stats_t::~memory_thread_stats_t()
 {
-   ++gAllocCount;
-   ++gFrameAllocs;
-   gAllocatedByteCount += size;
+   SpinLock( &gThreadStatsLock );
+   memory_thread_stats_t **link = &gThreadStats;
+   while (*link != this) {
+      link = &(*link)->next;
+   }
+   *link = next;
 
-   size_t alloc_size = size + sizeof(allocation_t);
-   allocation_t *ptr = (allocation_t*) malloc(alloc_size);
-   ptr->byte_size = size;
-   return ptr + 1;
+   // fold in under the lock, so nobody adding up sees it twice [or not at all]
+   for (uint i = 0; i < MEMORY_TAG_COUNT; ++i) {
+      AtomicAdd( &gTagStats[i].alloc_count, alloc_count[i] );
+      AtomicAdd( &gTagStats[i].free_count, free_count[i] );
+      AtomicAdd64( &gTagStats[i].live_bytes, live_bytes[i] );
+   }
+   SpinUnlock( &gThreadStatsLock );
+
+   // other thread_local destructors can still new and delete - they go straight to gTagStats
+   exited = true;
 }
 
-void operator delete( void *ptr ) 
+//--------------------------------------------------------------------
+uint MemorySetTag( uint tag )
 {
-   --gAllocCount;
-   ++gFrameFrees;
+   if (tag >= MEMORY_TAG_COUNT) {
+      __debugbreak();
+   }
 
-   allocation_t *size_ptr = (allocation_t*) ptr;
-   size_ptr--;
+   uint const prev_tag = tMemoryTag;
+   tMemoryTag = tag;
+   return prev_tag;
+}
+
+//--------------------------------------------------------------------
+void MemorySetTagName( uint tag, char const *name )
+{
+   gTagStats[tag].name = name;
+}
+
+//--------------------------------------------------------------------
+// Threads pick it up after their current countdown runs out
+void MemorySetSampleRate( uint rate )
+{
+   gSampleRate = rate;
+   tSampleCountdown = 0;
+}
+
+//--------------------------------------------------------------------
+MemoryTagScope::MemoryTagScope( uint tag )
+{
+   prev_tag = MemorySetTag( tag );
+}
+
+//--------------------------------------------------------------------
+MemoryTagScope::~MemoryTagScope()
+{
+   MemorySetTag( prev_tag );
+}
+
+#if MEMORY_TRACKING
+//--------------------------------------------------------------------
+// new[], sized delete and the nothrow forms all land in these two
+void* operator new( size_t const size ) 
+{
+   void *ptr = TrackedAlloc( size );
+   if (nullptr == ptr) {
+      throw std::bad_alloc();
+   }
+   return ptr;
+}
+
+//--------------------------------------------------------------------
+void operator delete( void *ptr ) noexcept
+{
+   TrackedFree( ptr );
+}
+
+#elif MEMORY_SIZE_CLASS_NEW
+//--------------------------------------------------------------------
+// new[], sized delete and the nothrow forms all land in these two
+void* operator new( size_t const size ) 
+{
+   void *ptr = SizeClassAlloc( size );
+   if (nullptr == ptr) {
+      throw std::bad_alloc();
+   }
+   return ptr;
+}
 
-   gAllocatedByteCount -= size_ptr->byte_size;
-   free( size_ptr );
+//--------------------------------------------------------------------
+void operator delete( void *ptr ) noexcept
+{
+   SizeClassFree( ptr );
 }
-*/
+#endif
 
 class Foo
 {
@@ -117,10 +527,15 @@ struct uint3
    uint z;
 };
 
+// Last frame's counts, for whoever wants to show them
 void ProfileMemoryFrameTick()
 {
-   gFrameAllocs = 0;
-   gFrameFrees = 0;
+   uint const alloc_count = GetTotalAllocs();
+   uint const free_count = GetTotalFrees();
+   gFrameAllocs = alloc_count - gLastAllocCount;
+   gFrameFrees = free_count - gLastFreeCount;
+   gLastAllocCount = alloc_count;
+   gLastFreeCount = free_count;
 }
 
 #include <map>
@@ -142,21 +557,82 @@ void MemTest()
    delete [] array;
    delete f3;
 }
+
+//--------------------------------------------------------------------
 uint GetAllocCount()
 {
-   return gAllocCount;
+   return GetTotalAllocs() - GetTotalFrees();
+}
+
+//--------------------------------------------------------------------
+uint64_t GetAllocatedByteCount()
+{
+   uint64_t bytes = 0;
+   for (uint i = 0; i < MEMORY_TAG_COUNT; ++i) {
+      bytes += GetTagStats( i ).live_bytes;
+   }
+   return bytes;
 }
 
-/*
-void PrintLiveAllocations()
+//--------------------------------------------------------------------
+// Only sampled allocations have a callstack, so per callstack numbers are what was
+// sampled - with a rate of N, multiply by about N for the real thing.
+void PrintLiveAllocations( uint max_callsites )
 {
-   for each (allocation) {
-      printf( "Allocation at 0x%08x took %u B\n", 
-         allocation->ptr, 
-         allocation->size ); 
+   printf( "Live allocations: %u [%llu B], last frame %u allocs / %u frees\n", 
+      GetAllocCount(), (unsigned long long)GetAllocatedByteCount(), gFrameAllocs, gFrameFrees );
+
+   for (uint i = 0; i < MEMORY_TAG_COUNT; ++i) {
+      memory_tag_stats_t const stats = GetTagStats( i );
+      if (stats.alloc_count == stats.free_count) {
+         continue;
+      }
+
+      char const *name = (nullptr == stats.name) ? "" : stats.name;
+      printf( "  tag %2u %-16s %8u allocs %12llu B\n", 
+         i, name, stats.alloc_count - stats.free_count, (unsigned long long)stats.live_bytes );
+   }
+
+   // snapshot what's live - the table itself keeps changing under us
+   static uint order[MEMORY_TRACKING_MAX_CALLSITES];
+   uint order_count = 0;
+   for (uint i = 1; i < MEMORY_TRACKING_MAX_CALLSITES; ++i) {
+      if ((0 != gCallsites[i].frame_count) && (0 != gCallsites[i].live_count)) {
+         order[order_count++] = i;
+      }
+   }
+
+   std::sort( order, order + order_count, []( uint a, uint b ) {
+      return gCallsites[a].live_bytes > gCallsites[b].live_bytes;
+   });
+
+   printf( "  %u callsites live [sampling 1 in %u, %u callstacks dropped]\n", 
+      order_count, gSampleRate, gDroppedCallstacks );
+
+   bool const symbols = CallstackSystemInit();
+   uint const print_count = (order_count < max_callsites) ? order_count : max_callsites;
+   for (uint i = 0; i < print_count; ++i) {
+      memory_callsite_t const &site = gCallsites[order[i]];
+      printf( "\n  %llu B in %u allocations [%u sampled ever]\n", 
+         (unsigned long long)site.live_bytes, site.live_count, site.total_count );
+
+      if (symbols) {
+         callstack_line_t lines[MEMORY_TRACKING_MAX_FRAMES];
+         uint const line_count = CallstackGetLines( lines, MEMORY_TRACKING_MAX_FRAMES, site.frames, site.frame_count );
+         for (uint l = 0; l < line_count; ++l) {
+            printf( "    %s(%u): %s\n", lines[l].filename, lines[l].line, lines[l].function_name );
+         }
+      } else {
+         for (uint f = 0; f < site.frame_count; ++f) {
+            printf( "    %p\n", site.frames[f] );
+         }
+      }
+   }
+
+   if (symbols) {
+      CallstackSystemDeinit();
    }
 }
-*/
 
 /************************************************************************/
 /*                                                                      */
@@ -169,5 +645,87 @@ void PrintLiveAllocations()
 /* UNIT TESTS                                                           */
 /*                                                                      */
 /************************************************************************/
+//--------------------------------------------------------------------
+void MemoryTrackingTest()
+{
+   uint const TEST_TAG = MEMORY_TAG_COUNT - 1;
+   MemorySetTagName( TEST_TAG, "test" );
+
+   // every allocation sampled - two call sites, grouped apart and sorted by bytes
+   {
+      MemorySetSampleRate( 1 );
+      MEMORY_TAG_SCOPE( TEST_TAG );
+
+      uint const A_COUNT = 100;
+      uint const B_COUNT = 10;
+      void *ptrs[A_COUNT + B_COUNT];
+      for (uint i = 0; i < A_COUNT; ++i) {
+         ptrs[i] = AllocFromSiteA( 16 );
+      }
+      for (uint i = 0; i < B_COUNT; ++i) {
+         ptrs[A_COUNT + i] = AllocFromSiteB( 1024 );
+      }
+
+      memory_tag_stats_t stats = GetTagStats( TEST_TAG );
+      uint const site_a = ((allocation_t*)ptrs[0] - 1)->callsite;
+      uint const site_b = ((allocation_t*)ptrs[A_COUNT] - 1)->callsite;
+      if ((stats.alloc_count - stats.free_count != A_COUNT + B_COUNT)
+         || (stats.live_bytes != (A_COUNT * 16) + (B_COUNT * 1024))
+         || (0 == site_a) || (0 == site_b) || (site_a == site_b)
+         || (((allocation_t*)ptrs[A_COUNT - 1] - 1)->callsite != site_a)
+         || (gCallsites[site_a].live_count != A_COUNT) || (gCallsites[site_a].live_bytes != A_COUNT * 16)
+         || (gCallsites[site_b].live_count != B_COUNT) || (gCallsites[site_b].live_bytes != B_COUNT * 1024)
+         || (TrackedGetSize( ptrs[A_COUNT] ) != 1024)) {
+         __debugbreak();
+      }
+
+      PrintLiveAllocations( 2 );
+
+      for (uint i = 0; i < A_COUNT + B_COUNT; ++i) {
+         TrackedFree( ptrs[i] );
+      }
+
+      stats = GetTagStats( TEST_TAG );
+      if ((stats.alloc_count != stats.free_count) || (0 != stats.live_bytes)
+         || (0 != gCallsites[site_a].live_count) || (0 != gCallsites[site_b].live_bytes)) {
+         __debugbreak();
+      }
+   }
+
+   // sampled - some, but nowhere near all of them get a callstack
+   {
+      MemorySetSampleRate( 64 );
+      uint const COUNT = 64 * 100;
+      void **ptrs = (void**) ::malloc( COUNT * sizeof(void*) );
+      uint sampled = 0;
+      for (uint i = 0; i < COUNT; ++i) {
+         ptrs[i] = TrackedAlloc( 8 );
+         sampled += (0 != ((allocation_t*)ptrs[i] - 1)->callsite) ? 1 : 0;
+      }
+      for (uint i = 0; i < COUNT; ++i) {
+         TrackedFree( ptrs[i] );
+      }
+      ::free( ptrs );
+
+      if ((sampled < 50) || (sampled > 200)) {
+         __debugbreak();
+      }
+   }
+
+   // what it costs - the churn through raw new, and tracked at a few rates
+   printf( "MemoryTrackingTest [%u frames of %u particles]...\n", CHURN_FRAME_COUNT, CHURN_PARTICLE_COUNT );
+   uint const rates[] = { 0, MEMORY_TRACKING_SAMPLE_RATE, 1 };
+   for (uint pass = 0; pass < 2; ++pass) {
+      double const raw_ms = TimeParticleChurn( MemoryRawAlloc, MemoryRawFree );
+      printf( "  untracked        %8.3f ms\n", raw_ms );
+      for (uint r = 0; r < sizeof(rates) / sizeof(rates[0]); ++r) {
+         MemorySetSampleRate( rates[r] );
+         double const tracked_ms = TimeParticleChurn( TrackedAlloc, TrackedFree );
+         printf( "  tracked 1 in %-3u %8.3f ms [%+.1f%%]\n", rates[r], tracked_ms, 100.0 * (tracked_ms - raw_ms) / raw_ms );
+      }
+   }
+
+   MemorySetSampleRate( MEMORY_TRACKING_SAMPLE_RATE );
+}
 
 
@@ -12,12 +12,41 @@
 /* DEFINES AND CONSTANTS                                                */
 /*                                                                      */
 /************************************************************************/
+// Global operator new/delete go through the size class allocator [sizeclassallocator.h]
+#if !defined(MEMORY_SIZE_CLASS_NEW)
+   #define MEMORY_SIZE_CLASS_NEW (0)
+#endif
+
+// Global operator new/delete go through TrackedAlloc/TrackedFree - a 16B header on every
+// allocation with its size and tag, and a callstack for a sample of them.  Cheap enough
+// to leave on in staging builds.
+#if !defined(MEMORY_TRACKING)
+   #if defined(_DEBUG)
+      #define MEMORY_TRACKING (1)
+   #else
+      #define MEMORY_TRACKING (0)
+   #endif
+#endif
+
+// Roughly one in this many allocations per thread gets its callstack captured [1 is every
+// one, 0 is none].  MemorySetSampleRate changes it while running.
+#if !defined(MEMORY_TRACKING_SAMPLE_RATE)
+   #define MEMORY_TRACKING_SAMPLE_RATE (256)
+#endif
+
+// callstacks are interned - allocations from the same place share one of these
+#define MEMORY_TRACKING_MAX_CALLSITES  (4096)
+#define MEMORY_TRACKING_MAX_FRAMES     (16)
+
+#define MEMORY_TAG_COUNT               (32)
+#define MEMORY_TAG_DEFAULT             (0)
 
 /************************************************************************/
 /*                                                                      */
 /* MACROS                                                               */
 /*                                                                      */
 /************************************************************************/
+#define MEMORY_TAG_SCOPE( tag ) MemoryTagScope COMBINE(__memory_tag_scope_,__LINE__)( tag )
 
 /************************************************************************/
 /*                                                                      */
@@ -36,6 +65,16 @@
 /* CLASSES                                                              */
 /*                                                                      */
 /************************************************************************/
+// Everything this thread allocates while it's around is tagged with tag
+class MemoryTagScope
+{
+   public:
+      MemoryTagScope( uint tag );
+      ~MemoryTagScope();
+
+   public:
+      uint prev_tag;
+};
 
 /************************************************************************/
 /*                                                                      */
@@ -48,13 +87,27 @@
 /* FUNCTION PROTOTYPES                                                  */
 /*                                                                      */
 /************************************************************************/
-// void* TrackedAlloc( size_t const size );
-// void TrackedFree( 
+// Work whether or not MEMORY_TRACKING routes new/delete through them
+void* TrackedAlloc( size_t const size );
+void TrackedFree( void *ptr );
+size_t TrackedGetSize( void const *ptr );
+
+// This thread's tag for new allocations - returns the one it replaces
+uint MemorySetTag( uint tag );
+void MemorySetTagName( uint tag, char const *name );
+void MemorySetSampleRate( uint rate );
 
 void ProfileMemoryFrameTick();
 
 void MemTest();
 
 uint GetAllocCount();
+uint64_t GetAllocatedByteCount();
+
+// Totals per tag, then live sampled allocations grouped by callstack, most bytes first
+void PrintLiveAllocations( uint max_callsites = 16 );
+
+// Grouping and tag checks, then tracked vs. untracked on a particle spawn/despawn churn
+void MemoryTrackingTest();
 
 
@@ -0,0 +1,118 @@
+/************************************************************************/
+/*                                                                      */
+/* INCLUDE                                                              */
+/*                                                                      */
+/************************************************************************/
+#include "mpmc_queue.h"
+
+#include "ts_queue.h"
+#include "time.h"
+
+#include <vector>
+
+/************************************************************************/
+/*                                                                      */
+/* LOCAL VARIABLES                                                      */
+/*                                                                      */
+/************************************************************************/
+static bool volatile gQueueTestGo = false;
+static uint64_t gQueueTestSum = 0;
+
+
+//--------------------------------------------------------------------
+// Some test code
+//--------------------------------------------------------------------
+
+//--------------------------------------------------------------------
+template <typename QUEUE>
+static void QueueProducerThread( QUEUE *queue, uint first, uint count )
+{
+   while (!gQueueTestGo) {
+      ThreadYield();
+   }
+
+   for (uint i = 0; i < count; ++i) {
+      queue->enqueue( first + i );
+   }
+}
+
+//--------------------------------------------------------------------
+// 0 means stop
+template <typename QUEUE>
+static void QueueConsumerThread( QUEUE *queue )
+{
+   while (!gQueueTestGo) {
+      ThreadYield();
+   }
+
+   uint64_t sum = 0;
+   uint value;
+   while (true) {
+      if (!queue->dequeue( &value )) {
+         ThreadYield();
+         continue;
+      }
+
+      if (0 == value) {
+         break;
+      }
+      sum += value;
+   }
+
+   AtomicAdd64( &gQueueTestSum, sum );
+}
+
+//--------------------------------------------------------------------
+template <typename QUEUE>
+static uint64_t RunQueueContention( QUEUE *queue, uint thread_count, uint total )
+{
+   uint per_producer = total / thread_count;
+
+   gQueueTestGo = false;
+   gQueueTestSum = 0;
+
+   std::vector<thread_handle_t> producers;
+   std::vector<thread_handle_t> consumers;
+   for (uint i = 0; i < thread_count; ++i) {
+      producers.push_back( ThreadCreate( QueueProducerThread<QUEUE>, queue, 1 + (i * per_producer), per_producer ) );
+      consumers.push_back( ThreadCreate( QueueConsumerThread<QUEUE>, queue ) );
+   }
+
+   uint64_t start_op = TimeGetOpCount();
+   gQueueTestGo = true;
+
+   ThreadJoin( producers.data(), thread_count );
+   for (uint i = 0; i < thread_count; ++i) {
+      queue->enqueue( 0 );
+   }
+   ThreadJoin( consumers.data(), thread_count );
+
+   uint64_t op = TimeGetOpCount() - start_op;
+
+   // everything made it through exactly once
+   uint64_t count = (uint64_t)per_producer * thread_count;
+   if (gQueueTestSum != (count * (count + 1)) / 2) {
+      __debugbreak();
+   }
+
+   return op;
+}
+
+//--------------------------------------------------------------------
+void MPMCQueueTest()
+{
+   uint const TOTAL = 1 << 20;
+
+   for (uint thread_count = 1; thread_count <= 64; thread_count *= 2) {
+      ThreadSafeQueue<uint> locked;
+      MPMCQueue<uint> lockless;
+
+      uint64_t locked_op = RunQueueContention( &locked, thread_count, TOTAL );
+      uint64_t lockless_op = RunQueueContention( &lockless, thread_count, TOTAL );
+
+      printf( "MPMCQueueTest [%2u producers, %2u consumers]: ThreadSafeQueue %.2f ms, MPMCQueue %.2f ms\n",
+         thread_count, thread_count,
+         TimeOpCountTo_ms( locked_op ),
+         TimeOpCountTo_ms( lockless_op ) );
+   }
+}
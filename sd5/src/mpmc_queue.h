@@ -0,0 +1,238 @@
+#pragma once
+#if !defined( __MPMC_QUEUE__ )
+#define __MPMC_QUEUE__
+
+// Bounded, lock-free, multi-producer multi-consumer queue.  Same enqueue/dequeue
+// as ThreadSafeQueue, but it is a fixed ring of cells so nothing is allocated
+// after construction, and nobody ever waits on a lock.
+//
+// Each cell has a sequence number that says whose turn it is - a producer at
+// position p can fill it once it reads p, a consumer can take it once it reads
+// p + 1.  Claiming a position is a single compare and set on the head or tail,
+// which each get their own cache line.
+//
+// peek() copies the oldest value and its position without taking it.  Somebody else
+// can take it the moment you've looked, so anything read through the copy only counts
+// if is_front( pos ) is still true afterwards - otherwise look again.
+
+/************************************************************************/
+/*                                                                      */
+/* INCLUDE                                                              */
+/*                                                                      */
+/************************************************************************/
+#include "common.h"
+#include "atomic.h"
+#include "thread.h"
+
+#include <utility>
+
+/************************************************************************/
+/*                                                                      */
+/* DEFINES AND CONSTANTS                                                */
+/*                                                                      */
+/************************************************************************/
+#define MPMC_QUEUE_DEFAULT_CAPACITY (1024)
+
+/************************************************************************/
+/*                                                                      */
+/* CLASSES                                                              */
+/*                                                                      */
+/************************************************************************/
+
+//------------------------------------------------------------------------
+template <typename T>
+class MPMCQueue
+{
+   public:
+      struct cell_t
+      {
+         uint volatile sequence;
+         T value;
+      };
+
+   public:
+      //------------------------------------------------------------------------
+      // capacity is rounded up to a power of two
+      MPMCQueue( uint capacity = MPMC_QUEUE_DEFAULT_CAPACITY )
+      {
+         uint size = 2;
+         while (size < capacity) {
+            size <<= 1;
+         }
+
+         cells = new cell_t[size];
+         mask = size - 1;
+         for (uint i = 0; i < size; ++i) {
+            cells[i].sequence = i;
+         }
+
+         enqueue_pos = 0;
+         dequeue_pos = 0;
+      }
+
+      //------------------------------------------------------------------------
+      ~MPMCQueue()
+      {
+         delete[] cells;
+      }
+
+      //------------------------------------------------------------------------
+      // false if it is full
+      bool try_enqueue( T const &v )
+      {
+         cell_t *cell;
+         uint pos = enqueue_pos;
+         while (true) {
+            cell = &cells[pos & mask];
+            int diff = (int)(cell->sequence - pos);
+            if (0 == diff) {
+               uint prev = CompareAndSet( &enqueue_pos, pos, pos + 1 );
+               if (prev == pos) {
+                  break;
+               }
+               pos = prev;
+            } else if (diff < 0) {
+               // still holds what was put here a lap ago
+               return false;
+            } else {
+               // someone else got here first
+               pos = enqueue_pos;
+            }
+         }
+
+         cell->value = v;
+
+         // volatile writes are releases with MSVC on x86/x64, so the value is visible before this is
+         cell->sequence = pos + 1;
+         return true;
+      }
+
+      //------------------------------------------------------------------------
+      // All or nothing - claims count cells with a single compare and set.
+      bool try_enqueue_batch( T const *v, uint count )
+      {
+         uint pos = enqueue_pos;
+         while (true) {
+            // every cell we'd take has to be free for this lap [consumers can free them out of order]
+            int diff = 0;
+            for (uint i = 0; (i < count) && (0 == diff); ++i) {
+               diff = (int)(cells[(pos + i) & mask].sequence - (pos + i));
+            }
+
+            if (0 == diff) {
+               uint prev = CompareAndSet( &enqueue_pos, pos, pos + count );
+               if (prev == pos) {
+                  break;
+               }
+               pos = prev;
+            } else if (diff < 0) {
+               return false;
+            } else {
+               pos = enqueue_pos;
+            }
+         }
+
+         for (uint i = 0; i < count; ++i) {
+            cell_t *cell = &cells[(pos + i) & mask];
+            cell->value = v[i];
+            cell->sequence = pos + i + 1;
+         }
+         return true;
+      }
+
+      //------------------------------------------------------------------------
+      // Waits for room if it's full
+      void enqueue( T const &v )
+      {
+         while (!try_enqueue( v )) {
+            ThreadYield();
+         }
+      }
+
+      //------------------------------------------------------------------------
+      bool dequeue( T *out )
+      {
+         cell_t *cell;
+         uint pos = dequeue_pos;
+         while (true) {
+            cell = &cells[pos & mask];
+            int diff = (int)(cell->sequence - (pos + 1));
+            if (0 == diff) {
+               uint prev = CompareAndSet( &dequeue_pos, pos, pos + 1 );
+               if (prev == pos) {
+                  break;
+               }
+               pos = prev;
+            } else if (diff < 0) {
+               // nothing written here yet
+               return false;
+            } else {
+               pos = dequeue_pos;
+            }
+         }
+
+         *out = std::move( cell->value );
+
+         // hand the cell to whoever writes it on the next lap
+         cell->sequence = pos + mask + 1;
+         return true;
+      }
+
+      //------------------------------------------------------------------------
+      // Copies the oldest value without taking it - false if there isn't one.  It can
+      // be taken the moment this returns, so anything read through it is only good if
+      // is_front( out_pos ) is still true afterwards.
+      bool peek( T *out, uint *out_pos ) const
+      {
+         uint const pos = dequeue_pos;
+         cell_t const *cell = &cells[pos & mask];
+         if ((int)(cell->sequence - (pos + 1)) != 0) {
+            return false;
+         }
+
+         *out = cell->value;
+         *out_pos = pos;
+         return (pos == dequeue_pos);
+      }
+
+      inline bool is_front( uint pos ) const    { return pos == dequeue_pos; }
+
+      //------------------------------------------------------------------------
+      // only a hint - can be out of date as soon as it returns
+      inline bool empty() const
+      {
+         return (int)(enqueue_pos - dequeue_pos) <= 0;
+      }
+
+      //------------------------------------------------------------------------
+      // same - a hint
+      inline uint size_approx() const
+      {
+         int size = (int)(enqueue_pos - dequeue_pos);
+         return (size > 0) ? (uint)size : 0;
+      }
+
+      inline uint get_capacity() const    { return mask + 1; }
+
+   public:
+      cell_t *cells;
+      uint mask;
+      byte_t pad0[CACHE_LINE_SIZE];
+
+      // producers and consumers each get their own line
+      uint volatile enqueue_pos;
+      byte_t pad1[CACHE_LINE_SIZE - sizeof(uint)];
+
+      uint volatile dequeue_pos;
+      byte_t pad2[CACHE_LINE_SIZE - sizeof(uint)];
+};
+
+/************************************************************************/
+/*                                                                      */
+/* FUNCTION PROTOTYPES                                                  */
+/*                                                                      */
+/************************************************************************/
+// ThreadSafeQueue against MPMCQueue, 1 to 64 producers and consumers
+void MPMCQueueTest();
+
+#endif
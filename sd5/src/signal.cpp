@@ -5,6 +5,12 @@
 /************************************************************************/
 #include "signal.h"
 
+#include "atomic.h"
+#include "time.h"
+
+// WaitOnAddress/WakeByAddressSingle
+#pragma comment(lib, "Synchronization.lib")
+
 /************************************************************************/
 /*                                                                      */
 /* DEFINES AND CONSTANTS                                                */
@@ -60,60 +66,172 @@
 /************************************************************************/
 //------------------------------------------------------------------------
 //
-Signal::Signal()
+Signal::Signal( uint max_count /*= SIGNAL_DEFAULT_MAX_COUNT*/, uint spin_count /*= 0*/ )
 {
-   os_event = ::CreateEvent( nullptr, // security attributes, not needed
-      TRUE,                           // Manual reset - do we manually reset, or auto reset after this is hit.
-      FALSE,                          // initial state of the signal
-      NULL );                         // name, used for cross-process communication
+   state = 0;
+   wake_count = 0;
+   this->max_count = (max_count > 0) ? max_count : 1;
+   this->spin_count = spin_count;
 }
 
 //------------------------------------------------------------------------
 Signal::~Signal()
 {
-   ::CloseHandle( os_event );
-   os_event = NULL;
    // nothing needed since we're destructing.
 }
 
 //------------------------------------------------------------------------
-void Signal::signal_all()
+void Signal::signal_one()
 {
-   ::SetEvent( os_event );
+   signal_n(1);
 }
 
 //------------------------------------------------------------------------
-void Signal::wait()
+void Signal::signal_n( uint n )
+{
+   if (0 == n) {
+      return;
+   }
+
+   // hand out what we can to waiters, keep the rest [up to max_count]
+   uint release;
+   uint old_state = state;
+   while (true) {
+      int cur = (int)old_state;
+      uint waiters = (cur < 0) ? (uint)(-cur) : 0;
+      release = (n < waiters) ? n : waiters;
+
+      int64_t next = (int64_t)cur + n;
+      next = (next < (int64_t)max_count) ? next : (int64_t)max_count;
+
+      uint prev = CompareAndSet( &state, old_state, (uint)(int)next );
+      if (prev == old_state) {
+         break;
+      }
+      old_state = prev;
+   }
+
+   if (0 == release) {
+      return;
+   }
+
+   // one wake per waiter we released - nobody else gets up
+   AtomicAdd( &wake_count, release );
+   for (uint i = 0; i < release; ++i) {
+      ::WakeByAddressSingle( (PVOID)&wake_count );
+   }
+}
+
+//------------------------------------------------------------------------
+void Signal::signal_all()
 {
-   DWORD result = ::WaitForSingleObject( os_event, INFINITE );
-   if (result == WAIT_OBJECT_0) {
-      // great, we succeeded!  [you can wait for multiple objects,
-      // hence the WAIT_OBJECT_0 - meaning our the first object was
-      // the one who caused us to activate.
+   uint release;
+   uint old_state = state;
+   while (true) {
+      int cur = (int)old_state;
+      uint next;
+      if (cur < 0) {
+         release = (uint)(-cur);
+         next = 0;
+      } else {
+         release = 0;
+         next = ((uint)cur < max_count) ? (uint)(cur + 1) : (uint)cur;
+      }
+
+      uint prev = CompareAndSet( &state, old_state, next );
+      if (prev == old_state) {
+         break;
+      }
+      old_state = prev;
+   }
+
+   if (release > 0) {
+      AtomicAdd( &wake_count, release );
+      ::WakeByAddressAll( (PVOID)&wake_count );
+   }
+}
 
-      // this means everyone who is waiting is going to reset, but oh well - they already
-      // got woken up. 
-      ::ResetEvent(os_event);
+//------------------------------------------------------------------------
+bool Signal::try_wait()
+{
+   uint old_state = state;
+   while ((int)old_state > 0) {
+      uint prev = CompareAndSet( &state, old_state, old_state - 1 );
+      if (prev == old_state) {
+         return true;
+      }
+      old_state = prev;
    }
+
+   return false;
 }
 
+//------------------------------------------------------------------------
+void Signal::wait()
+{
+   wait_for( INFINITE );
+}
 
 //------------------------------------------------------------------------
 bool Signal::wait_for( uint ms ) 
 {
-   DWORD result = ::WaitForSingleObject( os_event, ms );
-   if (result == WAIT_OBJECT_0) {
-      // great, we succeeded!  [you can wait for multiple objects,
-      // hence the WAIT_OBJECT_0 - meaning our the first object was
-      // the one who caused us to activate.
+   for (uint i = 0; i < spin_count; ++i) {
+      if (try_wait()) {
+         return true;
+      }
+      YieldProcessor();
+   }
 
-      // this means everyone who is waiting is going to reset, but oh well - they already
-      // got woken up. 
-      ::ResetEvent(os_event);
+   // take a kept signal, or sign up as a waiter [state goes negative]
+   uint old_state = AtomicAdd( &state, (uint)-1 ) + 1;
+   if ((int)old_state > 0) {
       return true;
    }
 
-   return false;
+   return park( ms );
+}
+
+//------------------------------------------------------------------------
+// We're counted as a waiter - sleep until a signaller hands us one of the wake_count.
+bool Signal::park( uint ms )
+{
+   uint64_t const end_op = (INFINITE == ms) ? 0 : (TimeGetOpCount() + TimeOpCountFrom_ms( (double)ms ));
+
+   while (true) {
+      uint wakes = wake_count;
+      if (wakes > 0) {
+         if (CompareAndSet( &wake_count, wakes, wakes - 1 ) == wakes) {
+            return true;
+         }
+         continue;
+      }
+
+      DWORD wait_ms = INFINITE;
+      if (0 != end_op) {
+         uint64_t now = TimeGetOpCount();
+         if (now >= end_op) {
+            // timed out - stop being a waiter.  If a signaller already counted us 
+            // a wake is on its way, and we have to take it so the counts stay right.
+            uint old_state = state;
+            while ((int)old_state < 0) {
+               uint prev = CompareAndSet( &state, old_state, old_state + 1 );
+               if (prev == old_state) {
+                  return false;
+               }
+               old_state = prev;
+            }
+
+            // we were released after all - wait for it [it is moments away]
+            return park( INFINITE );
+         }
+
+         // round up, so we don't wake up early and spin
+         wait_ms = (DWORD)TimeOpCountTo_ms( end_op - now ) + 1;
+      }
+
+      uint none = 0;
+      ::WaitOnAddress( &wake_count, &none, sizeof(none), wait_ms );
+   }
 }
 
 //------------------------------------------------------------------------
@@ -180,6 +298,96 @@ void SignalTest()
    ThreadSleep(100);
 }
 
+//------------------------------------------------------------------------
+// Ping-pong - the other thread wakes on ping and answers with pong, so each 
+// round trip is two wake ups.
+struct ping_pong_t
+{
+   Signal *ping;
+   Signal *pong;
+   HANDLE ping_event;
+   HANDLE pong_event;
+   uint rounds;
+};
+
+//------------------------------------------------------------------------
+static void PongSignalThread( void *data ) 
+{
+   ping_pong_t *test = (ping_pong_t*)data;
+   for (uint i = 0; i < test->rounds; ++i) {
+      test->ping->wait();
+      test->pong->signal_one();
+   }
+}
+
+//------------------------------------------------------------------------
+static void PongEventThread( void *data ) 
+{
+   ping_pong_t *test = (ping_pong_t*)data;
+   for (uint i = 0; i < test->rounds; ++i) {
+      ::WaitForSingleObject( test->ping_event, INFINITE );
+      ::SetEvent( test->pong_event );
+   }
+}
+
+//------------------------------------------------------------------------
+// average time from signal to the waiter running, in microseconds
+static double PingPongSignal( uint rounds, uint spin_count )
+{
+   Signal ping( 1, spin_count );
+   Signal pong( 1, spin_count );
+
+   ping_pong_t test;
+   test.ping = &ping;
+   test.pong = &pong;
+   test.rounds = rounds;
+
+   thread_handle_t handle = ThreadCreate( PongSignalThread, &test );
+
+   uint64_t start_op = TimeGetOpCount();
+   for (uint i = 0; i < rounds; ++i) {
+      ping.signal_one();
+      pong.wait();
+   }
+   uint64_t op = TimeGetOpCount() - start_op;
+
+   ThreadJoin( handle );
+   return TimeOpCountTo_ms( op ) * 1000.0 / (2.0 * rounds);
+}
+
+//------------------------------------------------------------------------
+static double PingPongEvent( uint rounds )
+{
+   ping_pong_t test;
+   test.ping_event = ::CreateEvent( nullptr, FALSE, FALSE, NULL );
+   test.pong_event = ::CreateEvent( nullptr, FALSE, FALSE, NULL );
+   test.rounds = rounds;
+
+   thread_handle_t handle = ThreadCreate( PongEventThread, &test );
+
+   uint64_t start_op = TimeGetOpCount();
+   for (uint i = 0; i < rounds; ++i) {
+      ::SetEvent( test.ping_event );
+      ::WaitForSingleObject( test.pong_event, INFINITE );
+   }
+   uint64_t op = TimeGetOpCount() - start_op;
+
+   ThreadJoin( handle );
+   ::CloseHandle( test.ping_event );
+   ::CloseHandle( test.pong_event );
+   return TimeOpCountTo_ms( op ) * 1000.0 / (2.0 * rounds);
+}
+
+//------------------------------------------------------------------------
+void SignalPingPongTest()
+{
+   uint const ROUNDS = 20000;
+
+   printf( "SignalPingPongTest [Win32 event]: %.2f us per wake\n", PingPongEvent( ROUNDS ) );
+   printf( "SignalPingPongTest [Signal, no spin]: %.2f us per wake\n", PingPongSignal( ROUNDS, 0 ) );
+   printf( "SignalPingPongTest [Signal, spin 4000]: %.2f us per wake\n", PingPongSignal( ROUNDS, 4000 ) );
+}
+
 /************************************************************************/
 /*                                                                      */
 /* COMMANDS                                                             */
@@ -1,6 +1,12 @@
 #pragma once
 
 // Standard Library Equivalent:  conditinal variables.
+//
+// Auto-reset - every signal lets exactly one waiter through, and a signal nobody 
+// is waiting for is kept [up to max_count of them] for the next one that waits, so 
+// a signal between checking for work and calling wait() is never lost.  Built on 
+// WaitOnAddress, which is Windows' futex - nothing goes to the kernel unless 
+// someone actually has to sleep or be woken.
 
 /************************************************************************/
 /*                                                                      */
@@ -10,7 +16,6 @@
 #include "common.h"
 #include "criticalsection.h"
 
-#include <condition_variable>
 
 
 /************************************************************************/
@@ -20,6 +25,9 @@
 /************************************************************************/
 // Infoknowledge Management System
 
+// Signals kept with no one waiting.  1 makes it an auto-reset event, more a semaphore.
+#define SIGNAL_DEFAULT_MAX_COUNT (1)
+
 /************************************************************************/
 /*                                                                      */
 /* MACROS                                                               */
@@ -47,10 +55,19 @@
 class Signal
 {
    public:
-      Signal();
+      // spin_count - times a waiter checks for a signal before going to sleep.  Worth
+      // it when signals come quickly [a few microseconds] and there are spare cores.
+      Signal( uint max_count = SIGNAL_DEFAULT_MAX_COUNT, uint spin_count = 0 );
       ~Signal();
 
-      // will signal all threads waiting on this object.
+      // Wakes one waiter, or is kept for the next wait if no one is waiting.
+      void signal_one();
+
+      // Wakes up to n waiters - the rest are kept [up to max_count]
+      void signal_n( uint n );
+
+      // will signal all threads waiting on this object.  If there are none 
+      // it is the same as signal_one.
       void signal_all();
 
       // Suspstends calling thread until object is signaled.
@@ -60,8 +77,21 @@ class Signal
       // passed.  Returns true if object was signaled, and fales if it timed out.
       bool wait_for( uint ms );
 
+      // takes a signal if one is waiting, never sleeps
+      bool try_wait();
+
+   private:
+      bool park( uint ms );
+
    public: 
-      HANDLE os_event;
+      // > 0, signals kept for the next waiters.  < 0, minus the number of waiters.
+      uint volatile state;
+
+      // waiters released but not yet woken - what they sleep on
+      uint volatile wake_count;
+
+      uint max_count;
+      uint spin_count;
 };
 
 
@@ -78,3 +108,6 @@ class Signal
 /************************************************************************/
 void SignalTest();
 
+// wake latency bouncing a signal between two threads, against a Win32 auto-reset event
+void SignalPingPongTest();
+
@@ -0,0 +1,357 @@
+/************************************************************************/
+/*                                                                      */
+/* INCLUDE                                                              */
+/*                                                                      */
+/************************************************************************/
+#include "sizeclassallocator.h"
+
+#include "atomic.h"
+#include "random.h"
+#include "thread.h"
+#include "time.h"
+
+#define WIN32_LEAN_AND_MEAN
+#include <Windows.h>
+#include <intrin.h>
+
+#include <new>
+#include <vector>
+
+/************************************************************************/
+/*                                                                      */
+/* DEFINES AND CONSTANTS                                                */
+/*                                                                      */
+/************************************************************************/
+// mixed size trace - live allocations at once, and how many threads replay it together
+#define TRACE_SLOT_COUNT      (4096)
+#define TRACE_THREAD_COUNT    (8)
+
+/************************************************************************/
+/*                                                                      */
+/* STRUCTS                                                              */
+/*                                                                      */
+/************************************************************************/
+// free whatever is in slot, then put a new allocation of size there
+struct trace_op_t
+{
+   uint slot;
+   uint size;
+};
+
+/************************************************************************/
+/*                                                                      */
+/* LOCAL VARIABLES                                                      */
+/*                                                                      */
+/************************************************************************/
+static size_t const gClassSizes[SIZE_CLASS_COUNT] = {
+   8, 16, 32, 48, 64, 80, 96, 112, 128,
+   160, 192, 224, 256,
+   320, 384, 448, 512,
+   640, 768, 896, 1024,
+   1280, 1536, 1792, 2048,
+   2560, 3072, 3584, 4096,
+   5120, 6144, 7168, 8192,
+   10240, 12288, 14336, 16384,
+   20480, 24576, 28672, 32768,
+};
+
+static std::vector<trace_op_t> gTrace;
+
+/************************************************************************/
+/*                                                                      */
+/* LOCAL FUNCTIONS                                                      */
+/*                                                                      */
+/************************************************************************/
+//--------------------------------------------------------------------
+// Mostly small, with a long tail - one in a thousand is past the biggest class
+// [and so a trip to the OS both ways]
+static uint GetTraceSize()
+{
+   uint const roll = Random( 0, 999 );
+   if (roll < 600) {
+      return Random( 8, 64 );
+   } else if (roll < 850) {
+      return Random( 65, 512 );
+   } else if (roll < 980) {
+      return Random( 513, 8192 );
+   } else if (roll < 999) {
+      return Random( 8193, SIZE_CLASS_MAX_SIZE );
+   } else {
+      return SIZE_CLASS_MAX_SIZE + (Random( 1, 224 ) * 1024);
+   }
+}
+
+//--------------------------------------------------------------------
+static void BuildTrace( uint count )
+{
+   srand( 1234 );
+   gTrace.resize( count );
+   for (uint i = 0; i < count; ++i) {
+      gTrace[i].slot = Random( 0, TRACE_SLOT_COUNT - 1 );
+      gTrace[i].size = GetTraceSize();
+   }
+}
+
+//--------------------------------------------------------------------
+// nullptr allocator replays it against malloc
+static void ReplayTrace( SizeClassAllocator *allocator )
+{
+   void **slots = (void**) ::calloc( TRACE_SLOT_COUNT, sizeof(void*) );
+
+   uint const count = (uint)gTrace.size();
+   for (uint i = 0; i < count; ++i) {
+      trace_op_t const &op = gTrace[i];
+      void *ptr;
+      if (nullptr == allocator) {
+         ::free( slots[op.slot] );
+         ptr = ::malloc( op.size );
+      } else {
+         allocator->free( slots[op.slot] );
+         ptr = allocator->alloc( op.size );
+      }
+
+      // touch it, like whoever asked would
+      *(uint*)ptr = i;
+      slots[op.slot] = ptr;
+   }
+
+   for (uint i = 0; i < TRACE_SLOT_COUNT; ++i) {
+      if (nullptr == allocator) {
+         ::free( slots[i] );
+      } else {
+         allocator->free( slots[i] );
+      }
+   }
+
+   ::free( slots );
+}
+
+//--------------------------------------------------------------------
+static double TimeReplay( SizeClassAllocator *allocator, uint thread_count )
+{
+   thread_handle_t threads[TRACE_THREAD_COUNT];
+
+   uint64_t const start_op = TimeGetOpCount();
+   if (1 == thread_count) {
+      ReplayTrace( allocator );
+   } else {
+      for (uint i = 0; i < thread_count; ++i) {
+         threads[i] = ThreadCreate( ReplayTrace, allocator );
+      }
+
+      for (uint i = 0; i < thread_count; ++i) {
+         ThreadJoin( threads[i] );
+      }
+   }
+
+   return TimeOpCountTo_ms( TimeGetOpCount() - start_op );
+}
+
+/************************************************************************/
+/*                                                                      */
+/* EXTERNAL FUNCTIONS                                                   */
+/*                                                                      */
+/************************************************************************/
+//--------------------------------------------------------------------
+SizeClassAllocator::SizeClassAllocator()
+{
+   // not through new - this may be what new is using
+   for (uint i = 0; i < SIZE_CLASS_COUNT; ++i) {
+      void *mem = ::malloc( sizeof(MagazineBlockAllocator) );
+      pools[i] = new (mem) MagazineBlockAllocator( gClassSizes[i] );
+      pools[i]->slabs.align_slabs( SIZE_CLASS_SLAB_SIZE, i );
+   }
+
+   large_count = 0;
+   large_bytes = 0;
+}
+
+//--------------------------------------------------------------------
+// Large allocations still out are left alone - they aren't tracked anywhere
+SizeClassAllocator::~SizeClassAllocator()
+{
+   for (uint i = 0; i < SIZE_CLASS_COUNT; ++i) {
+      pools[i]->~MagazineBlockAllocator();
+      ::free( pools[i] );
+      pools[i] = nullptr;
+   }
+}
+
+//--------------------------------------------------------------------
+uint SizeClassAllocator::GetClass( size_t size )
+{
+   if (size <= 8) {
+      return 0;
+   }
+
+   // every 16B up to 128
+   if (size <= 128) {
+      return (uint)((size + 15) >> 4);
+   }
+
+   // (2^p, 2^(p+1)] split into four
+   unsigned long p;
+   _BitScanReverse( &p, (unsigned long)(size - 1) );
+   uint const step = (uint)((size - 1 - ((size_t)1 << p)) >> (p - 2));
+   return 9 + ((p - 7) * 4) + step;
+}
+
+//--------------------------------------------------------------------
+size_t SizeClassAllocator::GetClassSize( uint class_idx )
+{
+   return gClassSizes[class_idx];
+}
+
+//--------------------------------------------------------------------
+void* SizeClassAllocator::alloc( size_t size )
+{
+   if (size > SIZE_CLASS_MAX_SIZE) {
+      return alloc_large( size );
+   }
+
+   return pools[GetClass(size)]->alloc( size );
+}
+
+//--------------------------------------------------------------------
+void SizeClassAllocator::free( void *ptr )
+{
+   if (nullptr == ptr) {
+      return;
+   }
+
+   block_slab_header_t *header = BlockSlabList::GetHeader( ptr, SIZE_CLASS_SLAB_SIZE );
+   if (SIZE_CLASS_LARGE_TAG == header->tag) {
+      AtomicDecrement( &large_count );
+      AtomicAdd64( &large_bytes, (uint64_t)0 - header->size );
+      BlockSlabRelease( header->base );
+   } else {
+      pools[header->tag]->free( ptr );
+   }
+}
+
+//--------------------------------------------------------------------
+size_t SizeClassAllocator::get_size( void const *ptr ) const
+{
+   block_slab_header_t const *header = BlockSlabList::GetHeader( ptr, SIZE_CLASS_SLAB_SIZE );
+   if (SIZE_CLASS_LARGE_TAG == header->tag) {
+      return header->size;
+   }
+
+   return gClassSizes[header->tag];
+}
+
+//--------------------------------------------------------------------
+// Its own aligned run from the OS, with a slab header in front so free can tell
+void* SizeClassAllocator::alloc_large( size_t size )
+{
+   void *base;
+   byte_t *mem = (byte_t*) BlockSlabReserve( BLOCK_SLAB_HEADER_SIZE + size, SIZE_CLASS_SLAB_SIZE, &base );
+   if (nullptr == mem) {
+      return nullptr;
+   }
+
+   block_slab_header_t *header = (block_slab_header_t*)mem;
+   header->next = nullptr;
+   header->base = base;
+   header->size = size;
+   header->tag = SIZE_CLASS_LARGE_TAG;
+
+   AtomicIncrement( &large_count );
+   AtomicAdd64( &large_bytes, size );
+   return mem + BLOCK_SLAB_HEADER_SIZE;
+}
+
+//--------------------------------------------------------------------
+SizeClassAllocator* SizeClassGetGlobal()
+{
+   static SizeClassAllocator *allocator = new (::malloc( sizeof(SizeClassAllocator) )) SizeClassAllocator();
+   return allocator;
+}
+
+//--------------------------------------------------------------------
+void* SizeClassAlloc( size_t size )
+{
+   return SizeClassGetGlobal()->alloc( size );
+}
+
+//--------------------------------------------------------------------
+void SizeClassFree( void *ptr )
+{
+   SizeClassGetGlobal()->free( ptr );
+}
+
+/************************************************************************/
+/*                                                                      */
+/* UNIT TESTS                                                           */
+/*                                                                      */
+/************************************************************************/
+//--------------------------------------------------------------------
+void SizeClassAllocatorTest()
+{
+   // every size goes to the smallest class that holds it
+   for (size_t size = 0; size <= SIZE_CLASS_MAX_SIZE; ++size) {
+      uint const class_idx = SizeClassAllocator::GetClass( size );
+      if ((class_idx >= SIZE_CLASS_COUNT)
+         || (SizeClassAllocator::GetClassSize( class_idx ) < size)
+         || ((class_idx > 0) && (SizeClassAllocator::GetClassSize( class_idx - 1 ) >= size))) {
+         __debugbreak();
+      }
+   }
+
+   {
+      SizeClassAllocator allocator;
+
+      size_t const sizes[] = { 0, 1, 8, 9, 17, 100, 128, 129, 1000, 4096, 30000, 32768, 32769, 100000, 4 * 1024 * 1024 };
+      uint const size_count = sizeof(sizes) / sizeof(sizes[0]);
+      void *ptrs[size_count];
+
+      for (uint i = 0; i < size_count; ++i) {
+         ptrs[i] = allocator.alloc( sizes[i] );
+         if ((nullptr == ptrs[i])
+            || (allocator.get_size( ptrs[i] ) < sizes[i])
+            || ((sizes[i] >= 16) && (0 != ((uintptr_t)ptrs[i] & 15)))) {
+            __debugbreak();
+         }
+         memset( ptrs[i], (int)i, sizes[i] );
+      }
+
+      if (3 != allocator.large_count) {
+         __debugbreak();
+      }
+
+      for (uint i = 0; i < size_count; ++i) {
+         byte_t const *bytes = (byte_t const*) ptrs[i];
+         for (size_t b = 0; b < sizes[i]; b += 61) {
+            if (bytes[b] != (byte_t)i) {
+               __debugbreak();
+            }
+         }
+         allocator.free( ptrs[i] );
+      }
+
+      if ((0 != allocator.large_count) || (0 != allocator.large_bytes)) {
+         __debugbreak();
+      }
+   }
+
+   // Mixed size trace, replayed the same way against both
+   uint const TRACE_COUNT = 1000000;
+   BuildTrace( TRACE_COUNT );
+
+   SizeClassAllocator *allocator = SizeClassGetGlobal();
+   printf( "SizeClassAllocatorTest [%u allocs, %u live]...\n", TRACE_COUNT, TRACE_SLOT_COUNT );
+   for (uint i = 0; i < 2; ++i) {
+      double const malloc_ms = TimeReplay( nullptr, 1 );
+      double const size_class_ms = TimeReplay( allocator, 1 );
+      printf( "  1 thread:   malloc %8.3f ms   size class %8.3f ms\n", malloc_ms, size_class_ms );
+   }
+
+   for (uint i = 0; i < 2; ++i) {
+      double const malloc_ms = TimeReplay( nullptr, TRACE_THREAD_COUNT );
+      double const size_class_ms = TimeReplay( allocator, TRACE_THREAD_COUNT );
+      printf( "  %u threads:  malloc %8.3f ms   size class %8.3f ms\n", TRACE_THREAD_COUNT, malloc_ms, size_class_ms );
+   }
+
+   gTrace.clear();
+   gTrace.shrink_to_fit();
+}
@@ -0,0 +1,86 @@
+#pragma once
+#if !defined( __SIZE_CLASS_ALLOCATOR__ )
+#define __SIZE_CLASS_ALLOCATOR__
+
+// General purpose allocations out of block pools.  A size is rounded up to one of
+// SIZE_CLASS_COUNT classes [8B up to 32KB - every 16B to 128B, then four steps per
+// power of two] and each class is its own MagazineBlockAllocator, so most allocs
+// and frees never leave the calling thread.  Anything bigger goes straight to the OS.
+//
+// There's no header on an allocation - every slab is SIZE_CLASS_SLAB_SIZE and
+// aligned to it, so free masks the pointer to find the slab and its class.
+//
+//    void *ptr = SizeClassAlloc( 200 );     // a 224B block
+//    SizeClassFree( ptr );
+//
+// memory.cpp can route operator new/delete through here [MEMORY_SIZE_CLASS_NEW].
+
+/************************************************************************/
+/*                                                                      */
+/* INCLUDE                                                              */
+/*                                                                      */
+/************************************************************************/
+#include "common.h"
+#include "blockallocator.h"
+
+/************************************************************************/
+/*                                                                      */
+/* DEFINES AND CONSTANTS                                                */
+/*                                                                      */
+/************************************************************************/
+#define SIZE_CLASS_COUNT      (41)
+#define SIZE_CLASS_MAX_SIZE   (32 * 1024)
+
+// every slab [and every large allocation] is aligned to this
+#define SIZE_CLASS_SLAB_SIZE  (256 * 1024)
+
+// slab tag for allocations too big for a class
+#define SIZE_CLASS_LARGE_TAG  (0xffffffff)
+
+/************************************************************************/
+/*                                                                      */
+/* CLASSES                                                              */
+/*                                                                      */
+/************************************************************************/
+class SizeClassAllocator : public IAllocator
+{
+   public:
+      SizeClassAllocator();
+      ~SizeClassAllocator();
+
+      void* alloc( size_t size );
+      void free( void *ptr );
+
+      // what ptr can actually hold - its class size, or what was asked for if it was large
+      size_t get_size( void const *ptr ) const;
+
+      static uint GetClass( size_t size );
+      static size_t GetClassSize( uint class_idx );
+
+   private:
+      void* alloc_large( size_t size );
+
+   public:
+      MagazineBlockAllocator *pools[SIZE_CLASS_COUNT];
+
+      uint large_count;          // live ones
+      uint64_t large_bytes;
+};
+
+/************************************************************************/
+/*                                                                      */
+/* FUNCTION PROTOTYPES                                                  */
+/*                                                                      */
+/************************************************************************/
+// The shared one - made on first use and never destroyed, so blocks can be freed
+// right up until the process goes away
+SizeClassAllocator* SizeClassGetGlobal();
+
+void* SizeClassAlloc( size_t size );
+void SizeClassFree( void *ptr );
+
+// Checks every size lands in the right class, then times a mixed size trace
+// against malloc on one thread and on several
+void SizeClassAllocatorTest();
+
+#endif
@@ -183,12 +183,12 @@ void ThreadSetNameInVisualStudio( char const *name )
 //------------------------------------------------------------------------
 // EXAMPLE CODE : LOGGER
 //------------------------------------------------------------------------
-#include "ts_queue.h"
+#include "mpmc_queue.h"
 #include "signal.h"
 #include "event.h"
 
 
-ThreadSafeQueue<std::string> gMessages;
+MPMCQueue<std::string> gMessages;
 
 thread_handle_t gLoggerThread = nullptr;
 bool gLoggerThreadRunning = true;
@@ -248,7 +248,7 @@ void LoggerThread( void* )
 void LogPrint( char const *msg ) 
 {
    gMessages.enqueue( msg );
-   gLogSignal.signal_all();
+   gLogSignal.signal_one();
 }
 
 //------------------------------------------------------------------------
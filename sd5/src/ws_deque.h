@@ -0,0 +1,232 @@
+#pragma once
+
+// Chase-Lev work stealing deque
+// The owning thread pushes and pops from the bottom (LIFO - keeps the cache warm)
+// while any other thread is allowed to steal from the top (FIFO - takes the oldest,
+// and likely largest, piece of work).
+//
+// Based on "Correct and Efficient Work-Stealing for Weak Memory Models" (Le, Pop, Cohen, Nardelli)
+
+/************************************************************************/
+/*                                                                      */
+/* INCLUDE                                                              */
+/*                                                                      */
+/************************************************************************/
+#include "common.h"
+
+#include <atomic>
+
+/************************************************************************/
+/*                                                                      */
+/* MACROS                                                               */
+/*                                                                      */
+/************************************************************************/
+
+/************************************************************************/
+/*                                                                      */
+/* TYPES                                                                */
+/*                                                                      */
+/************************************************************************/
+
+/************************************************************************/
+/*                                                                      */
+/* STRUCTS                                                              */
+/*                                                                      */
+/************************************************************************/
+
+/************************************************************************/
+/*                                                                      */
+/* CLASSES                                                              */
+/*                                                                      */
+/************************************************************************/
+
+//------------------------------------------------------------------------
+// T must be trivially copyable (in practice - a pointer)
+template <typename T>
+class WorkStealingDeque
+{
+   // circular buffer - only ever grows.  Old buffers are kept around until
+   // the deque is destroyed since a thief may still be reading from them.
+   struct array_t
+   {
+      int64_t size;  // always a power of two
+      int64_t mask;
+      std::atomic<T> *items;
+      array_t *prev;
+
+      T get( int64_t idx ) const                { return items[idx & mask].load( std::memory_order_relaxed ); }
+      void put( int64_t idx, T const &v )       { items[idx & mask].store( v, std::memory_order_relaxed ); }
+   };
+
+   public:
+      //------------------------------------------------------------------------
+      WorkStealingDeque( int64_t initial_size = 1024 )
+      {
+         top.store( 0, std::memory_order_relaxed );
+         bottom.store( 0, std::memory_order_relaxed );
+         array.store( create_array( initial_size, nullptr ), std::memory_order_relaxed );
+      }
+
+      //------------------------------------------------------------------------
+      ~WorkStealingDeque()
+      {
+         array_t *a = array.load( std::memory_order_relaxed );
+         while (nullptr != a) {
+            array_t *prev = a->prev;
+            delete[] a->items;
+            delete a;
+            a = prev;
+         }
+      }
+
+      //------------------------------------------------------------------------
+      // OWNER ONLY
+      void push( T const &v )
+      {
+         int64_t b = bottom.load( std::memory_order_relaxed );
+         int64_t t = top.load( std::memory_order_acquire );
+         array_t *a = array.load( std::memory_order_relaxed );
+
+         if ((b - t) > (a->size - 1)) {
+            a = grow( a, t, b );
+         }
+
+         a->put( b, v );
+         std::atomic_thread_fence( std::memory_order_release );
+         bottom.store( b + 1, std::memory_order_relaxed );
+      }
+
+      //------------------------------------------------------------------------
+      // OWNER ONLY - thieves see the whole lot at once
+      void push_batch( T const *v, uint count )
+      {
+         int64_t b = bottom.load( std::memory_order_relaxed );
+         int64_t t = top.load( std::memory_order_acquire );
+         array_t *a = array.load( std::memory_order_relaxed );
+
+         while ((b - t + (int64_t)count) > a->size) {
+            a = grow( a, t, b );
+         }
+
+         for (uint i = 0; i < count; ++i) {
+            a->put( b + i, v[i] );
+         }
+         std::atomic_thread_fence( std::memory_order_release );
+         bottom.store( b + count, std::memory_order_relaxed );
+      }
+
+      //------------------------------------------------------------------------
+      // OWNER ONLY
+      bool pop( T *out )
+      {
+         int64_t b = bottom.load( std::memory_order_relaxed ) - 1;
+         array_t *a = array.load( std::memory_order_relaxed );
+         bottom.store( b, std::memory_order_relaxed );
+         std::atomic_thread_fence( std::memory_order_seq_cst );
+         int64_t t = top.load( std::memory_order_relaxed );
+
+         if (t > b) {
+            // was empty - restore
+            bottom.store( b + 1, std::memory_order_relaxed );
+            return false;
+         }
+
+         *out = a->get(b);
+         if (t != b) {
+            // more than one item left - no thief can be racing us for this one.
+            return true;
+         }
+
+         // last item - race any thieves for it
+         bool won = top.compare_exchange_strong( t, t + 1, std::memory_order_seq_cst, std::memory_order_relaxed );
+         bottom.store( b + 1, std::memory_order_relaxed );
+         return won;
+      }
+
+      //------------------------------------------------------------------------
+      // ANY THREAD
+      bool steal( T *out )
+      {
+         int64_t t = top.load( std::memory_order_acquire );
+         std::atomic_thread_fence( std::memory_order_seq_cst );
+         int64_t b = bottom.load( std::memory_order_acquire );
+
+         if (t >= b) {
+            return false;
+         }
+
+         array_t *a = array.load( std::memory_order_acquire );
+         T v = a->get(t);
+         if (!top.compare_exchange_strong( t, t + 1, std::memory_order_seq_cst, std::memory_order_relaxed )) {
+            // lost to the owner or another thief
+            return false;
+         }
+
+         *out = v;
+         return true;
+      }
+
+      //------------------------------------------------------------------------
+      // approximate - only useful for heuristics
+      bool empty() const
+      {
+         int64_t b = bottom.load( std::memory_order_relaxed );
+         int64_t t = top.load( std::memory_order_relaxed );
+         return b <= t;
+      }
+
+      //------------------------------------------------------------------------
+      // approximate as well
+      uint size_approx() const
+      {
+         int64_t b = bottom.load( std::memory_order_relaxed );
+         int64_t t = top.load( std::memory_order_relaxed );
+         return (b > t) ? (uint)(b - t) : 0;
+      }
+
+   private:
+      //------------------------------------------------------------------------
+      static array_t* create_array( int64_t size, array_t *prev )
+      {
+         array_t *a = new array_t();
+         a->size = size;
+         a->mask = size - 1;
+         a->items = new std::atomic<T>[(size_t)size];
+         a->prev = prev;
+         return a;
+      }
+
+      //------------------------------------------------------------------------
+      array_t* grow( array_t *a, int64_t t, int64_t b )
+      {
+         array_t *new_array = create_array( a->size * 2, a );
+         for (int64_t i = t; i < b; ++i) {
+            new_array->put( i, a->get(i) );
+         }
+
+         array.store( new_array, std::memory_order_release );
+         return new_array;
+      }
+
+   public:
+      // top is written by thieves, bottom only by the owner - keep them
+      // on separate lines so pushes don't invalidate the thieves.
+      std::atomic<int64_t> top;
+      byte_t top_pad[CACHE_LINE_SIZE - sizeof(std::atomic<int64_t>)];
+
+      std::atomic<int64_t> bottom;
+      std::atomic<array_t*> array;
+      byte_t bottom_pad[CACHE_LINE_SIZE - sizeof(std::atomic<int64_t>) - sizeof(std::atomic<array_t*>)];
+};
+
+/************************************************************************/
+/*                                                                      */
+/* GLOBAL VARIABLES                                                     */
+/*                                                                      */
+/************************************************************************/
+
+/************************************************************************/
+/*                                                                      */
+/* FUNCTION PROTOTYPES                                                  */
+/*                                                                      */
+/************************************************************************/